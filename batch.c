@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Batch compilation, for --batch.
+ *
+ * Each line of the manifest is compiled as if it had been appended to the
+ * dtc command line, in a child process forked from this one.  Forking
+ * rather than running jobs on threads keeps the lexer, parser and check
+ * state of each job separate, while still saving the exec, option parsing
+ * and (with -C) include cache setup of a dtc process per job.
+ *
+ * Each job's diagnostics are collected and reported in manifest order
+ * once it finishes, so the output does not depend on -j.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "dtc.h"
+
+struct batch_job {
+	int lineno;
+	int argc;
+	char **argv;
+	pid_t pid;
+	FILE *err;		/* the job's stderr */
+	int status;
+	bool done;
+};
+
+static void add_arg(struct batch_job *job, char *arg)
+{
+	job->argv = xrealloc(job->argv, (job->argc + 2) * sizeof(*job->argv));
+	job->argv[job->argc++] = arg;
+	job->argv[job->argc] = NULL;
+}
+
+static struct batch_job *read_manifest(const char *manifest, int *njobs)
+{
+	struct batch_job *batch = NULL;
+	char *line = NULL, *p;
+	size_t size = 0;
+	int n = 0, lineno = 0;
+	FILE *f;
+
+	f = fopen(manifest, "r");
+	if (!f)
+		die("Couldn't open batch manifest %s: %s\n", manifest,
+		    strerror(errno));
+
+	while (getline(&line, &size, f) >= 0) {
+		struct batch_job *job;
+
+		lineno++;
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		if (!*p || (*p == '#'))
+			continue;
+
+		batch = xrealloc(batch, (n + 1) * sizeof(*batch));
+		job = &batch[n++];
+		memset(job, 0, sizeof(*job));
+		job->lineno = lineno;
+		add_arg(job, xstrdup("dtc"));
+
+		/* Arguments are separated by white space, with no quoting */
+		p = xstrdup(p);
+		while (*p) {
+			add_arg(job, p);
+			while (*p && !isspace((unsigned char)*p))
+				p++;
+			while (isspace((unsigned char)*p))
+				*p++ = '\0';
+		}
+	}
+
+	if (ferror(f))
+		die("Couldn't read batch manifest %s: %s\n", manifest,
+		    strerror(errno));
+	fclose(f);
+	free(line);
+
+	*njobs = n;
+	return batch;
+}
+
+static void start_job(struct batch_job *job, job_fn fn, void *data)
+{
+	job->err = tmpfile();
+	if (!job->err)
+		die("Couldn't create batch job output file: %s\n",
+		    strerror(errno));
+
+	/* Don't let the child write out anything we've buffered */
+	fflush(NULL);
+
+	job->pid = fork();
+	if (job->pid < 0)
+		die("Couldn't start batch job: %s\n", strerror(errno));
+
+	if (job->pid == 0) {
+		if (dup2(fileno(job->err), STDERR_FILENO) < 0)
+			die("Couldn't redirect batch job output: %s\n",
+			    strerror(errno));
+		fn(job->argc, job->argv, data);
+		exit(0);
+	}
+}
+
+/* Returns true if the job succeeded */
+static bool report_job(const char *manifest, struct batch_job *job)
+{
+	char buf[4096];
+	size_t n;
+
+	rewind(job->err);
+	while ((n = fread(buf, 1, sizeof(buf), job->err)) > 0)
+		fwrite(buf, 1, n, stderr);
+	fclose(job->err);
+
+	if (WIFSIGNALED(job->status))
+		fprintf(stderr, "%s:%d: Batch job killed by signal %d\n",
+			manifest, job->lineno, WTERMSIG(job->status));
+
+	return WIFEXITED(job->status) && (WEXITSTATUS(job->status) == 0);
+}
+
+int run_batch(const char *manifest, unsigned int maxjobs, job_fn fn,
+	      void *data)
+{
+	struct batch_job *batch;
+	int njobs, next = 0, reported = 0, i;
+	unsigned int running = 0;
+	bool ok = true;
+	pid_t pid;
+	int status;
+
+	batch = read_manifest(manifest, &njobs);
+
+	while (reported < njobs) {
+		while ((running < maxjobs) && (next < njobs)) {
+			start_job(&batch[next++], fn, data);
+			running++;
+		}
+
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0)
+			die("Couldn't wait for batch job: %s\n",
+			    strerror(errno));
+
+		for (i = reported; i < next; i++)
+			if (batch[i].pid == pid) {
+				batch[i].status = status;
+				batch[i].done = true;
+				running--;
+				break;
+			}
+
+		while ((reported < njobs) && batch[reported].done)
+			ok = report_job(manifest, &batch[reported++]) && ok;
+	}
+
+	return ok ? 0 : 1;
+}
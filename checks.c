@@ -3,6 +3,10 @@
  * (C) Copyright David Gibson <dwg@au1.ibm.com>, IBM Corporation.  2007.
  */
 
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
+
 #include "dtc.h"
 #include "srcpos.h"
 
@@ -28,18 +32,51 @@ struct check;
 
 typedef void (*check_fn)(struct check *c, struct dt_info *dti, struct node *node);
 
+enum fixuptype {
+	NO_FIXUP = 0,
+	FIXUP_ANNOTATE,		/* sets per-node state such as node->bus */
+	FIXUP_TREE,		/* adds or removes nodes or properties */
+};
+
+/*
+ * The nodes a check needs to visit.  Checks with a narrower scope than
+ * SCOPE_ALL are only called on the nodes which match, taken from an
+ * index of the tree built on first use.
+ */
+enum checkscope {
+	SCOPE_ALL = 0,		/* every node */
+	SCOPE_BUS,		/* nodes with node->bus == key */
+	SCOPE_CHILD_OF_BUS,	/* nodes with node->parent->bus == key */
+	SCOPE_PROPERTY,		/* nodes with a property named key */
+	SCOPE_COMPATIBLE,	/* nodes compatible with key */
+};
+
 struct check {
 	const char *name;
 	check_fn fn;
 	const void *data;
 	bool warn, error;
+	enum fixuptype fixup;	/* fixups are never run concurrently */
+	enum checkscope scope;
+	const void *scope_key;
 	enum checkstatus status;
 	bool inprogress;
 	int num_prereqs;
 	struct check **prereq;
+
+	/* State for running checks on worker threads (-j) */
+	bool queued, ran, buffered;
+	int queue_pos;
+	enum checkstatus result;
+	char *msgbuf;
+
+	/* Timing for -P, recorded wherever the check body runs */
+	int worker;		/* 0 for the main thread */
+	uint64_t start, end;
+	long maxrss;
 };
 
-#define CHECK_ENTRY(nm_, fn_, d_, w_, e_, ...)	       \
+#define CHECK_ENTRY(nm_, fn_, d_, w_, e_, f_, s_, k_, ...)	       \
 	static struct check *nm_##_prereqs[] = { __VA_ARGS__ }; \
 	static struct check nm_ = { \
 		.name = #nm_, \
@@ -47,16 +84,39 @@ struct check {
 		.data = (d_), \
 		.warn = (w_), \
 		.error = (e_), \
+		.fixup = (f_), \
+		.scope = (s_), \
+		.scope_key = (k_), \
 		.status = UNCHECKED, \
 		.num_prereqs = ARRAY_SIZE(nm_##_prereqs), \
 		.prereq = nm_##_prereqs, \
 	};
 #define WARNING(nm_, fn_, d_, ...) \
-	CHECK_ENTRY(nm_, fn_, d_, true, false, __VA_ARGS__)
+	CHECK_ENTRY(nm_, fn_, d_, true, false, NO_FIXUP, SCOPE_ALL, NULL, __VA_ARGS__)
 #define ERROR(nm_, fn_, d_, ...) \
-	CHECK_ENTRY(nm_, fn_, d_, false, true, __VA_ARGS__)
+	CHECK_ENTRY(nm_, fn_, d_, false, true, NO_FIXUP, SCOPE_ALL, NULL, __VA_ARGS__)
 #define CHECK(nm_, fn_, d_, ...) \
-	CHECK_ENTRY(nm_, fn_, d_, false, false, __VA_ARGS__)
+	CHECK_ENTRY(nm_, fn_, d_, false, false, NO_FIXUP, SCOPE_ALL, NULL, __VA_ARGS__)
+#define ANNOTATE_WARNING(nm_, fn_, d_, ...) \
+	CHECK_ENTRY(nm_, fn_, d_, true, false, FIXUP_ANNOTATE, SCOPE_ALL, NULL, __VA_ARGS__)
+#define FIXUP_ERROR(nm_, fn_, d_, ...) \
+	CHECK_ENTRY(nm_, fn_, d_, false, true, FIXUP_TREE, SCOPE_ALL, NULL, __VA_ARGS__)
+
+/*
+ * Scoped variants.  The scope_ argument is one of the helpers below,
+ * each of which expands to the scope type and its key.
+ */
+#define ON_BUS(bus_)		SCOPE_BUS, (bus_)
+#define CHILD_OF_BUS(bus_)	SCOPE_CHILD_OF_BUS, (bus_)
+#define WITH_PROPERTY(name_)	SCOPE_PROPERTY, (name_)
+#define WITH_COMPATIBLE(compat_)	SCOPE_COMPATIBLE, (compat_)
+
+#define SCOPED_WARNING(nm_, fn_, d_, scope_, ...) \
+	CHECK_ENTRY(nm_, fn_, d_, true, false, NO_FIXUP, scope_, __VA_ARGS__)
+#define SCOPED_ERROR(nm_, fn_, d_, scope_, ...) \
+	CHECK_ENTRY(nm_, fn_, d_, false, true, NO_FIXUP, scope_, __VA_ARGS__)
+#define SCOPED_ANNOTATE_WARNING(nm_, fn_, d_, scope_, ...) \
+	CHECK_ENTRY(nm_, fn_, d_, true, false, FIXUP_ANNOTATE, scope_, __VA_ARGS__)
 
 static inline void  PRINTF(5, 6) check_msg(struct check *c, struct dt_info *dti,
 					   struct node *node,
@@ -91,9 +151,9 @@ static inline void  PRINTF(5, 6) check_msg(struct check *c, struct dt_info *dti,
 
 	if (node) {
 		if (prop)
-			xasprintf_append(&str, "%s:%s: ", node->fullpath, prop->name);
+			xasprintf_append(&str, "%s:%s: ", get_node_path(node), prop->name);
 		else
-			xasprintf_append(&str, "%s: ", node->fullpath);
+			xasprintf_append(&str, "%s: ", get_node_path(node));
 	}
 
 	va_start(ap, fmt);
@@ -113,7 +173,10 @@ static inline void  PRINTF(5, 6) check_msg(struct check *c, struct dt_info *dti,
 		}
 	}
 
-	fputs(str, stderr);
+	if (c->buffered)
+		xasprintf_append(&c->msgbuf, "%s", str);
+	else
+		fputs(str, stderr);
 	free(str);
 }
 
@@ -136,7 +199,7 @@ static void check_nodes_props(struct check *c, struct dt_info *dti, struct node
 {
 	struct node *child;
 
-	TRACE(c, "%s", node->fullpath);
+	TRACE(c, "%s", get_node_path(node));
 	if (c->fn)
 		c->fn(c, dti, node);
 
@@ -144,6 +207,269 @@ static void check_nodes_props(struct check *c, struct dt_info *dti, struct node
 		check_nodes_props(c, dti, child);
 }
 
+/*
+ * Index of the nodes matching each scope, in tree order.  Property
+ * names and compatible strings only change under FIXUP_TREE checks,
+ * while node->bus may be set by any fixup, so the two halves of the
+ * index are invalidated separately.
+ */
+struct node_list {
+	struct node **nodes;
+	int n, size;
+};
+
+struct scope_entry {
+	const char *key;
+	struct node_list list;
+};
+
+struct scope_table {
+	struct hashtab h;		/* of struct scope_entry */
+	bool interned;			/* keys are interned names */
+};
+
+struct bus_entry {
+	const struct bus_type *bus;
+	struct node_list on_bus, children;
+};
+
+static struct scope_index {
+	bool names_valid, bus_valid;
+	struct scope_table props, compats;
+	struct bus_entry *buses;
+	int num_buses;
+} scope_index = {
+	.props.interned = true,
+};
+
+static void node_list_add(struct node_list *l, struct node *node)
+{
+	/* A node is only listed once, even if it matches repeatedly */
+	if (l->n && (l->nodes[l->n - 1] == node))
+		return;
+
+	if (l->n == l->size) {
+		l->size = l->size ? 2 * l->size : 8;
+		l->nodes = xrealloc(l->nodes, l->size * sizeof(*l->nodes));
+	}
+	l->nodes[l->n++] = node;
+}
+
+static bool scope_key_matches(const void *slot, const void *key)
+{
+	return streq(((const struct scope_entry *)slot)->key, key);
+}
+
+static bool scope_name_matches(const void *slot, const void *key)
+{
+	return ((const struct scope_entry *)slot)->key == key;
+}
+
+static struct scope_entry *scope_table_find(struct scope_table *t,
+					    const char *key, uint32_t *hash)
+{
+	if (t->interned) {
+		*hash = name_hash(key);
+		return hashtab_find(&t->h, *hash, scope_name_matches, key);
+	}
+
+	*hash = fnv1a_hash(key, strlen(key), FNV1A_SEED);
+	return hashtab_find(&t->h, *hash, scope_key_matches, key);
+}
+
+static struct node_list *scope_table_lookup(struct scope_table *t,
+					    const char *key)
+{
+	struct scope_entry *e;
+	uint32_t hash;
+
+	if (!key)
+		return NULL;
+
+	e = scope_table_find(t, key, &hash);
+	return e ? &e->list : NULL;
+}
+
+static void scope_table_add(struct scope_table *t, const char *key,
+			    struct node *node)
+{
+	struct scope_entry *e;
+	uint32_t hash;
+
+	e = scope_table_find(t, key, &hash);
+	if (!e) {
+		e = hashtab_add(&t->h, sizeof(*e), hash);
+		e->key = key;
+	}
+	node_list_add(&e->list, node);
+}
+
+static void scope_table_free(struct scope_table *t)
+{
+	struct scope_entry *e;
+	unsigned int i;
+
+	for (i = 0; i < t->h.size; i++)
+		if ((e = hashtab_slot(&t->h, i)))
+			free(e->list.nodes);
+	hashtab_free(&t->h);
+}
+
+static void index_node_names(struct scope_index *si, struct node *node)
+{
+	struct property *prop;
+	struct node *child;
+
+	for_each_property(node, prop) {
+		scope_table_add(&si->props, prop->name, node);
+
+		if (streq(prop->name, "compatible")) {
+			const char *str = prop->val.val;
+			const char *end = str + prop->val.len;
+
+			for (; str < end; str += strnlen(str, end - str) + 1)
+				if (strnlen(str, end - str) < (size_t)(end - str))
+					scope_table_add(&si->compats, str, node);
+		}
+	}
+
+	for_each_child(node, child)
+		index_node_names(si, child);
+}
+
+static struct bus_entry *bus_entry(struct scope_index *si,
+				   const struct bus_type *bus)
+{
+	int i;
+
+	for (i = 0; i < si->num_buses; i++)
+		if (si->buses[i].bus == bus)
+			return &si->buses[i];
+
+	si->buses = xrealloc(si->buses, (si->num_buses + 1) * sizeof(*si->buses));
+	memset(&si->buses[i], 0, sizeof(si->buses[i]));
+	si->buses[i].bus = bus;
+	si->num_buses++;
+	return &si->buses[i];
+}
+
+static void index_node_buses(struct scope_index *si, struct node *node)
+{
+	struct node *child;
+
+	if (node->bus)
+		node_list_add(&bus_entry(si, node->bus)->on_bus, node);
+	if (node->parent && node->parent->bus)
+		node_list_add(&bus_entry(si, node->parent->bus)->children, node);
+
+	for_each_child(node, child)
+		index_node_buses(si, child);
+}
+
+static void scope_index_invalidate(struct scope_index *si, enum fixuptype fixup)
+{
+	int i;
+
+	if (fixup == NO_FIXUP)
+		return;
+
+	if (fixup == FIXUP_TREE) {
+		scope_table_free(&si->props);
+		scope_table_free(&si->compats);
+		si->names_valid = false;
+	}
+
+	for (i = 0; i < si->num_buses; i++) {
+		free(si->buses[i].on_bus.nodes);
+		free(si->buses[i].children.nodes);
+	}
+	free(si->buses);
+	si->buses = NULL;
+	si->num_buses = 0;
+	si->bus_valid = false;
+}
+
+/* Make sure the index covers the scope of check c */
+static void scope_index_update(struct scope_index *si, struct check *c,
+			       struct dt_info *dti)
+{
+	switch (c->scope) {
+	case SCOPE_ALL:
+		break;
+
+	case SCOPE_PROPERTY:
+	case SCOPE_COMPATIBLE:
+		if (!si->names_valid) {
+			index_node_names(si, dti->dt);
+			si->names_valid = true;
+		}
+		break;
+
+	case SCOPE_BUS:
+	case SCOPE_CHILD_OF_BUS:
+		if (!si->bus_valid) {
+			index_node_buses(si, dti->dt);
+			si->bus_valid = true;
+		}
+		break;
+	}
+}
+
+static struct node_list *scope_nodes(struct scope_index *si, struct check *c)
+{
+	int i;
+
+	switch (c->scope) {
+	case SCOPE_PROPERTY:
+		return scope_table_lookup(&si->props,
+					  name_lookup(c->scope_key));
+
+	case SCOPE_COMPATIBLE:
+		return scope_table_lookup(&si->compats, c->scope_key);
+
+	case SCOPE_BUS:
+	case SCOPE_CHILD_OF_BUS:
+		for (i = 0; i < si->num_buses; i++)
+			if (si->buses[i].bus == c->scope_key)
+				return (c->scope == SCOPE_BUS) ?
+					&si->buses[i].on_bus :
+					&si->buses[i].children;
+		return NULL;
+
+	default:
+		assert(0);
+		return NULL;
+	}
+}
+
+static void run_check_nodes(struct check *c, struct dt_info *dti)
+{
+	struct node_list *l;
+	int i;
+
+	if (stats_enabled)
+		c->start = stats_now();
+
+	if (c->scope == SCOPE_ALL) {
+		check_nodes_props(c, dti, dti->dt);
+	} else {
+		scope_index_update(&scope_index, c, dti);
+		l = scope_nodes(&scope_index, c);
+		for (i = 0; l && (i < l->n); i++) {
+			TRACE(c, "%s", get_node_path(l->nodes[i]));
+			if (c->fn)
+				c->fn(c, dti, l->nodes[i]);
+		}
+	}
+
+	scope_index_invalidate(&scope_index, c->fixup);
+
+	if (stats_enabled) {
+		c->end = stats_now();
+		c->maxrss = stats_maxrss();
+	}
+}
+
 static bool is_multiple_of(int multiple, int divisor)
 {
 	if (divisor == 0)
@@ -154,7 +480,6 @@ static bool is_multiple_of(int multiple, int divisor)
 
 static bool run_check(struct check *c, struct dt_info *dti)
 {
-	struct node *dt = dti->dt;
 	bool error = false;
 	int i;
 
@@ -178,7 +503,16 @@ static bool run_check(struct check *c, struct dt_info *dti)
 	if (c->status != UNCHECKED)
 		goto out;
 
-	check_nodes_props(c, dti, dt);
+	if (c->ran) {
+		/* Already run on a worker thread, replay its result */
+		if (c->msgbuf)
+			fputs(c->msgbuf, stderr);
+		free(c->msgbuf);
+		c->msgbuf = NULL;
+		c->status = c->result;
+	} else {
+		run_check_nodes(c, dti);
+	}
 
 	if (c->status == UNCHECKED)
 		c->status = PASSED;
@@ -218,9 +552,9 @@ static void check_is_string(struct check *c, struct dt_info *dti,
 		FAIL_PROP(c, dti, node, prop, "property is not a string");
 }
 #define WARNING_IF_NOT_STRING(nm, propname) \
-	WARNING(nm, check_is_string, (propname))
+	SCOPED_WARNING(nm, check_is_string, (propname), WITH_PROPERTY(propname))
 #define ERROR_IF_NOT_STRING(nm, propname) \
-	ERROR(nm, check_is_string, (propname))
+	SCOPED_ERROR(nm, check_is_string, (propname), WITH_PROPERTY(propname))
 
 static void check_is_string_list(struct check *c, struct dt_info *dti,
 				 struct node *node)
@@ -247,9 +581,9 @@ static void check_is_string_list(struct check *c, struct dt_info *dti,
 	}
 }
 #define WARNING_IF_NOT_STRING_LIST(nm, propname) \
-	WARNING(nm, check_is_string_list, (propname))
+	SCOPED_WARNING(nm, check_is_string_list, (propname), WITH_PROPERTY(propname))
 #define ERROR_IF_NOT_STRING_LIST(nm, propname) \
-	ERROR(nm, check_is_string_list, (propname))
+	SCOPED_ERROR(nm, check_is_string_list, (propname), WITH_PROPERTY(propname))
 
 static void check_is_cell(struct check *c, struct dt_info *dti,
 			  struct node *node)
@@ -265,41 +599,133 @@ static void check_is_cell(struct check *c, struct dt_info *dti,
 		FAIL_PROP(c, dti, node, prop, "property is not a single cell");
 }
 #define WARNING_IF_NOT_CELL(nm, propname) \
-	WARNING(nm, check_is_cell, (propname))
+	SCOPED_WARNING(nm, check_is_cell, (propname), WITH_PROPERTY(propname))
 #define ERROR_IF_NOT_CELL(nm, propname) \
-	ERROR(nm, check_is_cell, (propname))
+	SCOPED_ERROR(nm, check_is_cell, (propname), WITH_PROPERTY(propname))
 
 /*
  * Structural check functions
  */
 
+/*
+ * Siblings sorted by name, so that those with the same name are together
+ * and otherwise in their original order.  Sorting finds every pair of
+ * siblings with the same name without comparing each pair, which is
+ * quadratic in the number of siblings.
+ */
+struct sibling {
+	const char *name;
+	int index;		/* position among the siblings */
+	int group;		/* sorted position of the first of its name */
+	void *p;
+};
+
+static int cmp_sibling(const void *ax, const void *bx)
+{
+	const struct sibling *a = ax, *b = bx;
+	int rc;
+
+	rc = strcmp(a->name, b->name);
+	if (rc)
+		return rc;
+
+	return a->index - b->index;
+}
+
+/* Sorts the n siblings, and returns where each index ended up */
+static int *sort_siblings(struct sibling *s, int n)
+{
+	int *pos = xmalloc(n * sizeof(*pos));
+	int i;
+
+	qsort(s, n, sizeof(*s), cmp_sibling);
+
+	for (i = 0; i < n; i++) {
+		pos[s[i].index] = i;
+		if ((i > 0) && streq(s[i].name, s[i - 1].name))
+			s[i].group = s[i - 1].group;
+		else
+			s[i].group = i;
+	}
+
+	return pos;
+}
+
+static void add_sibling(struct sibling *s, int *n, const char *name, void *p)
+{
+	s[*n].name = name;
+	s[*n].index = *n;
+	s[*n].p = p;
+	(*n)++;
+}
+
 static void check_duplicate_node_names(struct check *c, struct dt_info *dti,
 				       struct node *node)
 {
-	struct node *child, *child2;
+	struct node *child;
+	struct sibling *s;
+	int *pos;
+	int n = 0, i, j;
 
-	for_each_child(node, child)
-		for (child2 = child->next_sibling;
-		     child2;
-		     child2 = child2->next_sibling)
-			if (streq(child->name, child2->name))
-				FAIL(c, dti, child2, "Duplicate node name");
+	for_each_child_withdel(node, child)
+		n++;
+	if (n < 2)
+		return;
+
+	s = xmalloc(n * sizeof(*s));
+	n = 0;
+	for_each_child_withdel(node, child)
+		add_sibling(s, &n, child->name, child);
+	pos = sort_siblings(s, n);
+
+	/*
+	 * Each node is reported once for every node of the same name before
+	 * it which is not itself deleted.
+	 */
+	for (i = 0; i < n; i++) {
+		struct sibling *a = &s[pos[i]];
+
+		if (((struct node *)a->p)->deleted)
+			continue;
+
+		for (j = pos[i] + 1; (j < n) && (s[j].group == a->group); j++)
+			FAIL(c, dti, s[j].p, "Duplicate node name");
+	}
+
+	free(pos);
+	free(s);
 }
 ERROR(duplicate_node_names, check_duplicate_node_names, NULL);
 
 static void check_duplicate_property_names(struct check *c, struct dt_info *dti,
 					   struct node *node)
 {
-	struct property *prop, *prop2;
+	struct property *prop;
+	struct sibling *s;
+	int *pos;
+	int n = 0, i, j;
 
-	for_each_property(node, prop) {
-		for (prop2 = prop->next; prop2; prop2 = prop2->next) {
-			if (prop2->deleted)
-				continue;
-			if (streq(prop->name, prop2->name))
-				FAIL_PROP(c, dti, node, prop, "Duplicate property name");
-		}
+	for_each_property(node, prop)
+		n++;
+	if (n < 2)
+		return;
+
+	s = xmalloc(n * sizeof(*s));
+	n = 0;
+	for_each_property(node, prop)
+		add_sibling(s, &n, prop->name, prop);
+	pos = sort_siblings(s, n);
+
+	/* Each property is reported for every property after it of the same name */
+	for (i = 0; i < n; i++) {
+		struct sibling *a = &s[pos[i]];
+
+		for (j = pos[i] + 1; (j < n) && (s[j].group == a->group); j++)
+			FAIL_PROP(c, dti, node, a->p, "Duplicate property name");
 	}
+
+	free(pos);
+	free(s);
 }
 ERROR(duplicate_property_names, check_duplicate_property_names, NULL);
 
@@ -326,7 +752,7 @@ static void check_node_name_chars_strict(struct check *c, struct dt_info *dti,
 {
 	size_t n = strspn(node->name, c->data);
 
-	if (n < node->basenamelen)
+	if (n < node_basenamelen(node))
 		FAIL(c, dti, node, "Character '%c' not recommended in node name",
 		     node->name[n]);
 }
@@ -343,7 +769,7 @@ ERROR(node_name_format, check_node_name_format, NULL, &node_name_chars);
 static void check_node_name_not_empty(struct check *c, struct dt_info *dti,
 				      struct node *node)
 {
-	if (node->basenamelen == 0 && node->parent != NULL)
+	if (node_basenamelen(node) == 0 && node->parent != NULL)
 		FAIL(c, dti, node, "Empty node name");
 }
 ERROR(node_name_not_empty, check_node_name_not_empty, NULL, &node_name_chars);
@@ -441,53 +867,140 @@ CHECK(property_name_chars_strict, check_property_name_chars_strict, PROPNODECHAR
 	((mark) ? "value of " : ""),		\
 	((prop) ? "'" : ""), \
 	((prop) ? (prop)->name : ""), \
-	((prop) ? "' in " : ""), (node)->fullpath
+	((prop) ? "' in " : ""), get_node_path(node)
 
-static void check_duplicate_label(struct check *c, struct dt_info *dti,
-				  const char *label, struct node *node,
-				  struct property *prop, struct marker *mark)
+/*
+ * The first place each label is defined, in the order get_node_by_label(),
+ * then get_property_by_label(), then get_marker_label() would find it.
+ * Every other definition of the label is a duplicate of this one.
+ */
+enum label_rank {
+	LABEL_ON_NODE,
+	LABEL_ON_PROP,
+	LABEL_IN_VALUE,
+};
+
+struct label_owner {
+	const char *label;
+	enum label_rank rank;
+	struct node *node;
+	struct property *prop;
+	struct marker *mark;
+};
+
+static bool label_matches(const void *slot, const void *key)
 {
-	struct node *dt = dti->dt;
-	struct node *othernode = NULL;
-	struct property *otherprop = NULL;
-	struct marker *othermark = NULL;
+	return streq(((const struct label_owner *)slot)->label, key);
+}
 
-	othernode = get_node_by_label(dt, label);
+static struct label_owner *label_table_find(struct hashtab *t,
+					    const char *label)
+{
+	return hashtab_find(t, fnv1a_hash(label, strlen(label), FNV1A_SEED),
+			    label_matches, label);
+}
 
-	if (!othernode)
-		otherprop = get_property_by_label(dt, label, &othernode);
-	if (!othernode)
-		othermark = get_marker_label(dt, label, &othernode,
-					       &otherprop);
+static void label_table_add(struct hashtab *t, const char *label,
+			    enum label_rank rank, struct node *node,
+			    struct property *prop, struct marker *mark)
+{
+	struct label_owner *o;
 
-	if (!othernode)
+	/* The tree is walked in order, so only a lower rank displaces */
+	o = label_table_find(t, label);
+	if (o && (o->rank <= rank))
 		return;
+	if (!o)
+		o = hashtab_add(t, sizeof(*o),
+				fnv1a_hash(label, strlen(label), FNV1A_SEED));
+
+	o->label = label;
+	o->rank = rank;
+	o->node = node;
+	o->prop = prop;
+	o->mark = mark;
+}
 
-	if ((othernode != node) || (otherprop != prop) || (othermark != mark))
+static void collect_labels(struct hashtab *t, struct node *node)
+{
+	struct property *prop;
+	struct node *child;
+	struct label *l;
+
+	for_each_label(node->labels, l)
+		label_table_add(t, l->label, LABEL_ON_NODE, node, NULL, NULL);
+
+	for_each_property(node, prop) {
+		struct marker *m;
+
+		for_each_label(prop->labels, l)
+			label_table_add(t, l->label, LABEL_ON_PROP, node, prop,
+					NULL);
+
+		for_each_marker_of_type(prop->val, m, LABEL)
+			label_table_add(t, m->ref, LABEL_IN_VALUE, node, prop, m);
+	}
+
+	for_each_child(node, child)
+		collect_labels(t, child);
+}
+
+static void check_duplicate_label(struct check *c, struct dt_info *dti,
+				  struct hashtab *t, const char *label,
+				  struct node *node, struct property *prop,
+				  struct marker *mark)
+{
+	struct label_owner *o = label_table_find(t, label);
+
+	if ((o->node != node) || (o->prop != prop) || (o->mark != mark))
 		FAIL(c, dti, node, "Duplicate label '%s' on " DESCLABEL_FMT
 		     " and " DESCLABEL_FMT,
 		     label, DESCLABEL_ARGS(node, prop, mark),
-		     DESCLABEL_ARGS(othernode, otherprop, othermark));
+		     DESCLABEL_ARGS(o->node, o->prop, o->mark));
 }
 
-static void check_duplicate_label_node(struct check *c, struct dt_info *dti,
-				       struct node *node)
+static void check_duplicate_labels(struct check *c, struct dt_info *dti,
+				   struct hashtab *t, struct node *node)
 {
-	struct label *l;
 	struct property *prop;
+	struct node *child;
+	struct label *l;
 
 	for_each_label(node->labels, l)
-		check_duplicate_label(c, dti, l->label, node, NULL, NULL);
+		check_duplicate_label(c, dti, t, l->label, node, NULL, NULL);
 
 	for_each_property(node, prop) {
-		struct marker *m = prop->val.markers;
+		struct marker *m;
 
 		for_each_label(prop->labels, l)
-			check_duplicate_label(c, dti, l->label, node, prop, NULL);
+			check_duplicate_label(c, dti, t, l->label, node, prop,
+					      NULL);
 
-		for_each_marker_of_type(m, LABEL)
-			check_duplicate_label(c, dti, m->ref, node, prop, m);
+		for_each_marker_of_type(prop->val, m, LABEL)
+			check_duplicate_label(c, dti, t, m->ref, node, prop, m);
 	}
+
+	for_each_child(node, child)
+		check_duplicate_labels(c, dti, t, child);
+}
+
+/*
+ * Labels are checked all at once from the root, with one walk to find
+ * where each is first defined and another to report the rest, rather
+ * than searching the whole tree for every label.
+ */
+static void check_duplicate_label_node(struct check *c, struct dt_info *dti,
+				       struct node *node)
+{
+	struct hashtab t = {0};
+
+	if (node->parent)
+		return;
+
+	collect_labels(&t, node);
+	if (t.count)
+		check_duplicate_labels(c, dti, &t, node);
+	hashtab_free(&t);
 }
 ERROR(duplicate_label, check_duplicate_label_node, NULL);
 
@@ -509,8 +1022,7 @@ static cell_t check_phandle_prop(struct check *c, struct dt_info *dti,
 		return 0;
 	}
 
-	m = prop->val.markers;
-	for_each_marker_of_type(m, REF_PHANDLE) {
+	for_each_marker_of_type(prop->val, m, REF_PHANDLE) {
 		assert(m->offset == 0);
 		if (node != get_node_by_ref(root, m->ref))
 			/* "Set this node's phandle equal to some
@@ -566,13 +1078,13 @@ static void check_explicit_phandles(struct check *c, struct dt_info *dti,
 	other = get_node_by_phandle(root, phandle);
 	if (other && (other != node)) {
 		FAIL(c, dti, node, "duplicated phandle 0x%x (seen before at %s)",
-		     phandle, other->fullpath);
+		     phandle, get_node_path(other));
 		return;
 	}
 
 	node->phandle = phandle;
 }
-ERROR(explicit_phandles, check_explicit_phandles, NULL);
+FIXUP_ERROR(explicit_phandles, check_explicit_phandles, NULL);
 
 static void check_name_properties(struct check *c, struct dt_info *dti,
 				  struct node *node)
@@ -588,21 +1100,21 @@ static void check_name_properties(struct check *c, struct dt_info *dti,
 	if (!prop)
 		return; /* No name property, that's fine */
 
-	if ((prop->val.len != node->basenamelen + 1U)
-	    || (memcmp(prop->val.val, node->name, node->basenamelen) != 0)) {
+	if ((prop->val.len != node_basenamelen(node) + 1U)
+	    || (memcmp(prop->val.val, node->name, node_basenamelen(node)) != 0)) {
 		FAIL(c, dti, node, "\"name\" property is incorrect (\"%s\" instead"
 		     " of base node name)", prop->val.val);
 	} else {
 		/* The name property is correct, and therefore redundant.
-		 * Delete it */
+		 * Delete it.  Its name is interned, and interned names
+		 * must never be freed. */
 		*pp = prop->next;
-		free(prop->name);
 		data_free(prop->val);
 		free(prop);
 	}
 }
 ERROR_IF_NOT_STRING(name_is_string, "name");
-ERROR(name_properties, check_name_properties, NULL, &name_is_string);
+FIXUP_ERROR(name_properties, check_name_properties, NULL, &name_is_string);
 
 /*
  * Reference fixup functions
@@ -615,11 +1127,11 @@ static void fixup_phandle_references(struct check *c, struct dt_info *dti,
 	struct property *prop;
 
 	for_each_property(node, prop) {
-		struct marker *m = prop->val.markers;
+		struct marker *m;
 		struct node *refnode;
 		cell_t phandle;
 
-		for_each_marker_of_type(m, REF_PHANDLE) {
+		for_each_marker_of_type(prop->val, m, REF_PHANDLE) {
 			assert(m->offset + sizeof(cell_t) <= prop->val.len);
 
 			refnode = get_node_by_ref(dt, m->ref);
@@ -640,7 +1152,7 @@ static void fixup_phandle_references(struct check *c, struct dt_info *dti,
 		}
 	}
 }
-ERROR(phandle_references, fixup_phandle_references, NULL,
+FIXUP_ERROR(phandle_references, fixup_phandle_references, NULL,
       &duplicate_node_names, &explicit_phandles);
 
 static void fixup_path_references(struct check *c, struct dt_info *dti,
@@ -650,11 +1162,11 @@ static void fixup_path_references(struct check *c, struct dt_info *dti,
 	struct property *prop;
 
 	for_each_property(node, prop) {
-		struct marker *m = prop->val.markers;
+		struct marker *m;
 		struct node *refnode;
-		char *path;
+		const char *path;
 
-		for_each_marker_of_type(m, REF_PATH) {
+		for_each_marker_of_type(prop->val, m, REF_PATH) {
 			assert(m->offset <= prop->val.len);
 
 			refnode = get_node_by_ref(dt, m->ref);
@@ -664,7 +1176,7 @@ static void fixup_path_references(struct check *c, struct dt_info *dti,
 				continue;
 			}
 
-			path = refnode->fullpath;
+			path = get_node_path(refnode);
 			prop->val = data_insert_at_marker(prop->val, m, path,
 							  strlen(path) + 1);
 
@@ -672,7 +1184,7 @@ static void fixup_path_references(struct check *c, struct dt_info *dti,
 		}
 	}
 }
-ERROR(path_references, fixup_path_references, NULL, &duplicate_node_names);
+FIXUP_ERROR(path_references, fixup_path_references, NULL, &duplicate_node_names);
 
 static void fixup_omit_unused_nodes(struct check *c, struct dt_info *dti,
 				    struct node *node)
@@ -682,7 +1194,7 @@ static void fixup_omit_unused_nodes(struct check *c, struct dt_info *dti,
 	if (node->omit_if_unused && !node->is_referenced)
 		delete_node(node);
 }
-ERROR(omit_unused_nodes, fixup_omit_unused_nodes, NULL, &phandle_references, &path_references);
+FIXUP_ERROR(omit_unused_nodes, fixup_omit_unused_nodes, NULL, &phandle_references, &path_references);
 
 /*
  * Semantic checks
@@ -756,7 +1268,7 @@ static void fixup_addr_size_cells(struct check *c, struct dt_info *dti,
 	if (prop)
 		node->size_cells = propval_cell(prop);
 }
-WARNING(addr_size_cells, fixup_addr_size_cells, NULL,
+ANNOTATE_WARNING(addr_size_cells, fixup_addr_size_cells, NULL,
 	&address_cells_is_cell, &size_cells_is_cell);
 
 #define node_addr_cells(n) \
@@ -820,12 +1332,12 @@ static void check_ranges_format(struct check *c, struct dt_info *dti,
 		if (p_addr_cells != c_addr_cells)
 			FAIL_PROP(c, dti, node, prop, "empty \"%s\" property but its "
 				  "#address-cells (%d) differs from %s (%d)",
-				  ranges, c_addr_cells, node->parent->fullpath,
+				  ranges, c_addr_cells, get_node_path(node->parent),
 				  p_addr_cells);
 		if (p_size_cells != c_size_cells)
 			FAIL_PROP(c, dti, node, prop, "empty \"%s\" property but its "
 				  "#size-cells (%d) differs from %s (%d)",
-				  ranges, c_size_cells, node->parent->fullpath,
+				  ranges, c_size_cells, get_node_path(node->parent),
 				  p_size_cells);
 	} else if (!is_multiple_of(prop->val.len, entrylen)) {
 		FAIL_PROP(c, dti, node, prop, "\"%s\" property has invalid length (%d bytes) "
@@ -852,8 +1364,8 @@ static void check_pci_bridge(struct check *c, struct dt_info *dti, struct node *
 
 	node->bus = &pci_bus;
 
-	if (!strprefixeq(node->name, node->basenamelen, "pci") &&
-	    !strprefixeq(node->name, node->basenamelen, "pcie"))
+	if (!strprefixeq(node->name, node_basenamelen(node), "pci") &&
+	    !strprefixeq(node->name, node_basenamelen(node), "pcie"))
 		FAIL(c, dti, node, "node name is not \"pci\" or \"pcie\"");
 
 	prop = get_property(node, "ranges");
@@ -879,8 +1391,8 @@ static void check_pci_bridge(struct check *c, struct dt_info *dti, struct node *
 	if (fdt32_to_cpu(cells[1]) > 0xff)
 		FAIL_PROP(c, dti, node, prop, "maximum bus number must be less than 256");
 }
-WARNING(pci_bridge, check_pci_bridge, NULL,
-	&device_type_is_string, &addr_size_cells);
+SCOPED_ANNOTATE_WARNING(pci_bridge, check_pci_bridge, NULL,
+	WITH_PROPERTY("device_type"), &device_type_is_string, &addr_size_cells);
 
 static void check_pci_device_bus_num(struct check *c, struct dt_info *dti, struct node *node)
 {
@@ -888,9 +1400,6 @@ static void check_pci_device_bus_num(struct check *c, struct dt_info *dti, struc
 	unsigned int bus_num, min_bus, max_bus;
 	cell_t *cells;
 
-	if (!node->parent || (node->parent->bus != &pci_bus))
-		return;
-
 	prop = get_property(node, "reg");
 	if (!prop)
 		return;
@@ -910,7 +1419,8 @@ static void check_pci_device_bus_num(struct check *c, struct dt_info *dti, struc
 		FAIL_PROP(c, dti, node, prop, "PCI bus number %d out of range, expected (%d - %d)",
 			  bus_num, min_bus, max_bus);
 }
-WARNING(pci_device_bus_num, check_pci_device_bus_num, NULL, &reg_format, &pci_bridge);
+SCOPED_WARNING(pci_device_bus_num, check_pci_device_bus_num, NULL,
+	CHILD_OF_BUS(&pci_bus), &reg_format, &pci_bridge);
 
 static void check_pci_device_reg(struct check *c, struct dt_info *dti, struct node *node)
 {
@@ -920,9 +1430,6 @@ static void check_pci_device_reg(struct check *c, struct dt_info *dti, struct no
 	unsigned int dev, func, reg;
 	cell_t *cells;
 
-	if (!node->parent || (node->parent->bus != &pci_bus))
-		return;
-
 	prop = get_property(node, "reg");
 	if (!prop)
 		return;
@@ -953,36 +1460,19 @@ static void check_pci_device_reg(struct check *c, struct dt_info *dti, struct no
 	FAIL(c, dti, node, "PCI unit address format error, expected \"%s\"",
 	     unit_addr);
 }
-WARNING(pci_device_reg, check_pci_device_reg, NULL, &reg_format, &pci_bridge);
+SCOPED_WARNING(pci_device_reg, check_pci_device_reg, NULL,
+	CHILD_OF_BUS(&pci_bus), &reg_format, &pci_bridge);
 
 static const struct bus_type simple_bus = {
 	.name = "simple-bus",
 };
 
-static bool node_is_compatible(struct node *node, const char *compat)
-{
-	struct property *prop;
-	const char *str, *end;
-
-	prop = get_property(node, "compatible");
-	if (!prop)
-		return false;
-
-	for (str = prop->val.val, end = str + prop->val.len; str < end;
-	     str += strnlen(str, end - str) + 1) {
-		if (streq(str, compat))
-			return true;
-	}
-	return false;
-}
-
 static void check_simple_bus_bridge(struct check *c, struct dt_info *dti, struct node *node)
 {
-	if (node_is_compatible(node, "simple-bus"))
-		node->bus = &simple_bus;
+	node->bus = &simple_bus;
 }
-WARNING(simple_bus_bridge, check_simple_bus_bridge, NULL,
-	&addr_size_cells, &compatible_is_string_list);
+SCOPED_ANNOTATE_WARNING(simple_bus_bridge, check_simple_bus_bridge, NULL,
+	WITH_COMPATIBLE("simple-bus"), &addr_size_cells, &compatible_is_string_list);
 
 static void check_simple_bus_reg(struct check *c, struct dt_info *dti, struct node *node)
 {
@@ -993,9 +1483,6 @@ static void check_simple_bus_reg(struct check *c, struct dt_info *dti, struct no
 	uint64_t reg = 0;
 	cell_t *cells = NULL;
 
-	if (!node->parent || (node->parent->bus != &simple_bus))
-		return;
-
 	prop = get_property(node, "reg");
 	if (prop)
 		cells = (cell_t *)prop->val.val;
@@ -1021,7 +1508,8 @@ static void check_simple_bus_reg(struct check *c, struct dt_info *dti, struct no
 		FAIL(c, dti, node, "simple-bus unit address format error, expected \"%s\"",
 		     unit_addr);
 }
-WARNING(simple_bus_reg, check_simple_bus_reg, NULL, &reg_format, &simple_bus_bridge);
+SCOPED_WARNING(simple_bus_reg, check_simple_bus_reg, NULL,
+	CHILD_OF_BUS(&simple_bus), &reg_format, &simple_bus_bridge);
 
 static const struct bus_type i2c_bus = {
 	.name = "i2c-bus",
@@ -1029,13 +1517,13 @@ static const struct bus_type i2c_bus = {
 
 static void check_i2c_bus_bridge(struct check *c, struct dt_info *dti, struct node *node)
 {
-	if (strprefixeq(node->name, node->basenamelen, "i2c-bus") ||
-	    strprefixeq(node->name, node->basenamelen, "i2c-arb")) {
+	if (strprefixeq(node->name, node_basenamelen(node), "i2c-bus") ||
+	    strprefixeq(node->name, node_basenamelen(node), "i2c-arb")) {
 		node->bus = &i2c_bus;
-	} else if (strprefixeq(node->name, node->basenamelen, "i2c")) {
+	} else if (strprefixeq(node->name, node_basenamelen(node), "i2c")) {
 		struct node *child;
 		for_each_child(node, child) {
-			if (strprefixeq(child->name, child->basenamelen, "i2c-bus"))
+			if (strprefixeq(child->name, node_basenamelen(child), "i2c-bus"))
 				return;
 		}
 		node->bus = &i2c_bus;
@@ -1051,7 +1539,7 @@ static void check_i2c_bus_bridge(struct check *c, struct dt_info *dti, struct no
 		FAIL(c, dti, node, "incorrect #size-cells for I2C bus");
 
 }
-WARNING(i2c_bus_bridge, check_i2c_bus_bridge, NULL, &addr_size_cells);
+ANNOTATE_WARNING(i2c_bus_bridge, check_i2c_bus_bridge, NULL, &addr_size_cells);
 
 #define I2C_OWN_SLAVE_ADDRESS	(1U << 30)
 #define I2C_TEN_BIT_ADDRESS	(1U << 31)
@@ -1065,9 +1553,6 @@ static void check_i2c_bus_reg(struct check *c, struct dt_info *dti, struct node
 	int len;
 	cell_t *cells = NULL;
 
-	if (!node->parent || (node->parent->bus != &i2c_bus))
-		return;
-
 	prop = get_property(node, "reg");
 	if (prop)
 		cells = (cell_t *)prop->val.val;
@@ -1099,7 +1584,8 @@ static void check_i2c_bus_reg(struct check *c, struct dt_info *dti, struct node
 				  reg);
 	}
 }
-WARNING(i2c_bus_reg, check_i2c_bus_reg, NULL, &reg_format, &i2c_bus_bridge);
+SCOPED_WARNING(i2c_bus_reg, check_i2c_bus_reg, NULL,
+	CHILD_OF_BUS(&i2c_bus), &reg_format, &i2c_bus_bridge);
 
 static const struct bus_type spi_bus = {
 	.name = "spi-bus",
@@ -1109,7 +1595,7 @@ static void check_spi_bus_bridge(struct check *c, struct dt_info *dti, struct no
 {
 	int spi_addr_cells = 1;
 
-	if (strprefixeq(node->name, node->basenamelen, "spi")) {
+	if (strprefixeq(node->name, node_basenamelen(node), "spi")) {
 		node->bus = &spi_bus;
 	} else {
 		/* Try to detect SPI buses which don't have proper node name */
@@ -1144,7 +1630,7 @@ static void check_spi_bus_bridge(struct check *c, struct dt_info *dti, struct no
 		FAIL(c, dti, node, "incorrect #size-cells for SPI bus");
 
 }
-WARNING(spi_bus_bridge, check_spi_bus_bridge, NULL, &addr_size_cells);
+ANNOTATE_WARNING(spi_bus_bridge, check_spi_bus_bridge, NULL, &addr_size_cells);
 
 static void check_spi_bus_reg(struct check *c, struct dt_info *dti, struct node *node)
 {
@@ -1154,9 +1640,6 @@ static void check_spi_bus_reg(struct check *c, struct dt_info *dti, struct node
 	uint32_t reg = 0;
 	cell_t *cells = NULL;
 
-	if (!node->parent || (node->parent->bus != &spi_bus))
-		return;
-
 	if (get_property(node->parent, "spi-slave"))
 		return;
 
@@ -1175,7 +1658,8 @@ static void check_spi_bus_reg(struct check *c, struct dt_info *dti, struct node
 		FAIL(c, dti, node, "SPI bus unit address format error, expected \"%s\"",
 		     unit_addr);
 }
-WARNING(spi_bus_reg, check_spi_bus_reg, NULL, &reg_format, &spi_bus_bridge);
+SCOPED_WARNING(spi_bus_reg, check_spi_bus_reg, NULL,
+	CHILD_OF_BUS(&spi_bus), &reg_format, &spi_bus_bridge);
 
 static void check_unit_address_format(struct check *c, struct dt_info *dti,
 				      struct node *node)
@@ -1271,36 +1755,52 @@ static void check_unique_unit_address_common(struct check *c,
 						struct node *node,
 						bool disable_check)
 {
-	struct node *childa;
+	struct node *child;
+	struct sibling *s;
+	int *pos;
+	int n = 0, i, j;
 
 	if (node->addr_cells < 0 || node->size_cells < 0)
 		return;
 
-	if (!node->children)
+	for_each_child(node, child)
+		n++;
+	if (n < 2)
 		return;
 
-	for_each_child(node, childa) {
-		struct node *childb;
-		const char *addr_a = get_unitname(childa);
+	s = xmalloc(n * sizeof(*s));
+	n = 0;
+	for_each_child(node, child) {
+		const char *unitname = get_unitname(child);
 
-		if (!strlen(addr_a))
+		if (!strlen(unitname))
 			continue;
 
-		if (disable_check && node_is_disabled(childa))
+		if (disable_check && node_is_disabled(child))
 			continue;
 
-		for_each_child(node, childb) {
-			const char *addr_b = get_unitname(childb);
-			if (childa == childb)
-				break;
+		add_sibling(s, &n, unitname, child);
+	}
+	if (n < 2) {
+		free(s);
+		return;
+	}
+	pos = sort_siblings(s, n);
 
-			if (disable_check && node_is_disabled(childb))
-				continue;
+	/*
+	 * Each node is reported for every later node at the same address,
+	 * which the message names.
+	 */
+	for (i = 0; i < n; i++) {
+		struct sibling *a = &s[pos[i]];
+		struct node *childa = a->p;
 
-			if (streq(addr_a, addr_b))
-				FAIL(c, dti, childb, "duplicate unit-address (also used in node %s)", childa->fullpath);
-		}
+		for (j = a->group; j < pos[i]; j++)
+			FAIL(c, dti, s[j].p, "duplicate unit-address (also used in node %s)", get_node_path(childa));
 	}
+
+	free(pos);
+	free(s);
 }
 
 static void check_unique_unit_address(struct check *c, struct dt_info *dti,
@@ -1316,7 +1816,7 @@ static void check_unique_unit_address_if_enabled(struct check *c, struct dt_info
 	check_unique_unit_address_common(c, dti, node, true);
 }
 CHECK_ENTRY(unique_unit_address_if_enabled, check_unique_unit_address_if_enabled,
-	    NULL, false, false, &avoid_default_addr_size);
+	    NULL, false, false, NO_FIXUP, SCOPE_ALL, NULL, &avoid_default_addr_size);
 
 static void check_obsolete_chosen_interrupt_controller(struct check *c,
 						       struct dt_info *dti,
@@ -1434,13 +1934,9 @@ static void check_property_phandle_args(struct check *c,
 		}
 
 		/* If we have markers, verify the current cell is a phandle */
-		if (prop->val.markers) {
-			struct marker *m = prop->val.markers;
-			for_each_marker_of_type(m, REF_PHANDLE) {
-				if (m->offset == (cell * sizeof(cell_t)))
-					break;
-			}
-			if (!m)
+		if (prop->val.nmarkers) {
+			if (!data_find_marker(prop->val, REF_PHANDLE,
+					      cell * sizeof(cell_t)))
 				FAIL_PROP(c, dti, node, prop,
 					  "cell %d is not a phandle reference",
 					  cell);
@@ -1462,7 +1958,7 @@ static void check_property_phandle_args(struct check *c,
 		} else {
 			FAIL(c, dti, node, "Missing property '%s' in node %s or bad phandle (referred from %s[%d])",
 			     provider->cell_name,
-			     provider_node->fullpath,
+			     get_node_path(provider_node),
 			     prop->name, cell);
 			break;
 		}
@@ -1493,7 +1989,8 @@ static void check_provider_cells_property(struct check *c,
 #define WARNING_PROPERTY_PHANDLE_CELLS(nm, propname, cells_name, ...) \
 	static struct provider nm##_provider = { (propname), (cells_name), __VA_ARGS__ }; \
 	WARNING_IF_NOT_CELL(nm##_is_cell, cells_name); \
-	WARNING(nm##_property, check_provider_cells_property, &nm##_provider, &nm##_is_cell, &phandle_references);
+	SCOPED_WARNING(nm##_property, check_provider_cells_property, &nm##_provider, \
+		       WITH_PROPERTY(propname), &nm##_is_cell, &phandle_references);
 
 WARNING_PROPERTY_PHANDLE_CELLS(clocks, "clocks", "#clock-cells");
 WARNING_PROPERTY_PHANDLE_CELLS(cooling_device, "cooling-device", "#cooling-cells");
@@ -1680,7 +2177,7 @@ static void check_interrupt_map(struct check *c,
 			parent_cellsize = propval_cell(cellprop);
 		} else {
 			FAIL(c, dti, node, "Missing property '#interrupt-cells' in node %s or bad phandle (referred from interrupt-map[%zu])",
-			     provider_node->fullpath, cell);
+			     get_node_path(provider_node), cell);
 			break;
 		}
 
@@ -1690,7 +2187,7 @@ static void check_interrupt_map(struct check *c,
 		else
 			FAIL_PROP(c, dti, node, irq_map_prop,
 				"Missing property '#address-cells' in node %s, using 0 as fallback",
-				provider_node->fullpath);
+				get_node_path(provider_node));
 
 		cell += 1 + parent_cellsize;
 		if (cell > map_cells)
@@ -1699,7 +2196,8 @@ static void check_interrupt_map(struct check *c,
 				irq_map_prop->val.len, cell * sizeof(cell_t));
 	}
 }
-WARNING(interrupt_map, check_interrupt_map, NULL, &phandle_references, &addr_size_cells, &interrupt_provider);
+SCOPED_WARNING(interrupt_map, check_interrupt_map, NULL,
+	WITH_PROPERTY("interrupt-map"), &phandle_references, &addr_size_cells, &interrupt_provider);
 
 static void check_interrupts_property(struct check *c,
 				      struct dt_info *dti,
@@ -1769,7 +2267,8 @@ static void check_interrupts_property(struct check *c,
 			  irq_prop->val.len, (int)(irq_cells * sizeof(cell_t)));
 	}
 }
-WARNING(interrupts_property, check_interrupts_property, NULL, &phandle_references);
+SCOPED_WARNING(interrupts_property, check_interrupts_property, NULL,
+	WITH_PROPERTY("interrupts"), &phandle_references);
 
 static const struct bus_type graph_port_bus = {
 	.name = "graph-port",
@@ -1785,7 +2284,7 @@ static void check_graph_nodes(struct check *c, struct dt_info *dti,
 	struct node *child;
 
 	for_each_child(node, child) {
-		if (!(strprefixeq(child->name, child->basenamelen, "endpoint") ||
+		if (!(strprefixeq(child->name, node_basenamelen(child), "endpoint") ||
 		      get_property(child, "remote-endpoint")))
 			continue;
 
@@ -1805,7 +2304,7 @@ static void check_graph_nodes(struct check *c, struct dt_info *dti,
 	}
 
 }
-WARNING(graph_nodes, check_graph_nodes, NULL);
+ANNOTATE_WARNING(graph_nodes, check_graph_nodes, NULL);
 
 static void check_graph_reg(struct check *c, struct dt_info *dti,
 			    struct node *node)
@@ -1841,19 +2340,17 @@ static void check_graph_reg(struct check *c, struct dt_info *dti,
 static void check_graph_port(struct check *c, struct dt_info *dti,
 			     struct node *node)
 {
-	if (node->bus != &graph_port_bus)
-		return;
-
 	check_graph_reg(c, dti, node);
 
 	/* skip checks below for overlays */
 	if (dti->dtsflags & DTSF_PLUGIN)
 		return;
 
-	if (!strprefixeq(node->name, node->basenamelen, "port"))
+	if (!strprefixeq(node->name, node_basenamelen(node), "port"))
 		FAIL(c, dti, node, "graph port node name should be 'port'");
 }
-WARNING(graph_port, check_graph_port, NULL, &graph_nodes);
+SCOPED_WARNING(graph_port, check_graph_port, NULL, ON_BUS(&graph_port_bus),
+	&graph_nodes);
 
 static struct node *get_remote_endpoint(struct check *c, struct dt_info *dti,
 					struct node *endpoint)
@@ -1883,16 +2380,13 @@ static void check_graph_endpoint(struct check *c, struct dt_info *dti,
 {
 	struct node *remote_node;
 
-	if (!node->parent || node->parent->bus != &graph_port_bus)
-		return;
-
 	check_graph_reg(c, dti, node);
 
 	/* skip checks below for overlays */
 	if (dti->dtsflags & DTSF_PLUGIN)
 		return;
 
-	if (!strprefixeq(node->name, node->basenamelen, "endpoint"))
+	if (!strprefixeq(node->name, node_basenamelen(node), "endpoint"))
 		FAIL(c, dti, node, "graph endpoint node name should be 'endpoint'");
 
 	remote_node = get_remote_endpoint(c, dti, node);
@@ -1901,9 +2395,10 @@ static void check_graph_endpoint(struct check *c, struct dt_info *dti,
 
 	if (get_remote_endpoint(c, dti, remote_node) != node)
 		FAIL(c, dti, node, "graph connection to node '%s' is not bidirectional",
-		     remote_node->fullpath);
+		     get_node_path(remote_node));
 }
-WARNING(graph_endpoint, check_graph_endpoint, NULL, &graph_nodes);
+SCOPED_WARNING(graph_endpoint, check_graph_endpoint, NULL,
+	CHILD_OF_BUS(&graph_port_bus), &graph_nodes);
 
 static struct check *check_table[] = {
 	&duplicate_node_names, &duplicate_property_names,
@@ -2057,11 +2552,220 @@ void parse_checks_option(bool warn, bool error, const char *arg)
 	die("Unrecognized check name \"%s\"\n", name);
 }
 
+#ifndef NO_THREADS
+/*
+ * Running checks on worker threads
+ *
+ * The enabled checks and their prerequisites are queued in the order
+ * run_check() would visit them.  Worker threads then pick checks off
+ * the queue once their prerequisites have completed, buffering any
+ * diagnostics in the check.  Checks which modify the tree (fixups) act
+ * as barriers: they only start once every check queued before them has
+ * completed, and no check queued after them starts until they are
+ * done, so every check sees the tree exactly as it would when run
+ * serially.  Once a check queued before some check has failed with an
+ * error, the later check is not started, since the serial run would
+ * never reach it.
+ *
+ * process_checks() afterwards walks the checks serially as usual,
+ * replaying the buffered results, so the output is identical to a
+ * single threaded run.
+ */
+enum queuestate {
+	QUEUE_PENDING = 0,
+	QUEUE_RUNNING,
+	QUEUE_DONE,
+};
+
+struct check_queue {
+	struct dt_info *dti;
+	struct check **list;
+	enum queuestate *state;
+	int n, size;
+	int done_prefix;	/* every check before this one is done */
+	int first_error;	/* earliest check which failed with an error */
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct check_worker {
+	struct check_queue *q;
+	int index;		/* 0 for the calling thread */
+};
+
+static void queue_check(struct check_queue *q, struct check *c)
+{
+	int i;
+
+	if (c->queued)
+		return;
+
+	assert(!c->inprogress);
+	c->inprogress = true;
+	for (i = 0; i < c->num_prereqs; i++)
+		queue_check(q, c->prereq[i]);
+	c->inprogress = false;
+
+	if (q->n == q->size) {
+		q->size = q->size ? 2 * q->size : 64;
+		q->list = xrealloc(q->list, q->size * sizeof(*q->list));
+	}
+	c->queued = true;
+	c->queue_pos = q->n;
+	q->list[q->n++] = c;
+}
+
+static bool check_is_ready(struct check_queue *q, int pos)
+{
+	struct check *c = q->list[pos];
+	int i;
+
+	if ((q->state[pos] != QUEUE_PENDING) || (pos > q->first_error))
+		return false;
+
+	if (c->fixup)
+		return q->done_prefix == pos;
+
+	for (i = 0; i < c->num_prereqs; i++)
+		if (q->state[c->prereq[i]->queue_pos] != QUEUE_DONE)
+			return false;
+
+	for (i = q->done_prefix; i < pos; i++)
+		if (q->list[i]->fixup && (q->state[i] != QUEUE_DONE))
+			return false;
+
+	return true;
+}
+
+static void run_check_body(struct check *c, struct dt_info *dti)
+{
+	int i;
+
+	/* Prerequisite failures are reported when the results are replayed */
+	for (i = 0; i < c->num_prereqs; i++)
+		if (c->prereq[i]->result != PASSED) {
+			c->result = PREREQ;
+			return;
+		}
+
+	c->buffered = true;
+	run_check_nodes(c, dti);
+	c->buffered = false;
+
+	c->result = (c->status == UNCHECKED) ? PASSED : c->status;
+	c->status = UNCHECKED;
+	c->ran = true;
+}
+
+static void *check_worker(void *arg)
+{
+	struct check_worker *w = arg;
+	struct check_queue *q = w->q;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		struct check *c;
+		int pos;
+
+		for (pos = q->done_prefix; pos < q->n; pos++)
+			if (check_is_ready(q, pos))
+				break;
+
+		if (pos == q->n) {
+			/* Nothing can start until something finishes */
+			if (!q->running)
+				break;
+			pthread_cond_wait(&q->cond, &q->lock);
+			continue;
+		}
+
+		c = q->list[pos];
+		q->state[pos] = QUEUE_RUNNING;
+		q->running++;
+		/* Build any index the check needs before others can race */
+		scope_index_update(&scope_index, c, q->dti);
+		pthread_mutex_unlock(&q->lock);
+
+		TRACE(c, "\tRunning on worker thread");
+		c->worker = w->index;
+		run_check_body(c, q->dti);
+
+		pthread_mutex_lock(&q->lock);
+		q->state[pos] = QUEUE_DONE;
+		q->running--;
+		if ((c->result != PASSED) && c->error && (pos < q->first_error))
+			q->first_error = pos;
+		while ((q->done_prefix < q->n)
+		       && (q->state[q->done_prefix] == QUEUE_DONE))
+			q->done_prefix++;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+static void run_checks_parallel(struct dt_info *dti, unsigned int nthreads)
+{
+	struct check_queue q;
+	struct check_worker *workers;
+	pthread_t *threads;
+	unsigned int i, nstarted = 0;
+
+	memset(&q, 0, sizeof(q));
+	q.dti = dti;
+
+	for (i = 0; i < ARRAY_SIZE(check_table); i++) {
+		struct check *c = check_table[i];
+
+		if (c->warn || c->error)
+			queue_check(&q, c);
+	}
+
+	q.state = xmalloc(q.n * sizeof(*q.state));
+	memset(q.state, 0, q.n * sizeof(*q.state));
+	q.first_error = q.n;
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.cond, NULL);
+
+	/* The calling thread works through the queue too, as worker 0 */
+	threads = xmalloc((nthreads - 1) * sizeof(*threads));
+	workers = xmalloc(nthreads * sizeof(*workers));
+	for (i = 0; i < nthreads; i++) {
+		workers[i].q = &q;
+		workers[i].index = i;
+	}
+	for (i = 0; i < nthreads - 1; i++)
+		if (pthread_create(&threads[nstarted], NULL, check_worker,
+				   &workers[nstarted + 1]) == 0)
+			nstarted++;
+
+	check_worker(&workers[0]);
+
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&q.cond);
+	pthread_mutex_destroy(&q.lock);
+	free(threads);
+	free(workers);
+	free(q.state);
+	free(q.list);
+}
+#endif /* NO_THREADS */
+
 void process_checks(bool force, struct dt_info *dti)
 {
 	unsigned int i;
 	int error = 0;
 
+#ifndef NO_THREADS
+	if (jobs > 1)
+		run_checks_parallel(dti, jobs);
+#endif
+
 	for (i = 0; i < ARRAY_SIZE(check_table); i++) {
 		struct check *c = check_table[i];
 
@@ -2069,6 +2773,17 @@ void process_checks(bool force, struct dt_info *dti)
 			error = error || run_check(c, dti);
 	}
 
+	/* The tree may change from here on, drop the index */
+	scope_index_invalidate(&scope_index, FIXUP_TREE);
+
+	for (i = 0; stats_enabled && (i < ARRAY_SIZE(check_table)); i++) {
+		struct check *c = check_table[i];
+
+		if (c->end)
+			stats_add("check", c->name, c->worker, c->start, c->end,
+				  c->maxrss);
+	}
+
 	if (error) {
 		if (!force) {
 			fprintf(stderr, "ERROR: Input tree has errors, aborting "
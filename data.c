@@ -3,22 +3,62 @@
  * (C) Copyright David Gibson <dwg@au1.ibm.com>, IBM Corporation.  2005.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "dtc.h"
 
+/*
+ * Files mapped by data_copy_file().  Each is unmapped once the data
+ * borrowing it is freed, or copied because it grew.
+ */
+struct file_map {
+	char *val;		/* what the data borrows */
+	void *addr;
+	size_t len;
+};
+
+static struct file_map *file_maps;
+static int num_file_maps, max_file_maps;
+
+static void add_file_map(char *val, void *addr, size_t len)
+{
+	if (num_file_maps == max_file_maps) {
+		max_file_maps = max_file_maps ? 2 * max_file_maps : 16;
+		file_maps = xrealloc(file_maps,
+				     max_file_maps * sizeof(*file_maps));
+	}
+	file_maps[num_file_maps].val = val;
+	file_maps[num_file_maps].addr = addr;
+	file_maps[num_file_maps].len = len;
+	num_file_maps++;
+}
+
+/* Drops borrowed value val, unmapping it if it is a mapped file */
+static void release_borrowed(char *val)
+{
+	int i;
+
+	for (i = 0; i < num_file_maps; i++)
+		if (file_maps[i].val == val) {
+			munmap(file_maps[i].addr, file_maps[i].len);
+			file_maps[i] = file_maps[--num_file_maps];
+			return;
+		}
+}
+
 void data_free(struct data d)
 {
-	struct marker *m, *nm;
+	struct marker *m;
 
-	m = d.markers;
-	while (m) {
-		nm = m->next;
+	for_each_marker(d, m)
 		free(m->ref);
-		free(m);
-		m = nm;
-	}
+	free(d.markers);
 
-	if (d.val)
+	if (d.size)
 		free(d.val);
+	else if (d.val)
+		release_borrowed(d.val);
 }
 
 struct data data_grow_for(struct data d, unsigned int xlen)
@@ -26,17 +66,26 @@ struct data data_grow_for(struct data d, unsigned int xlen)
 	struct data nd;
 	unsigned int newsize;
 
-	if (xlen == 0)
+	if ((d.len + xlen) <= d.size)
 		return d;
 
 	nd = d;
 
-	newsize = xlen;
+	newsize = d.size ? d.size : d.len + xlen;
 
+	/* Grow geometrically, so appending n bytes is O(n) overall */
 	while ((d.len + xlen) > newsize)
 		newsize *= 2;
 
-	nd.val = xrealloc(d.val, newsize);
+	if (d.size || !d.val) {
+		nd.val = xrealloc(d.val, newsize);
+	} else {
+		/* Borrowed, so it has to be copied before it can grow */
+		nd.val = xmalloc(newsize);
+		memcpy(nd.val, d.val, d.len);
+		release_borrowed(d.val);
+	}
+	nd.size = newsize;
 
 	return nd;
 }
@@ -53,6 +102,20 @@ struct data data_copy_mem(const char *mem, int len)
 	return d;
 }
 
+/*
+ * Refer to mem without copying it.  mem must outlive the data, and the
+ * data's value may be modified in place, but it is copied if it grows.
+ */
+struct data data_borrow_mem(char *mem, int len)
+{
+	struct data d = empty_data;
+
+	d.val = mem;
+	d.len = len;
+
+	return d;
+}
+
 struct data data_copy_escape_string(const char *s, int len)
 {
 	int i = 0;
@@ -76,11 +139,65 @@ struct data data_copy_escape_string(const char *s, int len)
 	return d;
 }
 
+/*
+ * Map up to maxlen bytes of f from its current position, if f is a
+ * regular file.  The mapping is private, so the data can still be changed
+ * in place.
+ */
+static char *map_file(FILE *f, size_t maxlen, size_t *lenp)
+{
+	struct stat st;
+	long pos, start;
+	size_t len;
+	void *p;
+	int fd;
+
+	fd = fileno(f);
+	if ((fd < 0) || (fstat(fd, &st) != 0) || !S_ISREG(st.st_mode))
+		return NULL;
+
+	pos = ftell(f);
+	if ((pos < 0) || (pos >= st.st_size))
+		return NULL;
+
+	len = st.st_size - pos;
+	if (len > maxlen)
+		len = maxlen;
+	if ((len == 0) || (len > INT_MAX))
+		return NULL;
+
+	start = pos - (pos % sysconf(_SC_PAGESIZE));
+	p = mmap(NULL, len + (pos - start), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE, fd, start);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	add_file_map((char *)p + (pos - start), p, len + (pos - start));
+	*lenp = len;
+	return (char *)p + (pos - start);
+}
+
+/*
+ * Read up to maxlen bytes of f.  A regular file is mapped rather than
+ * read, and the data borrows the mapping, so a large /incbin/ is only
+ * copied when the output is written.  The mapping lasts as long as the
+ * data's value: data_free() unmaps it, as does growing the data, which
+ * copies the value first.
+ */
 struct data data_copy_file(FILE *f, size_t maxlen)
 {
 	struct data d = empty_data;
+	size_t len;
+	char *p;
 
 	d = data_add_marker(d, TYPE_NONE, NULL);
+
+	p = map_file(f, maxlen, &len);
+	if (p) {
+		d.val = p;
+		d.len = len;
+		return d;
+	}
 	while (!feof(f) && (d.len < maxlen)) {
 		size_t chunksize, ret;
 
@@ -121,35 +238,63 @@ struct data data_insert_at_marker(struct data d, struct marker *m,
 	d.len += len;
 
 	/* Adjust all markers after the one we're inserting at */
-	m = m->next;
-	for_each_marker(m)
+	for (m++; m < d.markers + d.nmarkers; m++)
 		m->offset += len;
 	return d;
 }
 
-static struct data data_append_markers(struct data d, struct marker *m)
+/* Make room for at least n more markers */
+static struct data data_grow_markers(struct data d, unsigned int n)
 {
-	struct marker **mp = &d.markers;
+	if ((d.nmarkers + n) <= d.maxmarkers)
+		return d;
+
+	if (!d.maxmarkers)
+		d.maxmarkers = 4;
+	while ((d.nmarkers + n) > d.maxmarkers)
+		d.maxmarkers *= 2;
 
-	/* Find the end of the markerlist */
-	while (*mp)
-		mp = &((*mp)->next);
-	*mp = m;
+	d.markers = xrealloc(d.markers, d.maxmarkers * sizeof(*d.markers));
 	return d;
 }
 
 struct data data_merge(struct data d1, struct data d2)
 {
 	struct data d;
-	struct marker *m2 = d2.markers;
+	unsigned int i, first = d1.nmarkers;
+
+	if (d1.len == 0) {
+		/* Nothing to copy d2 after, so take over its buffer */
+		if (d1.size)
+			free(d1.val);
+		d = d1;
+		d.val = d2.val;
+		d.len = d2.len;
+		d.size = d2.size;
+		d2.val = NULL;
+	} else {
+		d = data_append_data(d1, d2.val, d2.len);
+	}
 
-	d = data_append_markers(data_append_data(d1, d2.val, d2.len), m2);
+	if (!d.nmarkers) {
+		free(d.markers);
+		d.markers = d2.markers;
+		d.nmarkers = d2.nmarkers;
+		d.maxmarkers = d2.maxmarkers;
+	} else {
+		d = data_grow_markers(d, d2.nmarkers);
+		memcpy(d.markers + d.nmarkers, d2.markers,
+		       d2.nmarkers * sizeof(*d2.markers));
+		d.nmarkers += d2.nmarkers;
+		free(d2.markers);
+	}
 
 	/* Adjust for the length of d1 */
-	for_each_marker(m2)
-		m2->offset += d1.len;
+	for (i = first; i < d.nmarkers; i++)
+		d.markers[i].offset += d1.len;
 
 	d2.markers = NULL; /* So data_free() doesn't clobber them */
+	d2.nmarkers = 0;
 	data_free(d2);
 
 	return d;
@@ -224,13 +369,59 @@ struct data data_append_align(struct data d, int align)
 	return data_append_zeroes(d, newlen - d.len);
 }
 
-struct data data_add_marker(struct data d, enum markertype type, char *ref)
+struct data data_insert_marker(struct data d, unsigned int i,
+			       enum markertype type, unsigned int offset,
+			       char *ref)
 {
 	struct marker *m;
 
-	m = alloc_marker(d.len, type, ref);
+	assert(i <= d.nmarkers);
+	assert((i == 0) || (d.markers[i - 1].offset <= offset));
+	assert((i == d.nmarkers) || (offset <= d.markers[i].offset));
+
+	d = data_grow_markers(d, 1);
+	m = &d.markers[i];
+	memmove(m + 1, m, (d.nmarkers - i) * sizeof(*m));
+	m->type = type;
+	m->offset = offset;
+	m->ref = ref;
+	d.nmarkers++;
+
+	return d;
+}
+
+struct data data_add_marker(struct data d, enum markertype type, char *ref)
+{
+	return data_insert_marker(d, d.nmarkers, type, d.len, ref);
+}
+
+/* Index of the first marker at or after offset */
+unsigned int data_marker_index(struct data d, unsigned int offset)
+{
+	unsigned int lo = 0, hi = d.nmarkers, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (d.markers[mid].offset < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+struct marker *data_find_marker(struct data d, enum markertype type,
+				unsigned int offset)
+{
+	unsigned int i;
+
+	for (i = data_marker_index(d, offset);
+	     (i < d.nmarkers) && (d.markers[i].offset == offset); i++)
+		if (d.markers[i].type == type)
+			return &d.markers[i];
 
-	return data_append_markers(d, m);
+	return NULL;
 }
 
 bool data_is_one_string(struct data d)
@@ -254,7 +445,7 @@ bool data_is_one_string(struct data d)
 struct data data_insert_data(struct data d, struct marker *m, struct data old)
 {
 	unsigned int offset = m->offset;
-	struct marker *next = m->next;
+	unsigned int i = m - d.markers + 1;
 	struct marker *marker;
 	struct data new_data;
 	char *ref;
@@ -262,32 +453,16 @@ struct data data_insert_data(struct data d, struct marker *m, struct data old)
 	new_data = data_insert_at_marker(d, m, old.val, old.len);
 
 	/* Copy all markers from old value */
-	marker = old.markers;
-	for_each_marker(marker) {
+	for_each_marker(old, marker) {
 		ref = NULL;
 
 		if (marker->ref)
 			ref = xstrdup(marker->ref);
 
-		m->next = alloc_marker(marker->offset + offset, marker->type,
-				       ref);
-		m = m->next;
+		new_data = data_insert_marker(new_data, i++,
+					      marker->type,
+					      marker->offset + offset, ref);
 	}
-	m->next = next;
 
 	return new_data;
 }
-
-struct marker *alloc_marker(unsigned int offset, enum markertype type,
-			    char *ref)
-{
-	struct marker *m;
-
-	m = xmalloc(sizeof(*m));
-	m->offset = offset;
-	m->type = type;
-	m->ref = ref;
-	m->next = NULL;
-
-	return m;
-}
@@ -64,6 +64,7 @@ static bool is_ref_relative(const char *ref)
 %token <integer> DT_CHAR_LITERAL
 %token <byte> DT_BYTE
 %token <data> DT_STRING
+%token <data> DT_CELLS
 %token <labelref> DT_LABEL
 %token <labelref> DT_LABEL_REF
 %token <labelref> DT_PATH_REF
@@ -419,6 +420,12 @@ arrayprefix:
 
 			$$.data = data_append_integer($1.data, $2, $1.bits);
 		}
+	| arrayprefix DT_CELLS
+		{
+			/* The lexer only makes these in plain 32-bit arrays */
+			assert($1.bits == 32);
+			$$.data = data_merge($1.data, $2);
+		}
 	| arrayprefix dt_ref
 		{
 			uint64_t val = ~0ULL >> (64 - $1.bits);
@@ -22,32 +22,35 @@ int generate_fixups;		/* suppress generation of fixups on symbol support */
 int auto_label_aliases;		/* auto generate labels -> aliases */
 int annotate;		/* Level of annotation: 1 for input source location
 			   >1 for full input source location. */
+unsigned int jobs = 1;	/* Number of worker threads */
+int preprocess;		/* Run dts input through the built-in cpp */
 
 static int is_power_of_2(int x)
 {
 	return (x > 0) && ((x & (x - 1)) == 0);
 }
 
-static void fill_fullpaths(struct node *tree, const char *prefix)
-{
-	struct node *child;
-	const char *unit;
+/* More threads than this only add overhead */
+#define MAX_JOBS_PER_CPU	4
 
-	tree->fullpath = join_path(prefix, tree->name);
+static unsigned int parse_jobs(const char *arg)
+{
+	long n, ncpus, max;
+	char *end;
 
-	unit = strchr(tree->name, '@');
-	if (unit)
-		tree->basenamelen = unit - tree->name;
-	else
-		tree->basenamelen = strlen(tree->name);
+	errno = 0;
+	n = strtol(arg, &end, 0);
+	if (errno || (end == arg) || *end || (n < 1))
+		die("Invalid argument \"%s\" to -j option\n", arg);
 
-	for_each_child(tree, child)
-		fill_fullpaths(child, tree->fullpath);
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	max = MAX_JOBS_PER_CPU * ((ncpus > 0) ? ncpus : 1);
+	return (n > max) ? max : n;
 }
 
 /* Usage related data. */
 static const char usage_synopsis[] = "dtc [options] <input file>";
-static const char usage_short_opts[] = "qI:O:o:V:d:R:S:p:a:fb:i:H:sW:E:@LAThv";
+static const char usage_short_opts[] = "qI:O:o:V:d:R:S:p:a:fb:i:cD:H:sW:E:@LATj:P:C:B:Nhv";
 static struct option const usage_long_opts[] = {
 	{"quiet",            no_argument, NULL, 'q'},
 	{"in-format",         a_argument, NULL, 'I'},
@@ -62,6 +65,8 @@ static struct option const usage_long_opts[] = {
 	{"boot-cpu",          a_argument, NULL, 'b'},
 	{"force",            no_argument, NULL, 'f'},
 	{"include",           a_argument, NULL, 'i'},
+	{"cpp",              no_argument, NULL, 'c'},
+	{"define",            a_argument, NULL, 'D'},
 	{"sort",             no_argument, NULL, 's'},
 	{"phandle",           a_argument, NULL, 'H'},
 	{"warning",           a_argument, NULL, 'W'},
@@ -70,6 +75,11 @@ static struct option const usage_long_opts[] = {
 	{"local-fixups",     no_argument, NULL, 'L'},
 	{"auto-alias",       no_argument, NULL, 'A'},
 	{"annotate",         no_argument, NULL, 'T'},
+	{"jobs",              a_argument, NULL, 'j'},
+	{"profile",           a_argument, NULL, 'P'},
+	{"include-cache",     a_argument, NULL, 'C'},
+	{"batch",             a_argument, NULL, 'B'},
+	{"no-checks",        no_argument, NULL, 'N'},
 	{"help",             no_argument, NULL, 'h'},
 	{"version",          no_argument, NULL, 'v'},
 	{NULL,               no_argument, NULL, 0x0},
@@ -81,22 +91,25 @@ static const char * const usage_opts_help[] = {
 	 "\t\tdtb - device tree blob\n"
 	 "\t\tfs  - /proc/device-tree style directory",
 	"\n\tOutput file",
-	"\n\tOutput formats are:\n"
+	"\n\tOutput format, or <format>:<file> to write another output too.  Output formats are:\n"
 	 "\t\tdts - device tree source text\n"
 	 "\t\tdtb - device tree blob\n"
 #ifndef NO_YAML
 	 "\t\tyaml - device tree encoded as YAML\n"
 #endif
-	 "\t\tasm - assembler source",
-	"\n\tBlob version to produce, defaults to "stringify(DEFAULT_FDT_VERSION)" (for dtb and asm output)",
+	 "\t\tasm - assembler source\n"
+	 "\t\tc   - C source, with the blob as an array",
+	"\n\tBlob version to produce, defaults to "stringify(DEFAULT_FDT_VERSION)" (for dtb, asm and c output)",
 	"\n\tOutput dependency file",
-	"\n\tMake space for <number> reserve map entries (for dtb and asm output)",
+	"\n\tMake space for <number> reserve map entries (for dtb, asm and c output)",
 	"\n\tMake the blob at least <bytes> long (extra space)",
 	"\n\tAdd padding to the blob of <bytes> long (extra space)",
 	"\n\tMake the blob align to the <bytes> (extra space)",
 	"\n\tSet the physical boot cpu",
 	"\n\tTry to produce output even if the input tree has errors",
 	"\n\tAdd a path to search for include files",
+	"\n\tRun dts input through the built-in C preprocessor, instead of running cpp first",
+	"\n\tDefine <name>[=<value>] as a macro for --cpp",
 	"\n\tSort nodes and properties before outputting (useful for comparing trees)",
 	"\n\tValid phandle formats are:\n"
 	 "\t\tlegacy - \"linux,phandle\" properties only\n"
@@ -104,10 +117,18 @@ static const char * const usage_opts_help[] = {
 	 "\t\tboth   - Both \"linux,phandle\" and \"phandle\" properties",
 	"\n\tEnable/disable warnings (prefix with \"no-\")",
 	"\n\tEnable/disable errors (prefix with \"no-\")",
-	"\n\tEnable generation of symbols",
+	"\n\tEnable generation of symbols (-@ -@ to sort them by label)",
 	"\n\tPossibly generates a __local_fixups__ and a __fixups__ node at the root node",
 	"\n\tEnable auto-alias of labels",
 	"\n\tAnnotate output .dts with input source file and line (-T -T for more details)",
+	"\n\tRun checks (and read -I fs input) on <number> threads, or <number> --batch jobs at once",
+	"\n\tReport time and memory used by each phase, as <format>[:<file>]\n"
+	 "\t\ttext  - human readable table (default to stderr)\n"
+	 "\t\tjson  - JSON object\n"
+	 "\t\ttrace - Chrome trace event format",
+	"\n\tCache lexed include files in <dir>, for reuse by later runs",
+	"\n\tCompile each line of <manifest> as a set of extra options and an input file",
+	"\n\tDon't check the tree (dtb input only)",
 	"\n\tPrint this help and exit",
 	"\n\tPrint version and exit",
 	NULL,
@@ -161,42 +182,56 @@ static const char *guess_input_format(const char *fname, const char *fallback)
 	return guess_type_by_name(fname, fallback);
 }
 
-int main(int argc, char *argv[])
+/* An output, from -O <format>:<file>, or from -O and -o */
+struct dtc_output {
+	const char *form, *name;
+};
+
+struct dtc_args {
+	const char *inform, *outform, *outname, *depname;
+	struct dtc_output *outputs;	/* from -O <format>:<file> */
+	int noutputs;
+	bool force, sort, nochecks;
+	int outversion;
+	long long boot_cpuid;
+	char *statsformat, *statsname;
+	const char *batchname;
+};
+
+static void parse_args(struct dtc_args *a, int argc, char *argv[])
 {
-	struct dt_info *dti;
-	const char *inform = NULL;
-	const char *outform = NULL;
-	const char *outname = "-";
-	const char *depname = NULL;
-	bool force = false, sort = false;
-	const char *arg;
 	int opt;
-	FILE *outf = NULL;
-	int outversion = DEFAULT_FDT_VERSION;
-	long long cmdline_boot_cpuid = -1;
-
-	quiet      = 0;
-	reservenum = 0;
-	minsize    = 0;
-	padsize    = 0;
-	alignsize  = 0;
 
 	while ((opt = util_getopt_long()) != EOF) {
 		switch (opt) {
 		case 'I':
-			inform = optarg;
+			a->inform = optarg;
 			break;
 		case 'O':
-			outform = optarg;
+			if (strchr(optarg, ':')) {
+				struct dtc_output *out;
+				char *form = xstrdup(optarg);
+				char *name = strchr(form, ':');
+
+				*name++ = '\0';
+				a->outputs = xrealloc(a->outputs,
+						      (a->noutputs + 1)
+						      * sizeof(*a->outputs));
+				out = &a->outputs[a->noutputs++];
+				out->form = form;
+				out->name = name;
+			} else {
+				a->outform = optarg;
+			}
 			break;
 		case 'o':
-			outname = optarg;
+			a->outname = optarg;
 			break;
 		case 'V':
-			outversion = strtol(optarg, NULL, 0);
+			a->outversion = strtol(optarg, NULL, 0);
 			break;
 		case 'd':
-			depname = optarg;
+			a->depname = optarg;
 			break;
 		case 'R':
 			reservenum = strtoul(optarg, NULL, 0);
@@ -214,17 +249,23 @@ int main(int argc, char *argv[])
 				    alignsize);
 			break;
 		case 'f':
-			force = true;
+			a->force = true;
 			break;
 		case 'q':
 			quiet++;
 			break;
 		case 'b':
-			cmdline_boot_cpuid = strtoll(optarg, NULL, 0);
+			a->boot_cpuid = strtoll(optarg, NULL, 0);
 			break;
 		case 'i':
 			srcfile_add_search_path(optarg);
 			break;
+		case 'c':
+			preprocess = 1;
+			break;
+		case 'D':
+			preproc_define(optarg);
+			break;
 		case 'v':
 			util_version();
 		case 'H':
@@ -240,7 +281,7 @@ int main(int argc, char *argv[])
 			break;
 
 		case 's':
-			sort = true;
+			a->sort = true;
 			break;
 
 		case 'W':
@@ -252,7 +293,7 @@ int main(int argc, char *argv[])
 			break;
 
 		case '@':
-			generate_symbols = 1;
+			generate_symbols++;
 			break;
 
 		case 'L':
@@ -265,6 +306,30 @@ int main(int argc, char *argv[])
 		case 'T':
 			annotate++;
 			break;
+		case 'j':
+			jobs = parse_jobs(optarg);
+			break;
+		case 'P':
+			a->statsformat = xstrdup(optarg);
+			a->statsname = strchr(a->statsformat, ':');
+			if (a->statsname)
+				*a->statsname++ = '\0';
+			if (!streq(a->statsformat, "text")
+			    && !streq(a->statsformat, "json")
+			    && !streq(a->statsformat, "trace"))
+				die("Invalid argument \"%s\" to -P option\n",
+				    optarg);
+			stats_init();
+			break;
+		case 'C':
+			srccache_init(optarg);
+			break;
+		case 'B':
+			a->batchname = optarg;
+			break;
+		case 'N':
+			a->nochecks = true;
+			break;
 
 		case 'h':
 			usage(NULL);
@@ -272,77 +337,209 @@ int main(int argc, char *argv[])
 			usage("unknown option");
 		}
 	}
+}
 
-	if (argc > (optind+1))
-		usage("missing files");
-	else if (argc < (optind+1))
-		arg = "-";
-	else
-		arg = argv[optind];
+/*
+ * An unchecked dtb which is only being given a new layout as another dtb
+ * is copied across without building a tree from it.
+ */
+static bool can_copy_blob(const struct dtc_args *a, const char *outform,
+			  const char *blob)
+{
+	return a->nochecks && streq(outform, "dtb") && (a->outversion >= 16)
+		&& !generate_symbols && !generate_fixups && !auto_label_aliases
+		&& !a->statsformat && blob_copyable(blob);
+}
+
+static FILE *open_output(const char *outname)
+{
+	FILE *outf;
+
+	if (streq(outname, "-"))
+		return stdout;
+
+	outf = fopen(outname, "wb");
+	if (! outf)
+		die("Couldn't open output file %s: %s\n",
+		    outname, strerror(errno));
+
+	return outf;
+}
+
+static bool is_blob_format(const char *outform)
+{
+	return streq(outform, "dtb") || streq(outform, "asm")
+		|| streq(outform, "c");
+}
+
+static void write_output(const struct dtc_args *a, struct dt_info *dti,
+			 const char *inform, const struct dtc_output *out,
+			 struct flat_blob *fb)
+{
+	const char *outform = out->form;
+	FILE *outf;
+	int phase;
+
+	outf = open_output(out->name);
+
+	phase = stats_begin("output", outform);
+	if (streq(outform, "dts")) {
+		dt_to_source(outf, dti);
+#ifndef NO_YAML
+	} else if (streq(outform, "yaml")) {
+		if (!streq(inform, "dts"))
+			die("YAML output format requires dts input format\n");
+		dt_to_yaml(outf, dti);
+#endif
+	} else if (streq(outform, "dtb")) {
+		if (fb)
+			flat_blob_to_dtb(outf, fb);
+		else
+			dt_to_blob(outf, dti, a->outversion);
+	} else if (streq(outform, "asm")) {
+		if (fb)
+			flat_blob_to_asm(outf, fb);
+		else
+			dt_to_asm(outf, dti, a->outversion);
+	} else if (streq(outform, "c")) {
+		if (fb)
+			flat_blob_to_c(outf, fb);
+		else
+			dt_to_c(outf, dti, a->outversion);
+	} else if (streq(outform, "null")) {
+		/* do nothing */
+	} else {
+		die("Unknown output format \"%s\"\n", outform);
+	}
+	if (phase >= 0)
+		fflush(outf);
+	stats_end(phase);
+
+	if ((outf != stdout) && (fclose(outf) != 0))
+		die("Error writing output file %s: %s\n", out->name,
+		    strerror(errno));
+}
+
+static void compile(const struct dtc_args *a, const char *arg)
+{
+	struct dt_info *dti = NULL;
+	struct flat_blob *fb = NULL;
+	struct dtc_output *outputs;
+	char *blob = NULL;
+	const char *inform = a->inform;
+	FILE *outf = NULL;
+	int noutputs = 0, nblobs = 0, i;
+	int phase;
 
 	/* minsize and padsize are mutually exclusive */
 	if (minsize && padsize)
 		die("Can't set both -p and -S\n");
 
-	if (depname) {
-		depfile = fopen(depname, "w");
+	/*
+	 * The output given by -O and -o, unless there are only
+	 * -O <format>:<file> outputs, then those.
+	 */
+	outputs = xmalloc((a->noutputs + 1) * sizeof(*outputs));
+	if (!a->noutputs || a->outform || a->outname) {
+		outputs[0].form = a->outform;
+		outputs[0].name = a->outname ? a->outname : "-";
+		noutputs = 1;
+	}
+	if (a->noutputs)
+		memcpy(outputs + noutputs, a->outputs,
+		       a->noutputs * sizeof(*outputs));
+	noutputs += a->noutputs;
+
+	if (a->depname) {
+		depfile = fopen(a->depname, "w");
 		if (!depfile)
-			die("Couldn't open dependency file %s: %s\n", depname,
+			die("Couldn't open dependency file %s: %s\n", a->depname,
 			    strerror(errno));
 
-		fprint_path_escaped(depfile, outname);
+		for (i = 0; i < noutputs; i++) {
+			if (i)
+				fputc(' ', depfile);
+			fprint_path_escaped(depfile, outputs[i].name);
+		}
 		fputc(':', depfile);
 	}
 
 	if (inform == NULL)
 		inform = guess_input_format(arg, "dts");
-	if (outform == NULL) {
-		outform = guess_type_by_name(outname, NULL);
-		if (outform == NULL) {
+	for (i = 0; i < noutputs; i++) {
+		if (outputs[i].form)
+			continue;
+		outputs[i].form = guess_type_by_name(outputs[i].name, NULL);
+		if (outputs[i].form == NULL) {
 			if (streq(inform, "dts"))
-				outform = "dtb";
+				outputs[i].form = "dtb";
 			else
-				outform = "dts";
+				outputs[i].form = "dts";
 		}
 	}
-	if (annotate && (!streq(inform, "dts") || !streq(outform, "dts")))
-		die("--annotate requires -I dts -O dts\n");
-	if (streq(inform, "dts"))
+	if (annotate) {
+		if (!streq(inform, "dts"))
+			die("--annotate requires -I dts -O dts\n");
+		for (i = 0; i < noutputs; i++)
+			if (!streq(outputs[i].form, "dts"))
+				die("--annotate requires -I dts -O dts\n");
+	}
+	if (a->nochecks && !streq(inform, "dtb"))
+		die("--no-checks requires -I dtb\n");
+	phase = stats_begin("input", inform);
+	if (streq(inform, "dts")) {
 		dti = dt_from_source(arg);
-	else if (streq(inform, "fs"))
+	} else if (streq(inform, "fs")) {
 		dti = dt_from_fs(arg);
-	else if(streq(inform, "dtb"))
-		dti = dt_from_blob(arg);
-	else
+	} else if(streq(inform, "dtb")) {
+		blob = read_blob(arg);
+		if ((noutputs > 1)
+		    || !can_copy_blob(a, outputs[0].form, blob))
+			dti = dt_from_blob(blob);
+	} else {
 		die("Unknown input format \"%s\"\n", inform);
-
-	dti->outname = outname;
+	}
+	stats_end(phase);
 
 	if (depfile) {
 		fputc('\n', depfile);
 		fclose(depfile);
 	}
 
-	if (cmdline_boot_cpuid != -1)
-		dti->boot_cpuid_phys = cmdline_boot_cpuid;
+	if (!dti) {
+		outf = open_output(outputs[0].name);
+		copy_blob(outf, blob, a->outversion, a->sort, a->boot_cpuid);
+		free(outputs);
+		return;
+	}
+
+	dti->outname = outputs[0].name;
 
-	fill_fullpaths(dti->dt, "");
+	if (a->boot_cpuid != -1)
+		dti->boot_cpuid_phys = a->boot_cpuid;
 
 	/* on a plugin, generate by default */
 	if (dti->dtsflags & DTSF_PLUGIN) {
 		generate_fixups = 1;
 	}
 
-	process_checks(force, dti);
+	if (!a->nochecks)
+		process_checks(a->force, dti);
 
+	phase = stats_begin("tree", "aliases");
 	if (auto_label_aliases)
-		generate_label_tree(dti, "aliases", false);
+		generate_label_tree(dti, "aliases", false, false);
+	stats_end(phase);
 
+	phase = stats_begin("tree", "symbols");
 	generate_labels_from_tree(dti, "__symbols__");
 
 	if (generate_symbols)
-		generate_label_tree(dti, "__symbols__", true);
+		generate_label_tree(dti, "__symbols__", true,
+				    generate_symbols > 1);
+	stats_end(phase);
 
+	phase = stats_begin("tree", "fixups");
 	fixup_phandles(dti, "__fixups__");
 	local_fixup_phandles(dti, "__local_fixups__");
 
@@ -350,36 +547,90 @@ int main(int argc, char *argv[])
 		generate_fixups_tree(dti, "__fixups__");
 		generate_local_fixups_tree(dti, "__local_fixups__");
 	}
+	stats_end(phase);
 
-	if (sort)
+	if (a->sort) {
+		phase = stats_begin("tree", "sort");
 		sort_tree(dti);
+		stats_end(phase);
+	}
 
-	if (streq(outname, "-")) {
-		outf = stdout;
-	} else {
-		outf = fopen(outname, "wb");
-		if (! outf)
-			die("Couldn't open output file %s: %s\n",
-			    outname, strerror(errno));
+	/* Blob based outputs share one blob, when there are several */
+	for (i = 0; i < noutputs; i++)
+		if (is_blob_format(outputs[i].form))
+			nblobs++;
+	if (nblobs > 1) {
+		phase = stats_begin("output", "flatten");
+		fb = build_flat_blob(dti, a->outversion);
+		stats_end(phase);
 	}
 
-	if (streq(outform, "dts")) {
-		dt_to_source(outf, dti);
-#ifndef NO_YAML
-	} else if (streq(outform, "yaml")) {
-		if (!streq(inform, "dts"))
-			die("YAML output format requires dts input format\n");
-		dt_to_yaml(outf, dti);
-#endif
-	} else if (streq(outform, "dtb")) {
-		dt_to_blob(outf, dti, outversion);
-	} else if (streq(outform, "asm")) {
-		dt_to_asm(outf, dti, outversion);
-	} else if (streq(outform, "null")) {
-		/* do nothing */
-	} else {
-		die("Unknown output format \"%s\"\n", outform);
+	/*
+	 * The dts writer adds type markers to property values which have
+	 * none, which would change the YAML output, so it goes last.
+	 */
+	for (i = 0; i < noutputs; i++)
+		if (!streq(outputs[i].form, "dts"))
+			write_output(a, dti, inform, &outputs[i], fb);
+	for (i = 0; i < noutputs; i++)
+		if (streq(outputs[i].form, "dts"))
+			write_output(a, dti, inform, &outputs[i], fb);
+
+	if (fb)
+		free_flat_blob(fb);
+	free(outputs);
+
+	if (a->statsformat)
+		stats_report(a->statsformat, a->statsname, dti);
+}
+
+/* Run one line of a --batch manifest, on top of the command line options */
+static void batch_job(int argc, char *argv[], void *data)
+{
+	struct dtc_args a = *(const struct dtc_args *)data;
+
+	/* -j on the command line is the number of jobs run at once */
+	jobs = 1;
+	a.batchname = NULL;
+	optind = 1;
+	parse_args(&a, argc, argv);
+	if (a.batchname)
+		die("--batch can't be used within a batch manifest\n");
+	if (argc != (optind+1))
+		usage("missing files");
+
+	compile(&a, argv[optind]);
+}
+
+int main(int argc, char *argv[])
+{
+	struct dtc_args a = {
+		.outversion = DEFAULT_FDT_VERSION,
+		.boot_cpuid = -1,
+	};
+	const char *arg;
+
+	quiet      = 0;
+	reservenum = 0;
+	minsize    = 0;
+	padsize    = 0;
+	alignsize  = 0;
+
+	parse_args(&a, argc, argv);
+
+	if (a.batchname) {
+		if (argc > optind)
+			usage("input files can't be given with --batch");
+		exit(run_batch(a.batchname, jobs, batch_job, &a));
 	}
 
+	if (argc > (optind+1))
+		usage("missing files");
+	else if (argc < (optind+1))
+		arg = "-";
+	else
+		arg = argv[optind];
+
+	compile(&a, arg);
 	exit(0);
 }
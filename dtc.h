@@ -12,6 +12,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
@@ -44,6 +45,8 @@ extern int generate_symbols;	/* generate symbols for nodes with labels */
 extern int generate_fixups;	/* generate fixups */
 extern int auto_label_aliases;	/* auto generate labels -> aliases */
 extern int annotate;		/* annotate .dts with input source location */
+extern unsigned int jobs;	/* Number of worker threads */
+extern int preprocess;		/* Run dts input through the built-in cpp */
 
 #define PHANDLE_LEGACY	0x1
 #define PHANDLE_EPAPR	0x2
@@ -128,46 +131,43 @@ struct  marker {
 	enum markertype type;
 	unsigned int offset;
 	char *ref;
-	struct marker *next;
 };
 
 struct data {
 	unsigned int len;
+	unsigned int size;	/* allocated size of val, 0 if borrowed */
 	char *val;
-	struct marker *markers;
+	struct marker *markers;	/* sorted by offset */
+	unsigned int nmarkers, maxmarkers;
 };
 
 
 #define empty_data ((struct data){ 0 /* all .members = 0 or NULL */ })
 
-#define for_each_marker(m) \
-	for (; (m); (m) = (m)->next)
-#define for_each_marker_of_type(m, t) \
-	for_each_marker(m) \
+#define for_each_marker(d, m) \
+	for ((m) = (d).markers; (m) && ((m) < (d).markers + (d).nmarkers); (m)++)
+#define for_each_marker_of_type(d, m, t) \
+	for_each_marker(d, m) \
 		if ((m)->type == (t))
 
-static inline struct marker *next_type_marker(struct marker *m)
+/* Length of the data up to the type marker after m, or 0 if m is the last */
+static inline size_t type_marker_length(struct data d, struct marker *m)
 {
-	for_each_marker(m)
-		if (is_type_marker(m->type))
-			break;
-	return m;
-}
-
-static inline size_t type_marker_length(struct marker *m)
-{
-	struct marker *next = next_type_marker(m->next);
+	struct marker *next;
 
-	if (next)
-		return next->offset - m->offset;
+	for (next = m + 1; next < d.markers + d.nmarkers; next++)
+		if (is_type_marker(next->type))
+			return next->offset - m->offset;
 	return 0;
 }
 
 void data_free(struct data d);
 
+/* Make room for at least xlen more bytes, so appending them won't realloc */
 struct data data_grow_for(struct data d, unsigned int xlen);
 
 struct data data_copy_mem(const char *mem, int len);
+struct data data_borrow_mem(char *mem, int len);
 struct data data_copy_escape_string(const char *s, int len);
 struct data data_copy_file(FILE *f, size_t len);
 
@@ -184,9 +184,13 @@ struct data data_append_zeroes(struct data d, int len);
 struct data data_append_align(struct data d, int align);
 struct data data_insert_data(struct data d, struct marker *m, struct data old);
 
-struct marker *alloc_marker(unsigned int offset, enum markertype type,
-			    char *ref);
 struct data data_add_marker(struct data d, enum markertype type, char *ref);
+struct data data_insert_marker(struct data d, unsigned int i,
+			       enum markertype type, unsigned int offset,
+			       char *ref);
+unsigned int data_marker_index(struct data d, unsigned int offset);
+struct marker *data_find_marker(struct data d, enum markertype type,
+				unsigned int offset);
 
 bool data_is_one_string(struct data d);
 
@@ -196,6 +200,31 @@ bool data_is_one_string(struct data d);
 #define MAX_NODENAME_LEN	31
 
 /* Live trees */
+
+/*
+ * Node and property names are interned: each distinct name is stored
+ * once, along with its hash, so names are compared by pointer.
+ */
+struct name_entry {
+	unsigned int hash, len;
+	unsigned int basenamelen;	/* up to any '@' */
+	char name[];
+};
+
+const char *name_intern(const char *name);
+const char *name_lookup(const char *name);
+
+static inline const struct name_entry *name_entry(const char *name)
+{
+	return (const struct name_entry *)(name
+					   - offsetof(struct name_entry, name));
+}
+
+static inline unsigned int name_hash(const char *name)
+{
+	return name_entry(name)->hash;
+}
+
 struct label {
 	bool deleted;
 	char *label;
@@ -208,7 +237,7 @@ struct bus_type {
 
 struct property {
 	bool deleted;
-	char *name;
+	const char *name;	/* interned */
 	struct data val;
 
 	struct property *next;
@@ -217,28 +246,36 @@ struct property {
 	struct srcpos *srcpos;
 };
 
+/*
+ * The fields used in walking and checking the tree come first, to fit
+ * in one cache line on 64-bit hosts, ahead of those mostly used for
+ * output and diagnostics.
+ */
 struct node {
-	bool deleted;
-	char *name;
+	const char *name;	/* interned */
 	struct property *proplist;
 	struct node *children;
 
 	struct node *parent;
 	struct node *next_sibling;
 
-	char *fullpath;
-	size_t basenamelen;
-
+	const struct bus_type *bus;
 	cell_t phandle;
 	int addr_cells, size_cells;
 
+	bool deleted, omit_if_unused, is_referenced;
+
 	struct label *labels;
-	const struct bus_type *bus;
 	struct srcpos *srcpos;
-
-	bool omit_if_unused, is_referenced;
+	char *fullpath;		/* only once built by get_node_path() */
 };
 
+/* The length of the node's name without its unit address */
+static inline size_t node_basenamelen(const struct node *node)
+{
+	return name_entry(node->name)->basenamelen;
+}
+
 #define for_each_label_withdel(l0, l) \
 	for ((l) = (l0); (l); (l) = (l)->next)
 
@@ -280,16 +317,17 @@ struct node *merge_nodes(struct node *old_node, struct node *new_node);
 struct node *add_orphan_node(struct node *old_node, struct node *new_node, char *ref);
 
 void add_property(struct node *node, struct property *prop);
-void delete_property_by_name(struct node *node, char *name);
+void delete_property_by_name(struct node *node, const char *name);
 void delete_property(struct property *prop);
 void add_child(struct node *parent, struct node *child);
-void delete_node_by_name(struct node *parent, char *name);
+void delete_node_by_name(struct node *parent, const char *name);
 void delete_node(struct node *node);
 void append_to_property(struct node *node,
 			char *name, const void *data, int len,
 			enum markertype type);
 
 const char *get_unitname(struct node *node);
+const char *get_node_path(struct node *node);
 struct property *get_property(struct node *node, const char *propname);
 cell_t propval_cell(struct property *prop);
 cell_t propval_cell_n(struct property *prop, unsigned int n);
@@ -338,9 +376,11 @@ struct dt_info {
 struct dt_info *build_dt_info(unsigned int dtsflags,
 			      struct reserve_info *reservelist,
 			      struct node *tree, uint32_t boot_cpuid_phys);
+void sort_reserve_entries(struct dt_info *dti);
 void sort_tree(struct dt_info *dti);
 void generate_labels_from_tree(struct dt_info *dti, const char *name);
-void generate_label_tree(struct dt_info *dti, const char *name, bool allocph);
+void generate_label_tree(struct dt_info *dti, const char *name, bool allocph,
+			 bool sorted);
 void generate_fixups_tree(struct dt_info *dti, const char *name);
 void fixup_phandles(struct dt_info *dti, const char *name);
 void generate_local_fixups_tree(struct dt_info *dti, const char *name);
@@ -355,8 +395,20 @@ void process_checks(bool force, struct dt_info *dti);
 
 void dt_to_blob(FILE *f, struct dt_info *dti, int version);
 void dt_to_asm(FILE *f, struct dt_info *dti, int version);
+void dt_to_c(FILE *f, struct dt_info *dti, int version);
+
+struct flat_blob;
+struct flat_blob *build_flat_blob(struct dt_info *dti, int version);
+void flat_blob_to_dtb(FILE *f, struct flat_blob *fb);
+void flat_blob_to_asm(FILE *f, struct flat_blob *fb);
+void flat_blob_to_c(FILE *f, struct flat_blob *fb);
+void free_flat_blob(struct flat_blob *fb);
 
-struct dt_info *dt_from_blob(const char *fname);
+char *read_blob(const char *fname);
+struct dt_info *dt_from_blob(char *blob);
+bool blob_copyable(const char *blob);
+void copy_blob(FILE *f, char *blob, int version, bool sort,
+	       long long boot_cpuid);
 
 /* Tree source */
 
@@ -374,4 +426,24 @@ void dt_to_yaml(FILE *f, struct dt_info *dti);
 
 struct dt_info *dt_from_fs(const char *dirname);
 
+/* Statistics */
+
+extern bool stats_enabled;
+
+void stats_init(void);
+uint64_t stats_now(void);
+long stats_maxrss(void);
+void stats_add(const char *cat, const char *name, int thread,
+	       uint64_t start, uint64_t end, long maxrss);
+int stats_begin(const char *cat, const char *name);
+void stats_end(int phase);
+void stats_report(const char *format, const char *fname, struct dt_info *dti);
+
+/* Batch compilation */
+
+typedef void (*job_fn)(int argc, char *argv[], void *data);
+
+int run_batch(const char *manifest, unsigned int maxjobs, job_fn fn,
+	      void *data);
+
 #endif /* DTC_H */
@@ -3,6 +3,13 @@
  * (C) Copyright David Gibson <dwg@au1.ibm.com>, IBM Corporation.  2005.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libfdt.h>
+
 #include "dtc.h"
 #include "srcpos.h"
 
@@ -42,50 +49,139 @@ struct emitter {
 	void (*property)(void *, struct label *labels);
 };
 
+/*
+ * Labels, and their offsets in the blob, for the asm and C output.  Those on
+ * nodes, properties and values are picked up as the structure block is
+ * written, so the list is in order of offset throughout.
+ */
+enum blob_label_type {
+	BLOB_PART,		/* dt_blob_start, dt_header and so on */
+	RESERVE_LABEL,
+	NODE_LABEL,
+	NODE_END_LABEL,		/* just after the node */
+	PROP_LABEL,
+	VALUE_LABEL,
+};
+
+struct blob_label {
+	unsigned int offset;
+	const char *name;
+	enum blob_label_type type;
+};
+
+struct blob_labels {
+	struct blob_label *l;
+	int n, max;
+	unsigned int base;	/* offset of the structure block */
+};
+
+static void add_blob_label(struct blob_labels *labels, unsigned int offset,
+			   const char *name, enum blob_label_type type)
+{
+	struct blob_label *l;
+
+	if (labels->n == labels->max) {
+		labels->max = labels->max ? 2 * labels->max : 64;
+		labels->l = xrealloc(labels->l,
+				     labels->max * sizeof(*labels->l));
+	}
+
+	l = &labels->l[labels->n++];
+	assert((labels->n == 1) || (offset >= l[-1].offset));
+	l->offset = offset;
+	l->name = name;
+	l->type = type;
+}
+
+/*
+ * The binary emitter runs twice over the tree: once with a NULL buf to
+ * work out the size of the structure block, then again to write it
+ * straight into its place in the output blob, noting any labels as it
+ * goes.
+ */
+struct blob_out {
+	char *buf;
+	unsigned int len;
+	struct blob_labels *labels;
+};
+
+static void bin_emit_labels(struct blob_out *out, struct label *labels,
+			    enum blob_label_type type)
+{
+	struct label *l;
+
+	if (!out->buf || !out->labels)
+		return;
+
+	for_each_label(labels, l)
+		add_blob_label(out->labels, out->labels->base + out->len,
+			       l->label, type);
+}
+
+static void bin_emit_bytes(struct blob_out *out, const void *p, int len)
+{
+	if (out->buf)
+		memcpy(out->buf + out->len, p, len);
+	out->len += len;
+}
+
 static void bin_emit_cell(void *e, cell_t val)
 {
-	struct data *dtbuf = e;
+	fdt32_t beval = cpu_to_fdt32(val);
 
-	*dtbuf = data_append_cell(*dtbuf, val);
+	bin_emit_bytes(e, &beval, sizeof(beval));
 }
 
 static void bin_emit_string(void *e, const char *str, int len)
 {
-	struct data *dtbuf = e;
+	struct blob_out *out = e;
 
 	if (len == 0)
 		len = strlen(str);
 
-	*dtbuf = data_append_data(*dtbuf, str, len);
-	*dtbuf = data_append_byte(*dtbuf, '\0');
+	bin_emit_bytes(out, str, len);
+	bin_emit_bytes(out, "", 1);
 }
 
 static void bin_emit_align(void *e, int a)
 {
-	struct data *dtbuf = e;
+	struct blob_out *out = e;
+	unsigned int newlen = ALIGN(out->len, a);
 
-	*dtbuf = data_append_align(*dtbuf, a);
+	if (out->buf)
+		memset(out->buf + out->len, 0, newlen - out->len);
+	out->len = newlen;
 }
 
 static void bin_emit_data(void *e, struct data d)
 {
-	struct data *dtbuf = e;
+	struct blob_out *out = e;
+	struct marker *m;
+
+	if (out->buf && out->labels)
+		for_each_marker_of_type(d, m, LABEL)
+			add_blob_label(out->labels,
+				       out->labels->base + out->len + m->offset,
+				       m->ref, VALUE_LABEL);
 
-	*dtbuf = data_append_data(*dtbuf, d.val, d.len);
+	bin_emit_bytes(out, d.val, d.len);
 }
 
 static void bin_emit_beginnode(void *e, struct label *labels)
 {
+	bin_emit_labels(e, labels, NODE_LABEL);
 	bin_emit_cell(e, FDT_BEGIN_NODE);
 }
 
 static void bin_emit_endnode(void *e, struct label *labels)
 {
 	bin_emit_cell(e, FDT_END_NODE);
+	bin_emit_labels(e, labels, NODE_END_LABEL);
 }
 
 static void bin_emit_property(void *e, struct label *labels)
 {
+	bin_emit_labels(e, labels, PROP_LABEL);
 	bin_emit_cell(e, FDT_PROP);
 }
 
@@ -99,142 +195,98 @@ static struct emitter bin_emitter = {
 	.property = bin_emit_property,
 };
 
-static void emit_label(FILE *f, const char *prefix, const char *label)
-{
-	fprintf(f, "\t.globl\t%s_%s\n", prefix, label);
-	fprintf(f, "%s_%s:\n", prefix, label);
-	fprintf(f, "_%s_%s:\n", prefix, label);
-}
+/*
+ * The strings block.  A name which is a suffix of one already in the
+ * block shares its bytes, so every suffix of every string is indexed by
+ * the offset of its first occurrence.
+ */
+struct strtab {
+	struct data d;
+	struct hashtab suffixes;	/* offset of each indexed suffix */
+	struct hashtab names;	/* offsets of interned names, by pointer */
+};
 
-static void emit_offset_label(FILE *f, const char *label, int offset)
-{
-	fprintf(f, "\t.globl\t%s\n", label);
-	fprintf(f, "%s\t= . + %d\n", label, offset);
-}
+struct strtab_name {
+	const char *name;
+	unsigned int offset;
+};
 
-#define ASM_EMIT_BELONG(f, fmt, ...) \
-	{ \
-		fprintf((f), "\t.byte\t((" fmt ") >> 24) & 0xff\n", __VA_ARGS__); \
-		fprintf((f), "\t.byte\t((" fmt ") >> 16) & 0xff\n", __VA_ARGS__); \
-		fprintf((f), "\t.byte\t((" fmt ") >> 8) & 0xff\n", __VA_ARGS__); \
-		fprintf((f), "\t.byte\t(" fmt ") & 0xff\n", __VA_ARGS__); \
-	}
+struct strtab_key {
+	const char *base, *str;
+};
 
-static void asm_emit_cell(void *e, cell_t val)
+static bool strtab_matches(const void *slot, const void *key)
 {
-	FILE *f = e;
+	const struct strtab_key *k = key;
 
-	fprintf(f, "\t.byte\t0x%02x\n" "\t.byte\t0x%02x\n"
-		"\t.byte\t0x%02x\n" "\t.byte\t0x%02x\n",
-		(val >> 24) & 0xff, (val >> 16) & 0xff,
-		(val >> 8) & 0xff, val & 0xff);
+	return streq(k->base + *(const unsigned int *)slot, k->str);
 }
 
-static void asm_emit_string(void *e, const char *str, int len)
+static unsigned int *strtab_find(struct strtab *t, const char *str,
+				 uint32_t hash)
 {
-	FILE *f = e;
+	struct strtab_key k = { t->d.val, str };
 
-	if (len != 0)
-		fprintf(f, "\t.asciz\t\"%.*s\"\n", len, str);
-	else
-		fprintf(f, "\t.asciz\t\"%s\"\n", str);
+	return hashtab_find(&t->suffixes, hash, strtab_matches, &k);
 }
 
-static void asm_emit_align(void *e, int a)
+static void strtab_index(struct strtab *t, unsigned int offset)
 {
-	FILE *f = e;
+	const char *str = t->d.val + offset;
+	uint32_t hash = fnv1a_hash(str, strlen(str), FNV1A_SEED);
+	unsigned int *slot;
 
-	fprintf(f, "\t.balign\t%d, 0\n", a);
+	if (!strtab_find(t, str, hash)) {
+		slot = hashtab_add(&t->suffixes, sizeof(*slot), hash);
+		*slot = offset;
+	}
 }
 
-static void asm_emit_data(void *e, struct data d)
+static int stringtable_insert(struct strtab *t, const char *str)
 {
-	FILE *f = e;
-	unsigned int off = 0;
-	struct marker *m = d.markers;
-
-	for_each_marker_of_type(m, LABEL)
-		emit_offset_label(f, m->ref, m->offset);
-
-	while ((d.len - off) >= sizeof(uint32_t)) {
-		asm_emit_cell(e, dtb_ld32(d.val + off));
-		off += sizeof(uint32_t);
-	}
+	unsigned int i, offset, len = strlen(str);
+	unsigned int *slot;
 
-	while ((d.len - off) >= 1) {
-		fprintf(f, "\t.byte\t0x%hhx\n", d.val[off]);
-		off += 1;
-	}
+	slot = strtab_find(t, str, fnv1a_hash(str, len, FNV1A_SEED));
+	if (slot)
+		return *slot;
 
-	assert(off == d.len);
-}
+	offset = t->d.len;
+	t->d = data_append_data(t->d, str, len + 1);
+	for (i = offset; i <= offset + len; i++)
+		strtab_index(t, i);
 
-static void asm_emit_beginnode(void *e, struct label *labels)
-{
-	FILE *f = e;
-	struct label *l;
-
-	for_each_label(labels, l) {
-		fprintf(f, "\t.globl\t%s\n", l->label);
-		fprintf(f, "%s:\n", l->label);
-	}
-	fprintf(f, "\t/* FDT_BEGIN_NODE */\n");
-	asm_emit_cell(e, FDT_BEGIN_NODE);
+	return offset;
 }
 
-static void asm_emit_endnode(void *e, struct label *labels)
+static bool strtab_name_matches(const void *slot, const void *key)
 {
-	FILE *f = e;
-	struct label *l;
-
-	fprintf(f, "\t/* FDT_END_NODE */\n");
-	asm_emit_cell(e, FDT_END_NODE);
-	for_each_label(labels, l) {
-		fprintf(f, "\t.globl\t%s_end\n", l->label);
-		fprintf(f, "%s_end:\n", l->label);
-	}
+	return ((const struct strtab_name *)slot)->name == key;
 }
 
-static void asm_emit_property(void *e, struct label *labels)
+/* As stringtable_insert(), for an interned name */
+static int stringtable_insert_name(struct strtab *t, const char *name)
 {
-	FILE *f = e;
-	struct label *l;
+	struct strtab_name *s;
 
-	for_each_label(labels, l) {
-		fprintf(f, "\t.globl\t%s\n", l->label);
-		fprintf(f, "%s:\n", l->label);
+	s = hashtab_find(&t->names, name_hash(name), strtab_name_matches, name);
+	if (!s) {
+		s = hashtab_add(&t->names, sizeof(*s), name_hash(name));
+		s->name = name;
+		s->offset = stringtable_insert(t, name);
 	}
-	fprintf(f, "\t/* FDT_PROP */\n");
-	asm_emit_cell(e, FDT_PROP);
+	return s->offset;
 }
 
-static struct emitter asm_emitter = {
-	.cell = asm_emit_cell,
-	.string = asm_emit_string,
-	.align = asm_emit_align,
-	.data = asm_emit_data,
-	.beginnode = asm_emit_beginnode,
-	.endnode = asm_emit_endnode,
-	.property = asm_emit_property,
-};
-
-static int stringtable_insert(struct data *d, const char *str)
+static void strtab_free(struct strtab *t)
 {
-	unsigned int i;
-
-	/* FIXME: do this more efficiently? */
-
-	for (i = 0; i < d->len; i++) {
-		if (streq(str, d->val + i))
-			return i;
-	}
-
-	*d = data_append_data(*d, str, strlen(str)+1);
-	return i;
+	data_free(t->d);
+	hashtab_free(&t->suffixes);
+	hashtab_free(&t->names);
 }
 
 static void flatten_tree(struct node *tree, struct emitter *emit,
-			 void *etarget, struct data *strbuf,
+			 void *etarget, struct strtab *strbuf,
 			 struct version_info *vi)
 {
 	struct property *prop;
@@ -247,7 +299,7 @@ static void flatten_tree(struct node *tree, struct emitter *emit,
 	emit->beginnode(etarget, tree->labels);
 
 	if (vi->flags & FTF_FULLPATH)
-		emit->string(etarget, tree->fullpath, 0);
+		emit->string(etarget, get_node_path(tree), 0);
 	else
 		emit->string(etarget, tree->name, 0);
 
@@ -259,7 +311,7 @@ static void flatten_tree(struct node *tree, struct emitter *emit,
 		if (streq(prop->name, "name"))
 			seen_name_prop = true;
 
-		nameoff = stringtable_insert(strbuf, prop->name);
+		nameoff = stringtable_insert_name(strbuf, prop->name);
 
 		emit->property(etarget, prop->labels);
 		emit->cell(etarget, prop->val.len);
@@ -274,13 +326,13 @@ static void flatten_tree(struct node *tree, struct emitter *emit,
 
 	if ((vi->flags & FTF_NAMEPROPS) && !seen_name_prop) {
 		emit->property(etarget, NULL);
-		emit->cell(etarget, tree->basenamelen+1);
+		emit->cell(etarget, node_basenamelen(tree)+1);
 		emit->cell(etarget, stringtable_insert(strbuf, "name"));
 
-		if ((vi->flags & FTF_VARALIGN) && ((tree->basenamelen+1) >= 8))
+		if ((vi->flags & FTF_VARALIGN) && ((node_basenamelen(tree)+1) >= 8))
 			emit->align(etarget, 8);
 
-		emit->string(etarget, tree->name, tree->basenamelen);
+		emit->string(etarget, tree->name, node_basenamelen(tree));
 		emit->align(etarget, sizeof(cell_t));
 	}
 
@@ -291,24 +343,31 @@ static void flatten_tree(struct node *tree, struct emitter *emit,
 	emit->endnode(etarget, tree->labels);
 }
 
-static struct data flatten_reserve_list(struct reserve_info *reservelist,
-				 struct version_info *vi)
+static unsigned int reserve_list_size(struct reserve_info *reservelist)
 {
 	struct reserve_info *re;
-	struct data d = empty_data;
-	unsigned int j;
+	unsigned int n = reservenum;
 
-	for (re = reservelist; re; re = re->next) {
-		d = data_append_re(d, re->address, re->size);
+	for (re = reservelist; re; re = re->next)
+		n++;
+
+	return n * sizeof(struct fdt_reserve_entry);
+}
+
+static void flatten_reserve_list(struct fdt_reserve_entry *fre,
+				 struct reserve_info *reservelist)
+{
+	struct reserve_info *re;
+
+	for (re = reservelist; re; re = re->next, fre++) {
+		fre->address = cpu_to_fdt64(re->address);
+		fre->size = cpu_to_fdt64(re->size);
 	}
 	/*
-	 * Add additional reserved slots if the user asked for them.
+	 * Add additional reserved slots if the user asked for them, and
+	 * the terminating entry.
 	 */
-	for (j = 0; j < reservenum; j++) {
-		d = data_append_re(d, 0, 0);
-	}
-
-	return d;
+	memset(fre, 0, (reservenum + 1) * sizeof(*fre));
 }
 
 static void make_fdt_header(struct fdt_header *fdt,
@@ -343,31 +402,107 @@ static void make_fdt_header(struct fdt_header *fdt,
 		fdt->size_dt_struct = cpu_to_fdt32(dtsize);
 }
 
-void dt_to_blob(FILE *f, struct dt_info *dti, int version)
+/*
+ * Blobs at least this big are written by mapping the output file, when
+ * it is a regular file, rather than by building them in memory first.
+ */
+#define BLOB_MMAP_MIN	(1024 * 1024)
+
+static void *map_output(FILE *f, size_t size)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	if (size < BLOB_MMAP_MIN)
+		return NULL;
+
+	fd = fileno(f);
+	if ((fd < 0) || (fflush(f) != 0) || (fstat(fd, &st) != 0)
+	    || !S_ISREG(st.st_mode) || (st.st_size != 0)
+	    || (lseek(fd, 0, SEEK_CUR) != 0))
+		return NULL;
+
+	/* Allocate the space now, so running out of it isn't a SIGBUS */
+	if (posix_fallocate(fd, 0, size) != 0)
+		return NULL;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		if (ftruncate(fd, 0) != 0)
+			die("Error writing device tree blob: %s\n",
+			    strerror(errno));
+		return NULL;
+	}
+
+	return p;
+}
+
+static void unmap_output(FILE *f, void *p, size_t size)
+{
+	if ((munmap(p, size) != 0) || (fseek(f, size, SEEK_SET) != 0))
+		die("Error writing device tree blob: %s\n", strerror(errno));
+}
+
+/*
+ * The structure block is either flattened from a live tree, or copied
+ * node by node from another blob.
+ */
+struct blob_source {
+	struct node *tree;
+	const char *fdt;
+	bool sort;
+};
+
+static void flatten_blob(const char *fdt, int offset, struct blob_out *dt,
+			 struct strtab *strbuf, bool sort);
+
+static void flatten_source(struct blob_source *src, struct blob_out *dt,
+			   struct strtab *strbuf, struct version_info *vi)
+{
+	if (src->tree)
+		flatten_tree(src->tree, &bin_emitter, dt, strbuf, vi);
+	else
+		flatten_blob(src->fdt, 0, dt, strbuf, src->sort);
+	bin_emit_cell(dt, FDT_END);
+}
+
+static struct version_info *find_version(int version)
 {
-	struct version_info *vi = NULL;
 	unsigned int i;
-	struct data blob       = empty_data;
-	struct data reservebuf = empty_data;
-	struct data dtbuf      = empty_data;
-	struct data strbuf     = empty_data;
-	struct fdt_header fdt;
-	int padlen = 0;
 
 	for (i = 0; i < ARRAY_SIZE(version_table); i++) {
 		if (version_table[i].version == version)
-			vi = &version_table[i];
+			return &version_table[i];
 	}
-	if (!vi)
-		die("Unknown device tree blob version %d\n", version);
 
-	flatten_tree(dti->dt, &bin_emitter, &dtbuf, &strbuf, vi);
-	bin_emit_cell(&dtbuf, FDT_END);
+	die("Unknown device tree blob version %d\n", version);
+}
+
+/*
+ * Builds the blob, mapped from f if that is possible (see map_output()),
+ * or in memory otherwise.  If labels is given, it is filled in with the
+ * labels in the tree and the parts of the blob, for the asm output.
+ */
+static char *build_blob(FILE *f, struct dt_info *dti, struct version_info *vi,
+			struct blob_source *src, struct blob_labels *labels,
+			bool *mapped)
+{
+	struct blob_out dt = { NULL, 0, labels };
+	struct strtab strbuf = { 0 };
+	struct fdt_header fdt;
+	unsigned int reservesize, totalsize;
+	unsigned int off_rsvmap, off_struct, off_strings;
+	int padlen = 0;
+	char *blob;
 
-	reservebuf = flatten_reserve_list(dti->reservelist, vi);
+	/* Size the structure block, and build the strings block */
+	flatten_source(src, &dt, &strbuf, vi);
+
+	reservesize = reserve_list_size(dti->reservelist);
 
 	/* Make header */
-	make_fdt_header(&fdt, vi, reservebuf.len, dtbuf.len, strbuf.len,
+	make_fdt_header(&fdt, vi, reservesize, dt.len, strbuf.d.len,
 			dti->boot_cpuid_phys);
 
 	/*
@@ -398,169 +533,459 @@ void dt_to_blob(FILE *f, struct dt_info *dti, int version)
 	}
 
 	/*
-	 * Assemble the blob: start with the header, add with alignment
-	 * the reserve buffer, add the reserve map terminating zeroes,
-	 * the device tree itself, and finally the strings.
+	 * Assemble the blob in place: the header, the reserve map with
+	 * its terminating entry, the device tree itself, the strings and
+	 * any padding, each at the offset given in the header.
 	 */
-	blob = data_append_data(blob, &fdt, vi->hdr_size);
-	blob = data_append_align(blob, 8);
-	blob = data_merge(blob, reservebuf);
-	blob = data_append_zeroes(blob, sizeof(struct fdt_reserve_entry));
-	blob = data_merge(blob, dtbuf);
-	blob = data_merge(blob, strbuf);
+	totalsize = fdt32_to_cpu(fdt.totalsize);
+	off_rsvmap = fdt32_to_cpu(fdt.off_mem_rsvmap);
+	off_struct = fdt32_to_cpu(fdt.off_dt_struct);
+	off_strings = fdt32_to_cpu(fdt.off_dt_strings);
+
+	blob = f ? map_output(f, totalsize) : NULL;
+	*mapped = blob;
+	if (!*mapped)
+		blob = xmalloc(totalsize);
+
+	memset(blob, 0, off_rsvmap);
+	memcpy(blob, &fdt, vi->hdr_size);
+	flatten_reserve_list((struct fdt_reserve_entry *)(blob + off_rsvmap),
+			     dti->reservelist);
+
+	if (labels) {
+		struct reserve_info *re;
+		unsigned int off = off_rsvmap;
+		struct label *l;
+
+		add_blob_label(labels, 0, "blob_start", BLOB_PART);
+		add_blob_label(labels, 0, "header", BLOB_PART);
+		add_blob_label(labels, off_rsvmap, "reserve_map", BLOB_PART);
+		for (re = dti->reservelist; re; re = re->next) {
+			for_each_label(re->labels, l)
+				add_blob_label(labels, off, l->label,
+					       RESERVE_LABEL);
+			off += sizeof(struct fdt_reserve_entry);
+		}
+		add_blob_label(labels, off_struct, "struct_start", BLOB_PART);
+		labels->base = off_struct;
+	}
+
+	dt.buf = blob + off_struct;
+	dt.len = 0;
+	flatten_source(src, &dt, &strbuf, vi);
+	assert(blob + off_strings == dt.buf + dt.len);
+
+	memcpy(blob + off_strings, strbuf.d.val, strbuf.d.len);
 
 	/*
 	 * If the user asked for more space than is used, pad out the blob.
 	 */
 	if (padlen > 0)
-		blob = data_append_zeroes(blob, padlen);
+		memset(blob + totalsize - padlen, 0, padlen);
+
+	if (labels) {
+		add_blob_label(labels, off_strings, "struct_end", BLOB_PART);
+		add_blob_label(labels, off_strings, "strings_start", BLOB_PART);
+		add_blob_label(labels, off_strings + strbuf.d.len,
+			       "strings_end", BLOB_PART);
+		add_blob_label(labels, off_strings + strbuf.d.len,
+			       "blob_end", BLOB_PART);
+		add_blob_label(labels, totalsize, "blob_abs_end", BLOB_PART);
+	}
+
+	strtab_free(&strbuf);
+
+	return blob;
+}
 
-	if (fwrite(blob.val, blob.len, 1, f) != 1) {
+static void fwrite_blob(FILE *f, const char *blob)
+{
+	if (fwrite(blob, fdt_totalsize(blob), 1, f) != 1) {
 		if (ferror(f))
 			die("Error writing device tree blob: %s\n",
 			    strerror(errno));
 		else
 			die("Short write on device tree blob\n");
 	}
+}
 
-	/*
-	 * data_merge() frees the right-hand element so only the blob
-	 * remains to be freed.
-	 */
-	data_free(blob);
+static void write_blob(FILE *f, struct dt_info *dti, struct version_info *vi,
+		       struct blob_source *src)
+{
+	bool mapped;
+	char *blob;
+
+	blob = build_blob(f, dti, vi, src, NULL, &mapped);
+
+	if (mapped) {
+		unmap_output(f, blob, fdt_totalsize(blob));
+	} else {
+		fwrite_blob(f, blob);
+		free(blob);
+	}
 }
 
-static void dump_stringtable_asm(FILE *f, struct data strbuf)
+void dt_to_blob(FILE *f, struct dt_info *dti, int version)
 {
-	const char *p;
-	int len;
+	struct blob_source src = { .tree = dti->dt };
 
-	p = strbuf.val;
+	write_blob(f, dti, find_version(version), &src);
+}
+
+struct blob_item {
+	const char *name;
+	int offset;
+};
+
+static int cmp_blob_item(const void *ax, const void *bx)
+{
+	const struct blob_item *a = ax, *b = bx;
+
+	return strcmp(a->name, b->name);
+}
 
-	while (p < (strbuf.val + strbuf.len)) {
-		len = strlen(p);
-		fprintf(f, "\t.asciz \"%s\"\n", p);
-		p += len+1;
+static void add_blob_item(struct blob_item **items, int *n, int *max,
+			  const char *name, int offset)
+{
+	if (*n == *max) {
+		*max = *max ? 2 * *max : 8;
+		*items = xrealloc(*items, *max * sizeof(**items));
 	}
+	(*items)[*n].name = name;
+	(*items)[(*n)++].offset = offset;
 }
 
-void dt_to_asm(FILE *f, struct dt_info *dti, int version)
+/*
+ * Copy the node at offset in fdt, putting its properties before its
+ * subnodes as unflatten_tree() would, and sorting both as sort_tree()
+ * would if asked.
+ */
+static void flatten_blob(const char *fdt, int offset, struct blob_out *dt,
+			 struct strtab *strbuf, bool sort)
 {
-	struct version_info *vi = NULL;
-	unsigned int i;
-	struct data strbuf = empty_data;
-	struct reserve_info *re;
-	const char *symprefix = "dt";
+	struct blob_item *props = NULL, *nodes = NULL;
+	int nprops = 0, nnodes = 0, maxprops = 0, maxnodes = 0;
+	const struct fdt_property *prop;
+	const char *name;
+	int len, depth = 0, nextoffset, i;
+	uint32_t tag;
+
+	while (fdt_next_tag(fdt, offset, &nextoffset) == FDT_NOP)
+		offset = nextoffset;
+
+	name = fdt_get_name(fdt, offset, &len);
+	bin_emit_cell(dt, FDT_BEGIN_NODE);
+	bin_emit_bytes(dt, name, len);
+	bin_emit_bytes(dt, "", 1);
+	bin_emit_align(dt, sizeof(cell_t));
+
+	while (depth >= 0) {
+		offset = nextoffset;
+		tag = fdt_next_tag(fdt, offset, &nextoffset);
+
+		switch (tag) {
+		case FDT_PROP:
+			if (depth > 0)
+				break;
+			if (nnodes)
+				fprintf(stderr, "Warning: Flat tree input has "
+					"subnodes preceding a property.\n");
+			prop = fdt_get_property_by_offset(fdt, offset, NULL);
+			add_blob_item(&props, &nprops, &maxprops,
+				      fdt_string(fdt, fdt32_to_cpu(prop->nameoff)),
+				      offset);
+			break;
 
-	for (i = 0; i < ARRAY_SIZE(version_table); i++) {
-		if (version_table[i].version == version)
-			vi = &version_table[i];
+		case FDT_BEGIN_NODE:
+			if (depth++ > 0)
+				break;
+			add_blob_item(&nodes, &nnodes, &maxnodes,
+				      fdt_get_name(fdt, offset, NULL), offset);
+			break;
+
+		case FDT_END_NODE:
+			depth--;
+			break;
+		}
 	}
-	if (!vi)
-		die("Unknown device tree blob version %d\n", version);
 
-	fprintf(f, "/* autogenerated by dtc, do not edit */\n\n");
+	if (sort) {
+		qsort(props, nprops, sizeof(*props), cmp_blob_item);
+		qsort(nodes, nnodes, sizeof(*nodes), cmp_blob_item);
+	}
+
+	for (i = 0; i < nprops; i++) {
+		prop = fdt_get_property_by_offset(fdt, props[i].offset, &len);
 
-	emit_label(f, symprefix, "blob_start");
-	emit_label(f, symprefix, "header");
-	fprintf(f, "\t/* magic */\n");
-	asm_emit_cell(f, FDT_MAGIC);
-	fprintf(f, "\t/* totalsize */\n");
-	ASM_EMIT_BELONG(f, "_%s_blob_abs_end - _%s_blob_start",
-			symprefix, symprefix);
-	fprintf(f, "\t/* off_dt_struct */\n");
-	ASM_EMIT_BELONG(f, "_%s_struct_start - _%s_blob_start",
-		symprefix, symprefix);
-	fprintf(f, "\t/* off_dt_strings */\n");
-	ASM_EMIT_BELONG(f, "_%s_strings_start - _%s_blob_start",
-		symprefix, symprefix);
-	fprintf(f, "\t/* off_mem_rsvmap */\n");
-	ASM_EMIT_BELONG(f, "_%s_reserve_map - _%s_blob_start",
-		symprefix, symprefix);
-	fprintf(f, "\t/* version */\n");
-	asm_emit_cell(f, vi->version);
-	fprintf(f, "\t/* last_comp_version */\n");
-	asm_emit_cell(f, vi->last_comp_version);
-
-	if (vi->flags & FTF_BOOTCPUID) {
-		fprintf(f, "\t/* boot_cpuid_phys */\n");
-		asm_emit_cell(f, dti->boot_cpuid_phys);
-	}
-
-	if (vi->flags & FTF_STRTABSIZE) {
-		fprintf(f, "\t/* size_dt_strings */\n");
-		ASM_EMIT_BELONG(f, "_%s_strings_end - _%s_strings_start",
-				symprefix, symprefix);
-	}
-
-	if (vi->flags & FTF_STRUCTSIZE) {
-		fprintf(f, "\t/* size_dt_struct */\n");
-		ASM_EMIT_BELONG(f, "_%s_struct_end - _%s_struct_start",
-			symprefix, symprefix);
+		bin_emit_cell(dt, FDT_PROP);
+		bin_emit_cell(dt, len);
+		bin_emit_cell(dt, stringtable_insert(strbuf, props[i].name));
+		bin_emit_bytes(dt, prop->data, len);
+		bin_emit_align(dt, sizeof(cell_t));
 	}
 
-	/*
-	 * Reserve map entries.
-	 * Align the reserve map to a doubleword boundary.
-	 * Each entry is an (address, size) pair of u64 values.
-	 * Always supply a zero-sized termination entry.
-	 */
-	asm_emit_align(f, 8);
-	emit_label(f, symprefix, "reserve_map");
+	for (i = 0; i < nnodes; i++)
+		flatten_blob(fdt, nodes[i].offset, dt, strbuf, sort);
 
-	fprintf(f, "/* Memory reserve map from source file */\n");
+	bin_emit_cell(dt, FDT_END_NODE);
 
-	/*
-	 * Use .long on high and low halves of u64s to avoid .quad
-	 * as it appears .quad isn't available in some assemblers.
-	 */
-	for (re = dti->reservelist; re; re = re->next) {
-		struct label *l;
+	free(props);
+	free(nodes);
+}
 
-		for_each_label(re->labels, l) {
-			fprintf(f, "\t.globl\t%s\n", l->label);
-			fprintf(f, "%s:\n", l->label);
+/*
+ * Whether copy_blob() can be used on a blob.  It has to be version 16 or
+ * later and pass libfdt's checks, and not be an overlay, since the fixups
+ * of an overlay are rebuilt when its tree is processed.  Anything else is
+ * left to dt_from_blob(), and its diagnostics.
+ */
+bool blob_copyable(const char *blob)
+{
+	return (fdt_check_full(blob, fdt_totalsize(blob)) == 0)
+		&& (fdt_version(blob) >= 16)
+		&& (fdt_subnode_offset(blob, 0, "__fixups__") < 0)
+		&& (fdt_subnode_offset(blob, 0, "__local_fixups__") < 0);
+}
+
+/*
+ * Write out the blob read by read_blob() again with a new layout,
+ * without building a tree from it.  The structure block is copied as
+ * dt_to_blob() would flatten the tree dt_from_blob() would have built,
+ * sorted if asked, so the output is the same either way.  The output
+ * must be version 16 or later.
+ */
+void copy_blob(FILE *f, char *blob, int version, bool sort,
+	       long long boot_cpuid)
+{
+	struct version_info *vi = find_version(version);
+	struct blob_source src = { .fdt = blob, .sort = sort };
+	struct reserve_info *reservelist = NULL;
+	struct dt_info *dti;
+	uint64_t address, size;
+	int i;
+
+	assert(vi->flags & FTF_NOPS);
+
+	for (i = 0; i < fdt_num_mem_rsv(blob); i++) {
+		fdt_get_mem_rsv(blob, i, &address, &size);
+		reservelist = add_reserve_entry(reservelist,
+					build_reserve_entry(address, size));
+	}
+
+	dti = build_dt_info(DTSF_V1, reservelist, NULL,
+			    (boot_cpuid != -1) ? boot_cpuid :
+			    fdt_boot_cpuid_phys(blob));
+	if (sort)
+		sort_reserve_entries(dti);
+
+	write_blob(f, dti, vi, &src);
+}
+
+/*
+ * Bytes are written as .ascii strings, which assemble far quicker than
+ * lists of numbers and don't depend on the target's byte order.  Anything
+ * not safe to include as itself, in a string which may yet go through the
+ * preprocessor, is given as an octal escape.
+ */
+static void asm_emit_bytes(FILE *f, const char *p, unsigned int len)
+{
+	char line[sizeof("\t.ascii\t\"\"\n") + 64 * sizeof("\\000")];
+	unsigned int i, n;
+	char *q;
+
+	while (len) {
+		n = (len < 64) ? len : 64;
+
+		q = line + sprintf(line, "\t.ascii\t\"");
+		for (i = 0; i < n; i++) {
+			unsigned char c = p[i];
+
+			if ((c >= ' ') && (c <= '~') && !strchr("\"\\?", c)) {
+				*q++ = c;
+			} else {
+				*q++ = '\\';
+				*q++ = '0' + (c >> 6);
+				*q++ = '0' + ((c >> 3) & 7);
+				*q++ = '0' + (c & 7);
+			}
 		}
-		ASM_EMIT_BELONG(f, "0x%08x", (unsigned int)(re->address >> 32));
-		ASM_EMIT_BELONG(f, "0x%08x",
-				(unsigned int)(re->address & 0xffffffff));
-		ASM_EMIT_BELONG(f, "0x%08x", (unsigned int)(re->size >> 32));
-		ASM_EMIT_BELONG(f, "0x%08x", (unsigned int)(re->size & 0xffffffff));
+		*q++ = '"';
+		*q++ = '\n';
+		fwrite(line, 1, q - line, f);
+
+		p += n;
+		len -= n;
 	}
-	for (i = 0; i < reservenum; i++) {
-		fprintf(f, "\t.long\t0, 0\n\t.long\t0, 0\n");
+}
+
+static void asm_emit_label(FILE *f, struct blob_label *l)
+{
+	const char *suffix = (l->type == NODE_END_LABEL) ? "_end" : "";
+
+	if (l->type == BLOB_PART) {
+		fprintf(f, "\t.globl\tdt_%s\n", l->name);
+		fprintf(f, "dt_%s:\n", l->name);
+		fprintf(f, "_dt_%s:\n", l->name);
+	} else {
+		fprintf(f, "\t.globl\t%s%s\n", l->name, suffix);
+		fprintf(f, "%s%s:\n", l->name, suffix);
 	}
+}
+
+/*
+ * The dtb, asm and C outputs are all written from a blob built in memory
+ * along with its labels, once for all of them when more than one is
+ * asked for.
+ */
+struct flat_blob {
+	char *blob;
+	struct blob_labels labels;
+};
+
+struct flat_blob *build_flat_blob(struct dt_info *dti, int version)
+{
+	struct blob_source src = { .tree = dti->dt };
+	struct flat_blob *fb = xmalloc(sizeof(*fb));
+	bool mapped;
+
+	memset(fb, 0, sizeof(*fb));
+	fb->blob = build_blob(NULL, dti, find_version(version), &src,
+			      &fb->labels, &mapped);
+
+	return fb;
+}
 
-	fprintf(f, "\t.long\t0, 0\n\t.long\t0, 0\n");
+void free_flat_blob(struct flat_blob *fb)
+{
+	free(fb->labels.l);
+	free(fb->blob);
+	free(fb);
+}
+
+void flat_blob_to_dtb(FILE *f, struct flat_blob *fb)
+{
+	fwrite_blob(f, fb->blob);
+}
+
+/*
+ * The asm output is the blob itself, with the labels placed at their
+ * offsets in it.
+ */
+void flat_blob_to_asm(FILE *f, struct flat_blob *fb)
+{
+	const char *blob = fb->blob;
+	unsigned int off = 0;
+	int i;
+
+	fprintf(f, "/* autogenerated by dtc, do not edit */\n\n");
+	fprintf(f, "\t.balign\t%d, 0\n", (alignsize > 8) ? alignsize : 8);
 
-	emit_label(f, symprefix, "struct_start");
-	flatten_tree(dti->dt, &asm_emitter, f, &strbuf, vi);
+	for (i = 0; i < fb->labels.n; i++) {
+		struct blob_label *l = &fb->labels.l[i];
+
+		asm_emit_bytes(f, blob + off, l->offset - off);
+		off = l->offset;
+		asm_emit_label(f, l);
+	}
+	asm_emit_bytes(f, blob + off, fdt_totalsize(blob) - off);
+}
+
+void dt_to_asm(FILE *f, struct dt_info *dti, int version)
+{
+	struct flat_blob *fb = build_flat_blob(dti, version);
 
-	fprintf(f, "\t/* FDT_END */\n");
-	asm_emit_cell(f, FDT_END);
-	emit_label(f, symprefix, "struct_end");
+	flat_blob_to_asm(f, fb);
+	free_flat_blob(fb);
+}
 
-	emit_label(f, symprefix, "strings_start");
-	dump_stringtable_asm(f, strbuf);
-	emit_label(f, symprefix, "strings_end");
+/*
+ * The C output is the blob as an array, named dt_blob_start as the asm
+ * output would have it, preceded by a #define for each label in the tree:
+ * the libfdt offset of each labelled node and property, and the offset in
+ * the blob of each labelled value and reserve map entry.
+ */
+void flat_blob_to_c(FILE *f, struct flat_blob *fb)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *blob = fb->blob;
+	unsigned int totalsize = fdt_totalsize(blob);
+	unsigned int off, j;
+	char line[12 * sizeof("0x00, ")];
+	char *q;
+	int i;
 
-	emit_label(f, symprefix, "blob_end");
+	fprintf(f, "/* autogenerated by dtc, do not edit */\n\n");
 
 	/*
-	 * If the user asked for more space than is used, pad it out.
+	 * Every offset is from the start of the blob.  The libfdt offset of
+	 * a node or property is its offset less DT_STRUCT_OFFSET.
 	 */
-	if (minsize > 0) {
-		fprintf(f, "\t.space\t%d - (_%s_blob_end - _%s_blob_start), 0\n",
-			minsize, symprefix, symprefix);
+	fprintf(f, "#define DT_STRUCT_OFFSET\t0x%x\n", fb->labels.base);
+	for (i = 0; i < fb->labels.n; i++) {
+		struct blob_label *l = &fb->labels.l[i];
+
+		switch (l->type) {
+		case NODE_LABEL:
+			fprintf(f, "#define DT_NODE_%s\t0x%x\n", l->name,
+				l->offset);
+			break;
+		case PROP_LABEL:
+			fprintf(f, "#define DT_PROP_%s\t0x%x\n", l->name,
+				l->offset);
+			break;
+		case VALUE_LABEL:
+			fprintf(f, "#define DT_VALUE_%s\t0x%x\n", l->name,
+				l->offset);
+			break;
+		case RESERVE_LABEL:
+			fprintf(f, "#define DT_RESERVE_%s\t0x%x\n", l->name,
+				l->offset);
+			break;
+		default:
+			break;
+		}
 	}
-	if (padsize > 0) {
-		fprintf(f, "\t.space\t%d, 0\n", padsize);
+
+	/* _Alignas is C11, so fall back to GCC's attribute, or to nothing */
+	fprintf(f, "\n#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)\n"
+		"#define DT_BLOB_ALIGN\t_Alignas(%d)\n"
+		"#elif defined(__GNUC__)\n"
+		"#define DT_BLOB_ALIGN\t__attribute__((aligned(%d)))\n"
+		"#else\n"
+		"#define DT_BLOB_ALIGN\n"
+		"#endif\n\n",
+		(alignsize > 8) ? alignsize : 8,
+		(alignsize > 8) ? alignsize : 8);
+	fprintf(f, "DT_BLOB_ALIGN const unsigned char dt_blob_start[%u] = {\n",
+		totalsize);
+
+	for (off = 0; off < totalsize; off += 12) {
+		unsigned int end = (totalsize - off < 12) ? totalsize : off + 12;
+
+		q = line;
+		for (j = off; j < end; j++) {
+			unsigned char c = blob[j];
+
+			*q++ = '0';
+			*q++ = 'x';
+			*q++ = hex[c >> 4];
+			*q++ = hex[c & 0xf];
+			*q++ = ',';
+			*q++ = (j + 1 < end) ? ' ' : '\n';
+		}
+		fputc('\t', f);
+		fwrite(line, 1, q - line, f);
 	}
-	if (alignsize > 0)
-		asm_emit_align(f, alignsize);
-	emit_label(f, symprefix, "blob_abs_end");
 
-	data_free(strbuf);
+	fprintf(f, "};\n");
+}
+
+void dt_to_c(FILE *f, struct dt_info *dti, int version)
+{
+	struct flat_blob *fb = build_flat_blob(dti, version);
+
+	flat_blob_to_c(f, fb);
+	free_flat_blob(fb);
 }
 
 struct inbuf {
@@ -604,11 +1029,11 @@ static void flat_realign(struct inbuf *inb, int align)
 		die("Premature end of data parsing flat device tree\n");
 }
 
-static const char *flat_read_string(struct inbuf *inb)
+static char *flat_read_string(struct inbuf *inb)
 {
 	int len = 0;
 	const char *p = inb->ptr;
-	const char *str;
+	char *str;
 
 	do {
 		if (p >= inb->limit)
@@ -625,17 +1050,22 @@ static const char *flat_read_string(struct inbuf *inb)
 	return str;
 }
 
+/*
+ * The tree borrows property values and names from the input blob, which
+ * is kept for as long as the tree is.
+ */
 static struct data flat_read_data(struct inbuf *inb, int len)
 {
-	struct data d = empty_data;
+	struct data d;
 
 	if (len == 0)
 		return empty_data;
 
-	d = data_grow_for(d, len);
-	d.len = len;
+	if ((inb->ptr + len) > inb->limit)
+		die("Premature end of data parsing flat device tree\n");
 
-	flat_read_chunk(inb, d.val, len);
+	d = data_borrow_mem(inb->ptr, len);
+	inb->ptr += len;
 
 	flat_realign(inb, sizeof(uint32_t));
 
@@ -644,7 +1074,7 @@ static struct data flat_read_data(struct inbuf *inb, int len)
 
 static char *flat_read_stringtable(struct inbuf *inb, int offset)
 {
-	const char *p;
+	char *p;
 
 	p = inb->base + offset;
 	while (1) {
@@ -658,27 +1088,49 @@ static char *flat_read_stringtable(struct inbuf *inb, int offset)
 		p++;
 	}
 
-	return xstrdup(inb->base + offset);
+	return inb->base + offset;
+}
+
+/*
+ * The strings block being read, with the names interned from it so far
+ * cached by offset, as a blob has few distinct property names
+ */
+#define STRINGS_CACHE_SIZE	1024
+
+struct strings_in {
+	struct inbuf inb;
+	struct cached_name {
+		uint32_t offset;
+		const char *name;
+	} cache[STRINGS_CACHE_SIZE];
+};
+
+static const char *flat_read_name(struct strings_in *strs, uint32_t offset)
+{
+	struct cached_name *c = &strs->cache[offset % STRINGS_CACHE_SIZE];
+
+	if (!c->name || (c->offset != offset)) {
+		c->name = name_intern(flat_read_stringtable(&strs->inb, offset));
+		c->offset = offset;
+	}
+	return c->name;
 }
 
 static struct property *flat_read_property(struct inbuf *dtbuf,
-					   struct inbuf *strbuf, int flags)
+					   struct strings_in *strs, int flags)
 {
 	uint32_t proplen, stroff;
-	char *name;
-	struct data val;
+	const char *name;
 
 	proplen = flat_read_word(dtbuf);
 	stroff = flat_read_word(dtbuf);
 
-	name = flat_read_stringtable(strbuf, stroff);
+	name = flat_read_name(strs, stroff);
 
 	if ((flags & FTF_VARALIGN) && (proplen >= 8))
 		flat_realign(dtbuf, 8);
 
-	val = flat_read_data(dtbuf, proplen);
-
-	return build_property(name, val, NULL);
+	return build_property(name, flat_read_data(dtbuf, proplen), NULL);
 }
 
 
@@ -711,7 +1163,7 @@ static struct reserve_info *flat_read_mem_reserve(struct inbuf *inb)
 }
 
 
-static const char *nodename_from_path(const char *ppath, const char *cpath)
+static char *nodename_from_path(const char *ppath, char *cpath)
 {
 	int plen;
 
@@ -729,22 +1181,26 @@ static const char *nodename_from_path(const char *ppath, const char *cpath)
 }
 
 static struct node *unflatten_tree(struct inbuf *dtbuf,
-				   struct inbuf *strbuf,
+				   struct strings_in *strs,
 				   const char *parent_flatname, int flags)
 {
 	struct node *node;
-	const char *flatname;
+	struct property **nextprop;
+	struct node **nextchild;
+	char *flatname;
 	uint32_t val;
 
 	node = build_node(NULL, NULL, NULL);
+	nextprop = &node->proplist;
+	nextchild = &node->children;
 
 	flatname = flat_read_string(dtbuf);
 
 	if (flags & FTF_FULLPATH)
-		node->name = xstrdup(nodename_from_path(parent_flatname,
-							flatname));
+		node->name = name_intern(nodename_from_path(parent_flatname,
+							    flatname));
 	else
-		node->name = xstrdup(flatname);
+		node->name = name_intern(flatname);
 
 	do {
 		struct property *prop;
@@ -756,13 +1212,18 @@ static struct node *unflatten_tree(struct inbuf *dtbuf,
 			if (node->children)
 				fprintf(stderr, "Warning: Flat tree input has "
 					"subnodes preceding a property.\n");
-			prop = flat_read_property(dtbuf, strbuf, flags);
-			add_property(node, prop);
+			prop = flat_read_property(dtbuf, strs, flags);
+			/* As add_property(), without walking the list */
+			*nextprop = prop;
+			nextprop = &prop->next;
 			break;
 
 		case FDT_BEGIN_NODE:
-			child = unflatten_tree(dtbuf,strbuf, flatname, flags);
-			add_child(node, child);
+			child = unflatten_tree(dtbuf, strs, flatname, flags);
+			/* As add_child(), without walking the list */
+			child->parent = node;
+			*nextchild = child;
+			nextchild = &child->next_sibling;
 			break;
 
 		case FDT_END_NODE:
@@ -790,24 +1251,43 @@ static struct node *unflatten_tree(struct inbuf *dtbuf,
 }
 
 
-struct dt_info *dt_from_blob(const char *fname)
+/*
+ * Map a blob of totalsize bytes which starts at the beginning of f, if f
+ * is a regular file.  The mapping is private, so values borrowed from it
+ * can still be changed in place without touching the file.
+ */
+static char *map_input(FILE *f, uint32_t totalsize, long pos)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = fileno(f);
+	if ((fd < 0) || (fstat(fd, &st) != 0) || !S_ISREG(st.st_mode)
+	    || (st.st_size < totalsize) || (ftell(f) != pos))
+		return NULL;
+
+	p = mmap(NULL, totalsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	return p;
+}
+
+/*
+ * Read the blob in fname.  The trees made from it borrow from it, so it
+ * is never freed.
+ */
+char *read_blob(const char *fname)
 {
 	FILE *f;
 	fdt32_t magic_buf, totalsize_buf;
-	uint32_t magic, totalsize, version, size_dt, boot_cpuid_phys;
-	uint32_t off_dt, off_str, off_mem_rsvmap;
+	uint32_t magic, totalsize;
 	int rc;
 	char *blob;
 	struct fdt_header *fdt;
 	char *p;
-	struct inbuf dtbuf, strbuf;
-	struct inbuf memresvbuf;
 	int sizeleft;
-	struct reserve_info *reservelist;
-	struct node *tree;
-	uint32_t val;
-	int flags = 0;
-	unsigned int dtsflags = DTSF_V1;
 
 	f = srcfile_relative_open(fname, NULL);
 
@@ -840,29 +1320,51 @@ struct dt_info *dt_from_blob(const char *fname)
 	if (totalsize < FDT_V1_SIZE)
 		die("DT blob size (%d) is too small\n", totalsize);
 
-	blob = xmalloc(totalsize);
+	blob = map_input(f, totalsize, sizeof(magic) + sizeof(totalsize));
+	if (!blob) {
+		blob = xmalloc(totalsize);
 
-	fdt = (struct fdt_header *)blob;
-	fdt->magic = cpu_to_fdt32(magic);
-	fdt->totalsize = cpu_to_fdt32(totalsize);
+		fdt = (struct fdt_header *)blob;
+		fdt->magic = cpu_to_fdt32(magic);
+		fdt->totalsize = cpu_to_fdt32(totalsize);
 
-	sizeleft = totalsize - sizeof(magic) - sizeof(totalsize);
-	p = blob + sizeof(magic)  + sizeof(totalsize);
+		sizeleft = totalsize - sizeof(magic) - sizeof(totalsize);
+		p = blob + sizeof(magic)  + sizeof(totalsize);
 
-	while (sizeleft) {
-		if (feof(f))
-			die("EOF before reading %d bytes of DT blob\n",
-			    totalsize);
+		while (sizeleft) {
+			if (feof(f))
+				die("EOF before reading %d bytes of DT blob\n",
+				    totalsize);
 
-		rc = fread(p, 1, sizeleft, f);
-		if (ferror(f))
-			die("Error reading DT blob: %s\n",
-			    strerror(errno));
+			rc = fread(p, 1, sizeleft, f);
+			if (ferror(f))
+				die("Error reading DT blob: %s\n",
+				    strerror(errno));
 
-		sizeleft -= rc;
-		p += rc;
+			sizeleft -= rc;
+			p += rc;
+		}
 	}
+	fclose(f);
+
+	return blob;
+}
+
+struct dt_info *dt_from_blob(char *blob)
+{
+	uint32_t totalsize, version, size_dt, boot_cpuid_phys;
+	uint32_t off_dt, off_str, off_mem_rsvmap;
+	struct fdt_header *fdt = (struct fdt_header *)blob;
+	struct inbuf dtbuf;
+	struct strings_in *strs = xmalloc(sizeof(*strs));
+	struct inbuf memresvbuf;
+	struct reserve_info *reservelist;
+	struct node *tree;
+	uint32_t val;
+	int flags = 0;
+	unsigned int dtsflags = DTSF_V1;
 
+	totalsize = fdt32_to_cpu(fdt->totalsize);
 	off_dt = fdt32_to_cpu(fdt->off_dt_struct);
 	off_str = fdt32_to_cpu(fdt->off_dt_strings);
 	off_mem_rsvmap = fdt32_to_cpu(fdt->off_mem_rsvmap);
@@ -882,10 +1384,11 @@ struct dt_info *dt_from_blob(const char *fname)
 		uint32_t size_str = fdt32_to_cpu(fdt->size_dt_strings);
 		if ((off_str+size_str < off_str) || (off_str+size_str > totalsize))
 			die("String table extends past total size\n");
-		inbuf_init(&strbuf, blob + off_str, blob + off_str + size_str);
+		inbuf_init(&strs->inb, blob + off_str, blob + off_str + size_str);
 	} else {
-		inbuf_init(&strbuf, blob + off_str, blob + totalsize);
+		inbuf_init(&strs->inb, blob + off_str, blob + totalsize);
 	}
+	memset(strs->cache, 0, sizeof(strs->cache));
 
 	if (version >= 17) {
 		size_dt = fdt32_to_cpu(fdt->size_dt_struct);
@@ -910,16 +1413,13 @@ struct dt_info *dt_from_blob(const char *fname)
 	if (val != FDT_BEGIN_NODE)
 		die("Device tree blob doesn't begin with FDT_BEGIN_NODE (begins with 0x%08x)\n", val);
 
-	tree = unflatten_tree(&dtbuf, &strbuf, "", flags);
+	tree = unflatten_tree(&dtbuf, strs, "", flags);
+	free(strs);
 
 	val = flat_read_word(&dtbuf);
 	if (val != FDT_END)
 		die("Device tree blob doesn't end with FDT_END\n");
 
-	free(blob);
-
-	fclose(f);
-
 	if (get_subnode(tree, "__fixups__") || get_subnode(tree, "__local_fixups__"))
 		dtsflags |= DTSF_PLUGIN;
 
@@ -6,71 +6,234 @@
 #include "dtc.h"
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
 
-static struct node *read_fstree(const char *dirname)
+/*
+ * Each directory is read by a task of its own, which fills in its node's
+ * properties and adds an empty child node for each subdirectory, in the
+ * order readdir() gives them, queueing a task to read it.  So the tree
+ * comes out the same whatever order the tasks run in, and with -j they
+ * are shared out among several threads.
+ */
+struct fs_task {
+	char *dirname;
+	struct node *node;
+	struct fs_task *next;
+};
+
+struct fs_queue {
+	struct fs_task *head;
+	int running;		/* tasks taken off the queue, not yet done */
+#ifndef NO_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+};
+
+static void fs_queue_lock(struct fs_queue *q)
 {
-	DIR *d;
+#ifndef NO_THREADS
+	pthread_mutex_lock(&q->lock);
+#endif
+}
+
+static void fs_queue_unlock(struct fs_queue *q)
+{
+#ifndef NO_THREADS
+	pthread_mutex_unlock(&q->lock);
+#endif
+}
+
+static void fs_queue_push(struct fs_queue *q, char *dirname, struct node *node)
+{
+	struct fs_task *task = xmalloc(sizeof(*task));
+
+	task->dirname = dirname;
+	task->node = node;
+
+	fs_queue_lock(q);
+	task->next = q->head;
+	q->head = task;
+#ifndef NO_THREADS
+	pthread_cond_signal(&q->cond);
+#endif
+	fs_queue_unlock(q);
+}
+
+/* Reads up to size bytes of a property, with one read() if it can */
+static bool read_fsprop(int dfd, const char *dirname, const char *name,
+			size_t size, struct data *d)
+{
+	ssize_t ret;
+	int fd;
+
+	fd = openat(dfd, name, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	*d = data_add_marker(empty_data, TYPE_NONE, NULL);
+	*d = data_grow_for(*d, size);
+	while (d->len < size) {
+		ret = read(fd, d->val + d->len, size - d->len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			die("Error reading %s/%s: %s\n", dirname, name,
+			    strerror(errno));
+		}
+		if (ret == 0)
+			break;
+		d->len += ret;
+	}
+
+	close(fd);
+	return true;
+}
+
+static void read_fsdir(struct fs_queue *q, struct fs_task *task)
+{
+	struct property **nextprop = &task->node->proplist;
+	struct node **nextchild = &task->node->children;
 	struct dirent *de;
 	struct stat st;
-	struct node *tree;
+	int dfd;
+	DIR *d;
 
-	d = opendir(dirname);
+	dfd = open(task->dirname, O_RDONLY | O_DIRECTORY);
+	d = (dfd >= 0) ? fdopendir(dfd) : NULL;
 	if (!d)
-		die("Couldn't opendir() \"%s\": %s\n", dirname, strerror(errno));
-
-	tree = build_node(NULL, NULL, NULL);
+		die("Couldn't opendir() \"%s\": %s\n", task->dirname,
+		    strerror(errno));
 
 	while ((de = readdir(d)) != NULL) {
-		char *tmpname;
-
 		if (streq(de->d_name, ".")
 		    || streq(de->d_name, ".."))
 			continue;
 
-		tmpname = join_path(dirname, de->d_name);
-
-		if (stat(tmpname, &st) < 0)
-			die("stat(%s): %s\n", tmpname, strerror(errno));
+		if (fstatat(dfd, de->d_name, &st, 0) < 0)
+			die("stat(%s): %s\n",
+			    join_path(task->dirname, de->d_name),
+			    strerror(errno));
 
 		if (S_ISREG(st.st_mode)) {
 			struct property *prop;
-			FILE *pfile;
+			struct data val;
+
+			if (!read_fsprop(dfd, task->dirname, de->d_name,
+					 st.st_size, &val)) {
+				char *tmpname = join_path(task->dirname,
+							  de->d_name);
 
-			pfile = fopen(tmpname, "rb");
-			if (! pfile) {
 				fprintf(stderr,
 					"WARNING: Cannot open %s: %s\n",
 					tmpname, strerror(errno));
+				free(tmpname);
 			} else {
-				prop = build_property(de->d_name,
-						      data_copy_file(pfile,
-								     st.st_size),
-						      NULL);
-				add_property(tree, prop);
-				fclose(pfile);
+				prop = build_property(de->d_name, val, NULL);
+				*nextprop = prop;
+				nextprop = &prop->next;
 			}
 		} else if (S_ISDIR(st.st_mode)) {
 			struct node *newchild;
 
-			newchild = read_fstree(tmpname);
-			newchild = name_node(newchild, xstrdup(de->d_name));
-			add_child(tree, newchild);
-		}
+			newchild = build_node(NULL, NULL, NULL);
+			newchild = name_node(newchild, de->d_name);
+			newchild->parent = task->node;
+			*nextchild = newchild;
+			nextchild = &newchild->next_sibling;
 
-		free(tmpname);
+			fs_queue_push(q, join_path(task->dirname, de->d_name),
+				      newchild);
+		}
 	}
 
 	closedir(d);
-	return tree;
+}
+
+static void *fs_worker(void *arg)
+{
+	struct fs_queue *q = arg;
+	struct fs_task *task;
+
+	fs_queue_lock(q);
+	for (;;) {
+		task = q->head;
+		if (!task) {
+			/* A running task may yet queue more */
+			if (!q->running)
+				break;
+#ifndef NO_THREADS
+			pthread_cond_wait(&q->cond, &q->lock);
+#endif
+			continue;
+		}
+
+		q->head = task->next;
+		q->running++;
+		fs_queue_unlock(q);
+
+		read_fsdir(q, task);
+		free(task->dirname);
+		free(task);
+
+		fs_queue_lock(q);
+		q->running--;
+	}
+#ifndef NO_THREADS
+	pthread_cond_broadcast(&q->cond);
+#endif
+	fs_queue_unlock(q);
+
+	return NULL;
+}
+
+static void read_fstree(struct node *tree, const char *dirname)
+{
+	struct fs_queue q;
+#ifndef NO_THREADS
+	pthread_t *threads;
+	unsigned int i, nstarted = 0;
+#endif
+
+	memset(&q, 0, sizeof(q));
+#ifndef NO_THREADS
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.cond, NULL);
+#endif
+	fs_queue_push(&q, xstrdup(dirname), tree);
+
+#ifndef NO_THREADS
+	/* The calling thread works through the queue too */
+	threads = xmalloc(jobs * sizeof(*threads));
+	for (i = 0; i < jobs - 1; i++)
+		if (pthread_create(&threads[nstarted], NULL, fs_worker, &q) == 0)
+			nstarted++;
+
+	fs_worker(&q);
+
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&q.cond);
+	pthread_mutex_destroy(&q.lock);
+	free(threads);
+#else
+	fs_worker(&q);
+#endif
 }
 
 struct dt_info *dt_from_fs(const char *dirname)
 {
 	struct node *tree;
 
-	tree = read_fstree(dirname);
+	tree = build_node(NULL, NULL, NULL);
 	tree = name_node(tree, "");
+	read_fstree(tree, dirname);
 
 	return build_dt_info(DTSF_V1, NULL, tree, guess_boot_cpuid(tree));
 }
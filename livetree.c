@@ -6,6 +6,106 @@
 #include "dtc.h"
 #include "srcpos.h"
 
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
+
+/*
+ * Name interning
+ *
+ * Names are carved out of large chunks and never freed, and found again
+ * through an open addressed table of them.  Trees are built on several
+ * threads by fstree.c, so interning takes a lock.  Looking a name up
+ * doesn't, as names are only looked up once a tree is built, and checks
+ * which intern names by modifying the tree run alone.
+ */
+#define NAME_CHUNK_SIZE		65536
+
+static struct {
+	struct hashtab table;	/* of const char *, the interned names */
+	char *chunk;
+	size_t chunk_left;
+#ifndef NO_THREADS
+	pthread_mutex_t lock;
+#endif
+} names = {
+#ifndef NO_THREADS
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+struct name_key {
+	const char *name;
+	size_t len;
+};
+
+static bool name_matches(const void *slot, const void *key)
+{
+	const struct name_entry *e = name_entry(*(const char * const *)slot);
+	const struct name_key *k = key;
+
+	return (e->len == k->len) && !memcmp(e->name, k->name, k->len);
+}
+
+static const char *name_add(const char *name, size_t len, unsigned int hash)
+{
+	size_t size = offsetof(struct name_entry, name) + len + 1;
+	struct name_entry *e;
+
+	size = (size + sizeof(unsigned int) - 1) & ~(sizeof(unsigned int) - 1);
+	if (size > NAME_CHUNK_SIZE / 4) {
+		e = xmalloc(size);
+	} else {
+		if (size > names.chunk_left) {
+			names.chunk = xmalloc(NAME_CHUNK_SIZE);
+			names.chunk_left = NAME_CHUNK_SIZE;
+		}
+		e = (struct name_entry *)names.chunk;
+		names.chunk += size;
+		names.chunk_left -= size;
+	}
+
+	e->hash = hash;
+	e->len = len;
+	memcpy(e->name, name, len);
+	e->name[len] = '\0';
+	e->basenamelen = strcspn(e->name, "@");
+	return e->name;
+}
+
+const char *name_intern(const char *name)
+{
+	struct name_key key = { name, strlen(name) };
+	uint32_t hash = fnv1a_hash(name, key.len, FNV1A_SEED);
+	const char **slot;
+
+#ifndef NO_THREADS
+	pthread_mutex_lock(&names.lock);
+#endif
+	slot = hashtab_find(&names.table, hash, name_matches, &key);
+	if (!slot) {
+		slot = hashtab_add(&names.table, sizeof(*slot), hash);
+		*slot = name_add(name, key.len, hash);
+	}
+	name = *slot;
+#ifndef NO_THREADS
+	pthread_mutex_unlock(&names.lock);
+#endif
+
+	return name;
+}
+
+/* The interned copy of name, or NULL if no node or property has it */
+const char *name_lookup(const char *name)
+{
+	struct name_key key = { name, strlen(name) };
+	const char **slot;
+
+	slot = hashtab_find(&names.table, fnv1a_hash(name, key.len, FNV1A_SEED),
+			    name_matches, &key);
+	return slot ? *slot : NULL;
+}
+
 /*
  * Tree building functions
  */
@@ -43,7 +143,7 @@ struct property *build_property(const char *name, struct data val,
 
 	memset(new, 0, sizeof(*new));
 
-	new->name = xstrdup(name);
+	new->name = name_intern(name);
 	new->val = val;
 	new->srcpos = srcpos_copy(srcpos);
 
@@ -56,7 +156,7 @@ struct property *build_property_delete(const char *name)
 
 	memset(new, 0, sizeof(*new));
 
-	new->name = xstrdup(name);
+	new->name = name_intern(name);
 	new->deleted = 1;
 
 	return new;
@@ -120,7 +220,7 @@ struct node *name_node(struct node *node, const char *name)
 {
 	assert(node->name == NULL);
 
-	node->name = xstrdup(name);
+	node->name = name_intern(name);
 
 	return node;
 }
@@ -167,7 +267,7 @@ struct node *merge_nodes(struct node *old_node, struct node *new_node)
 
 		/* Look for a collision, set new value if there is */
 		for_each_property_withdel(old_node, old_prop) {
-			if (streq(old_prop->name, new_prop->name)) {
+			if (old_prop->name == new_prop->name) {
 				/* Add new labels to old property */
 				for_each_label_withdel(new_prop->labels, l)
 					add_label(&old_prop->labels, l->label);
@@ -204,7 +304,7 @@ struct node *merge_nodes(struct node *old_node, struct node *new_node)
 
 		/* Search for a collision.  Merge if there is */
 		for_each_child_withdel(old_node, old_child) {
-			if (streq(old_child->name, new_child->name)) {
+			if (old_child->name == new_child->name) {
 				merge_nodes(old_child, new_child);
 				new_child = NULL;
 				break;
@@ -277,12 +377,13 @@ void add_property(struct node *node, struct property *prop)
 	*p = prop;
 }
 
-void delete_property_by_name(struct node *node, char *name)
+void delete_property_by_name(struct node *node, const char *name)
 {
 	struct property *prop = node->proplist;
 
+	name = name_lookup(name);
 	while (prop) {
-		if (streq(prop->name, name)) {
+		if (prop->name == name) {
 			delete_property(prop);
 			return;
 		}
@@ -310,12 +411,13 @@ void add_child(struct node *parent, struct node *child)
 	*p = child;
 }
 
-void delete_node_by_name(struct node *parent, char *name)
+void delete_node_by_name(struct node *parent, const char *name)
 {
 	struct node *node = parent->children;
 
+	name = name_lookup(name);
 	while (node) {
-		if (streq(node->name, name)) {
+		if (node->name == name) {
 			delete_node(node);
 			return;
 		}
@@ -352,63 +454,6 @@ void append_to_property(struct node *node,
 	p->val = data_append_data(p->val, data, len);
 }
 
-static int append_unique_str_to_property(struct node *node,
-					 char *name, const char *data, int len)
-{
-	struct property *p;
-
-	p = get_property(node, name);
-	if (p) {
-		const char *s;
-
-		if (p->val.len && p->val.val[p->val.len - 1] != '\0')
-			/* The current content doesn't look like a string */
-			return -1;
-
-		for (s = p->val.val; s < p->val.val + p->val.len; s = strchr(s, '\0') + 1) {
-			if (strcmp(data, s) == 0)
-				/* data already contained in node.name */
-				return 0;
-		}
-	} else {
-		p = build_property(name, empty_data, NULL);
-		add_property(node, p);
-	}
-
-	p->val = data_add_marker(p->val, TYPE_STRING, name);
-	p->val = data_append_data(p->val, data, len);
-
-	return 0;
-}
-
-static int append_unique_u32_to_property(struct node *node, char *name, fdt32_t value)
-{
-	struct property *p;
-
-	p = get_property(node, name);
-	if (p) {
-		const fdt32_t *v, *val_end = (const fdt32_t *)p->val.val + p->val.len / 4;
-
-		if (p->val.len % 4 != 0)
-			/* The current content doesn't look like a u32 array */
-			return -1;
-
-		for (v = (const void *)p->val.val; v < val_end; v++) {
-			if (*v == value)
-				/* value already contained */
-				return 0;
-		}
-	} else {
-		p = build_property(name, empty_data, NULL);
-		add_property(node, p);
-	}
-
-	p->val = data_add_marker(p->val, TYPE_UINT32, name);
-	p->val = data_append_data(p->val, &value, 4);
-
-	return 0;
-}
-
 struct reserve_info *build_reserve_entry(uint64_t address, uint64_t size)
 {
 	struct reserve_info *new = xmalloc(sizeof(*new));
@@ -469,18 +514,69 @@ struct dt_info *build_dt_info(unsigned int dtsflags,
 
 const char *get_unitname(struct node *node)
 {
-	if (node->name[node->basenamelen] == '\0')
+	if (node->name[node_basenamelen(node)] == '\0')
 		return "";
 	else
-		return node->name + node->basenamelen + 1;
+		return node->name + node_basenamelen(node) + 1;
+}
+
+/*
+ * Paths are only built when asked for, mostly for diagnostics and
+ * __symbols__, and are then kept in the node.  Checks run on several
+ * threads may ask for the same one, so building them takes a lock, but
+ * a path already built is read without it.
+ */
+static char *build_node_path(struct node *node)
+{
+	char *ppath, *path;
+
+	if (!node->parent)
+		return join_path("", node->name);
+	if (node->parent->fullpath)
+		return join_path(node->parent->fullpath, node->name);
+
+	ppath = build_node_path(node->parent);
+	path = join_path(ppath, node->name);
+	free(ppath);
+	return path;
+}
+
+const char *get_node_path(struct node *node)
+{
+#ifndef NO_THREADS
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	char *path = __atomic_load_n(&node->fullpath, __ATOMIC_ACQUIRE);
+
+	if (path)
+		return path;
+
+	pthread_mutex_lock(&lock);
+	path = node->fullpath;
+	if (!path) {
+		path = build_node_path(node);
+		__atomic_store_n(&node->fullpath, path, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return path;
+#else
+	if (!node->fullpath)
+		node->fullpath = build_node_path(node);
+
+	return node->fullpath;
+#endif
 }
 
 struct property *get_property(struct node *node, const char *propname)
 {
 	struct property *prop;
 
+	propname = name_lookup(propname);
+	if (!propname)
+		return NULL;
+
 	for_each_property(node, prop)
-		if (streq(prop->name, propname))
+		if (prop->name == propname)
 			return prop;
 
 	return NULL;
@@ -535,8 +631,7 @@ struct marker *get_marker_label(struct node *tree, const char *label,
 
 	for_each_property(tree, p) {
 		*prop = p;
-		m = p->val.markers;
-		for_each_marker_of_type(m, LABEL)
+		for_each_marker_of_type(p->val, m, LABEL)
 			if (streq(m->ref, label))
 				return m;
 	}
@@ -556,8 +651,12 @@ struct node *get_subnode(struct node *node, const char *nodename)
 {
 	struct node *child;
 
+	nodename = name_lookup(nodename);
+	if (!nodename)
+		return NULL;
+
 	for_each_child(node, child)
-		if (streq(child->name, nodename) && !child->deleted)
+		if ((child->name == nodename) && !child->deleted)
 			return child;
 
 	return NULL;
@@ -686,17 +785,17 @@ static void add_phandle_property(struct node *node,
 	add_property(node, build_property(name, d, NULL));
 }
 
+static cell_t next_phandle = 1; /* FIXME: ick, static */
+
 cell_t get_node_phandle(struct node *root, struct node *node)
 {
-	static cell_t phandle = 1; /* FIXME: ick, static local */
-
 	if (phandle_is_valid(node->phandle))
 		return node->phandle;
 
-	while (get_node_by_phandle(root, phandle))
-		phandle++;
+	while (get_node_by_phandle(root, next_phandle))
+		next_phandle++;
 
-	node->phandle = phandle;
+	node->phandle = next_phandle;
 
 	add_phandle_property(node, "linux,phandle", PHANDLE_LEGACY);
 	add_phandle_property(node, "phandle", PHANDLE_EPAPR);
@@ -750,7 +849,7 @@ static int cmp_reserve_info(const void *ax, const void *bx)
 		return 0;
 }
 
-static void sort_reserve_entries(struct dt_info *dti)
+void sort_reserve_entries(struct dt_info *dti)
 {
 	struct reserve_info *ri, **tbl;
 	int n = 0, i = 0;
@@ -868,18 +967,32 @@ void sort_tree(struct dt_info *dti)
 	sort_node(dti->dt);
 }
 
-/* utility helper to avoid code duplication */
-static struct node *build_and_name_child_node(struct node *parent, const char *name)
+/* Builds a child of parent named name, and links it in at *pos */
+static struct node *build_child_node_at(struct node *parent,
+					struct node **pos, const char *name)
 {
 	struct node *node;
 
 	node = build_node(NULL, NULL, NULL);
 	name_node(node, name);
-	add_child(parent, node);
+	node->parent = parent;
+	node->next_sibling = *pos;
+	*pos = node;
 
 	return node;
 }
 
+/* utility helper to avoid code duplication */
+static struct node *build_and_name_child_node(struct node *parent, const char *name)
+{
+	struct node **pos = &parent->children;
+
+	while (*pos)
+		pos = &(*pos)->next_sibling;
+
+	return build_child_node_at(parent, pos, name);
+}
+
 static struct node *build_root_node(struct node *dt, const char *name)
 {
 	struct node *an;
@@ -908,70 +1021,454 @@ static bool any_label_tree(struct dt_info *dti, struct node *node)
 	return false;
 }
 
-static void generate_label_tree_internal(struct dt_info *dti,
-					 struct node *an, struct node *node,
-					 bool allocph)
+/*
+ * A label tree is built in bulk: the labels are counted and gathered in
+ * tree order, duplicates are found by sorting them alongside the
+ * properties already in the node, and the new properties are then linked
+ * in at the end of the node in one go.
+ */
+struct label_entry {
+	const char *label;
+	struct node *node;
+	int index;		/* position in tree order */
+	bool dup;		/* already a property of the label tree */
+};
+
+static void count_labels(struct node *node, int *nlabels, int *nnodes)
 {
-	struct node *dt = dti->dt;
 	struct node *c;
-	struct property *p;
 	struct label *l;
 
-	/* if there are labels */
-	if (node->labels) {
+	if (node->labels)
+		(*nnodes)++;
+	for_each_label(node->labels, l)
+		(*nlabels)++;
 
-		/* now add the label in the node */
-		for_each_label(node->labels, l) {
+	for_each_child(node, c)
+		count_labels(c, nlabels, nnodes);
+}
 
-			/* check whether the label already exists */
-			p = get_property(an, l->label);
-			if (p) {
-				fprintf(stderr, "WARNING: label %s already"
-					" exists in /%s", l->label,
-					an->name);
-				continue;
-			}
+static void gather_labels(struct node *node, struct label_entry *labels,
+			  int *nlabels, struct node **nodes, int *nnodes)
+{
+	struct node *c;
+	struct label *l;
 
-			/* insert it */
-			p = build_property(l->label,
-				data_copy_escape_string(node->fullpath,
-						strlen(node->fullpath)),
-				NULL);
-			add_property(an, p);
-		}
+	if (node->labels)
+		nodes[(*nnodes)++] = node;
+	for_each_label(node->labels, l) {
+		labels[*nlabels].label = l->label;
+		labels[*nlabels].node = node;
+		labels[*nlabels].index = *nlabels;
+		labels[*nlabels].dup = false;
+		(*nlabels)++;
+	}
+
+	for_each_child(node, c)
+		gather_labels(c, labels, nlabels, nodes, nnodes);
+}
+
+static int cmp_label_entry(const void *ax, const void *bx)
+{
+	const struct label_entry *a = *(const struct label_entry * const *)ax;
+	const struct label_entry *b = *(const struct label_entry * const *)bx;
+	int rc;
+
+	rc = strcmp(a->label, b->label);
+	if (rc)
+		return rc;
+
+	return a->index - b->index;
+}
+
+static int cmp_prop_name(const void *key, const void *bx)
+{
+	const struct property *b = *(const struct property * const *)bx;
+
+	return strcmp(key, b->name);
+}
+
+/* Marks each label which is already a property of an, or an earlier label */
+static void find_dup_labels(struct node *an, struct label_entry *labels,
+			    int nlabels)
+{
+	struct label_entry **sorted;
+	struct property *prop, **props;
+	int i, nprops = 0;
+
+	for_each_property(an, prop)
+		nprops++;
+	props = xmalloc((nprops + 1) * sizeof(*props));
+	nprops = 0;
+	for_each_property(an, prop)
+		props[nprops++] = prop;
+	qsort(props, nprops, sizeof(*props), cmp_prop);
+
+	sorted = xmalloc(nlabels * sizeof(*sorted));
+	for (i = 0; i < nlabels; i++)
+		sorted[i] = &labels[i];
+	qsort(sorted, nlabels, sizeof(*sorted), cmp_label_entry);
+
+	for (i = 0; i < nlabels; i++)
+		if ((i > 0) && streq(sorted[i]->label, sorted[i - 1]->label))
+			sorted[i]->dup = true;
+		else
+			sorted[i]->dup = !!bsearch(sorted[i]->label, props,
+						   nprops, sizeof(*props),
+						   cmp_prop_name);
+
+	free(sorted);
+	free(props);
+}
+
+static void collect_phandles(struct node *node, cell_t *phandles, int *n)
+{
+	struct node *c;
+
+	if (phandle_is_valid(node->phandle))
+		phandles[(*n)++] = node->phandle;
+
+	for_each_child(node, c)
+		collect_phandles(c, phandles, n);
+}
+
+static void count_nodes(struct node *node, int *n)
+{
+	struct node *c;
 
-		/* force allocation of a phandle for this node */
-		if (allocph)
-			(void)get_node_phandle(dt, node);
+	(*n)++;
+	for_each_child(node, c)
+		count_nodes(c, n);
+}
+
+static int cmp_phandle(const void *ax, const void *bx)
+{
+	cell_t a = *(const cell_t *)ax, b = *(const cell_t *)bx;
+
+	return (a > b) - (a < b);
+}
+
+/*
+ * Gives each of the nodes a phandle, just as calling get_node_phandle()
+ * on them in turn would, but with the phandles already in use looked up
+ * in a sorted table rather than by searching the tree for each.
+ */
+static void assign_node_phandles(struct node *root, struct node **nodes,
+				 int nnodes)
+{
+	cell_t *used;
+	int i, j = 0, nused = 0;
+
+	count_nodes(root, &nused);
+	used = xmalloc(nused * sizeof(*used));
+	nused = 0;
+	collect_phandles(root, used, &nused);
+	qsort(used, nused, sizeof(*used), cmp_phandle);
+
+	for (i = 0; i < nnodes; i++) {
+		struct node *node = nodes[i];
+
+		if (phandle_is_valid(node->phandle))
+			continue;
+
+		for (; (j < nused) && (used[j] <= next_phandle); j++)
+			if (used[j] == next_phandle)
+				next_phandle++;
+
+		node->phandle = next_phandle++;
+
+		add_phandle_property(node, "linux,phandle", PHANDLE_LEGACY);
+		add_phandle_property(node, "phandle", PHANDLE_EPAPR);
 	}
 
+	free(used);
+}
+
+/*
+ * While __fixups__ and __local_fixups__ are generated, the labels of the
+ * tree, the subnodes and properties of the fixup nodes, and the entries
+ * in those properties are kept in hash tables.  So each reference is
+ * resolved and added without searching the tree or rescanning what has
+ * been added before it, and the whole pass is linear.
+ *
+ * A key is a run of bytes belonging to an owner, a node or property (or
+ * nothing, for labels).  The empty key stands for the owner itself, and
+ * is entered once the owner's existing contents are in the tables.
+ */
+struct fixup_slot {
+	const void *owner;
+	char *key;
+	unsigned int len;
+	void *val;
+};
+
+struct fixup_key {
+	const void *owner;
+	const char *key;
+	unsigned int len;
+};
+
+struct fixup_state {
+	struct node *dt;
+	struct hashtab labels;		/* label -> node */
+	struct hashtab children;	/* (node, name) -> subnode */
+	struct hashtab props;		/* (node, name) -> property */
+	struct hashtab entries;		/* (property, entry) */
+	struct hashtab lfnodes;		/* node -> its __local_fixups__ node */
+};
+
+static uint32_t fixup_hash(const void *owner, const char *key,
+			   unsigned int len)
+{
+	return fnv1a_hash(key, len,
+			  fnv1a_hash(&owner, sizeof(owner), FNV1A_SEED));
+}
+
+static bool fixup_matches(const void *slot, const void *key)
+{
+	const struct fixup_slot *s = slot;
+	const struct fixup_key *k = key;
+
+	return (s->owner == k->owner) && (s->len == k->len)
+		&& (!k->len || !memcmp(s->key, k->key, k->len));
+}
+
+/* The slot for owner's key, or NULL if it hasn't been entered */
+static struct fixup_slot *fixup_lookup(struct hashtab *t,
+				       const void *owner, const char *key,
+				       unsigned int len)
+{
+	struct fixup_key k = { owner, key, len };
+
+	return hashtab_find(t, fixup_hash(owner, key, len), fixup_matches, &k);
+}
+
+/* Enters a key which isn't already in the table */
+static void fixup_insert(struct hashtab *t, const void *owner,
+			 const char *key, unsigned int len, void *val)
+{
+	struct fixup_slot *s;
+
+	s = hashtab_add(t, sizeof(*s), fixup_hash(owner, key, len));
+	s->owner = owner;
+	if (len) {
+		s->key = xmalloc(len);
+		memcpy(s->key, key, len);
+	}
+	s->len = len;
+	s->val = val;
+}
+
+static void fixup_table_free(struct hashtab *t)
+{
+	struct fixup_slot *s;
+	unsigned int i;
+
+	for (i = 0; i < t->size; i++)
+		if ((s = hashtab_slot(t, i)))
+			free(s->key);
+	hashtab_free(t);
+}
+
+/* Labels go in as get_node_by_label() would find them, first in tree order */
+static void fixup_index_labels(struct hashtab *t, struct node *node)
+{
+	struct node *c;
+	struct label *l;
+
+	for_each_label(node->labels, l)
+		if (!fixup_lookup(t, NULL, l->label, strlen(l->label)))
+			fixup_insert(t, NULL, l->label, strlen(l->label), node);
+
 	for_each_child(node, c)
-		generate_label_tree_internal(dti, an, c, allocph);
+		fixup_index_labels(t, c);
+}
+
+static void fixup_state_init(struct fixup_state *fs, struct node *dt)
+{
+	memset(fs, 0, sizeof(*fs));
+	fs->dt = dt;
+	fixup_index_labels(&fs->labels, dt);
+}
+
+static void fixup_state_free(struct fixup_state *fs)
+{
+	fixup_table_free(&fs->labels);
+	fixup_table_free(&fs->children);
+	fixup_table_free(&fs->props);
+	fixup_table_free(&fs->entries);
+	fixup_table_free(&fs->lfnodes);
+}
+
+/* As get_node_by_ref(), but with the labels looked up in the index */
+static struct node *fixup_ref_node(struct fixup_state *fs, const char *ref)
+{
+	const char *slash;
+	struct fixup_slot *s;
+
+	if (ref[0] == '/')
+		return get_node_by_ref(fs->dt, ref);
+
+	slash = strchr(ref, '/');
+	s = fixup_lookup(&fs->labels, NULL, ref,
+			 slash ? (unsigned int)(slash - ref) : strlen(ref));
+	if (!s)
+		return NULL;
+
+	return slash ? get_node_by_path(s->val, slash + 1) : s->val;
+}
+
+/* Enters the subnodes and properties node already has, if not done yet */
+static void fixup_enter_node(struct fixup_state *fs, struct node *node)
+{
+	struct property **nextprop = &node->proplist;
+	struct node **nextchild = &node->children;
+
+	if (fixup_lookup(&fs->props, node, NULL, 0))
+		return;
+
+	/* As get_property() and get_subnode(), the first of a name wins */
+	while (*nextprop) {
+		struct property *p = *nextprop;
+
+		if (!p->deleted
+		    && !fixup_lookup(&fs->props, node, p->name,
+				     strlen(p->name)))
+			fixup_insert(&fs->props, node, p->name,
+				     strlen(p->name), p);
+		nextprop = &p->next;
+	}
+	fixup_insert(&fs->props, node, NULL, 0, nextprop);
+
+	while (*nextchild) {
+		struct node *c = *nextchild;
+
+		if (!c->deleted
+		    && !fixup_lookup(&fs->children, node, c->name,
+				     strlen(c->name)))
+			fixup_insert(&fs->children, node, c->name,
+				     strlen(c->name), c);
+		nextchild = &c->next_sibling;
+	}
+	fixup_insert(&fs->children, node, NULL, 0, nextchild);
+}
+
+/* Finds node's subnode name, adding it at the end if there isn't one */
+static struct node *fixup_subnode(struct fixup_state *fs, struct node *node,
+				  const char *name)
+{
+	struct fixup_slot *s;
+	struct node *child;
+
+	fixup_enter_node(fs, node);
+
+	s = fixup_lookup(&fs->children, node, name, strlen(name));
+	if (s)
+		return s->val;
+
+	s = fixup_lookup(&fs->children, node, NULL, 0);
+	child = build_child_node_at(node, s->val, name);
+	s->val = &child->next_sibling;
+
+	fixup_insert(&fs->children, node, name, strlen(name), child);
+	return child;
 }
 
-static bool any_fixup_tree(struct dt_info *dti, struct node *node)
+/* Finds node's property name, adding it at the end if there isn't one */
+static struct property *fixup_property(struct fixup_state *fs,
+				       struct node *node, const char *name)
+{
+	struct fixup_slot *s;
+	struct property *prop, **nextprop;
+
+	fixup_enter_node(fs, node);
+
+	s = fixup_lookup(&fs->props, node, name, strlen(name));
+	if (s)
+		return s->val;
+
+	prop = build_property(name, empty_data, NULL);
+	s = fixup_lookup(&fs->props, node, NULL, 0);
+	nextprop = s->val;
+	*nextprop = prop;
+	s->val = &prop->next;
+
+	fixup_insert(&fs->props, node, name, strlen(name), prop);
+	return prop;
+}
+
+/*
+ * Enters the entries prop already has, returning false if it doesn't look
+ * like a list of strings (or of u32s, for TYPE_UINT32) to add to.
+ */
+static bool fixup_enter_entries(struct fixup_state *fs, struct property *prop,
+				enum markertype type)
+{
+	struct fixup_slot *s = fixup_lookup(&fs->entries, prop, NULL, 0);
+	const char *v = prop->val.val, *end = v + prop->val.len;
+	unsigned int len;
+
+	if (s)
+		return !s->val;
+
+	if ((type == TYPE_STRING)
+	    ? (prop->val.len && (end[-1] != '\0'))
+	    : (prop->val.len % sizeof(fdt32_t))) {
+		fixup_insert(&fs->entries, prop, NULL, 0, prop);
+		return false;
+	}
+
+	for (; v < end; v += len) {
+		len = (type == TYPE_STRING) ? strlen(v) + 1 : sizeof(fdt32_t);
+		if (!fixup_lookup(&fs->entries, prop, v, len))
+			fixup_insert(&fs->entries, prop, v, len, NULL);
+	}
+	fixup_insert(&fs->entries, prop, NULL, 0, NULL);
+	return true;
+}
+
+/* Appends data to node's property name, unless it's already there */
+static int fixup_append(struct fixup_state *fs, struct node *node,
+			const char *name, const void *data, unsigned int len,
+			enum markertype type)
+{
+	struct property *p = fixup_property(fs, node, name);
+
+	if (!fixup_enter_entries(fs, p, type))
+		return -1;
+
+	if (fixup_lookup(&fs->entries, p, data, len))
+		return 0;
+	fixup_insert(&fs->entries, p, data, len, NULL);
+
+	p->val = data_add_marker(p->val, type, xstrdup(name));
+	p->val = data_append_data(p->val, data, len);
+
+	return 0;
+}
+
+static bool any_fixup_tree(struct fixup_state *fs, struct node *node)
 {
 	struct node *c;
 	struct property *prop;
 	struct marker *m;
 
 	for_each_property(node, prop) {
-		m = prop->val.markers;
-		for_each_marker_of_type(m, REF_PHANDLE) {
-			if (!get_node_by_ref(dti->dt, m->ref))
+		for_each_marker_of_type(prop->val, m, REF_PHANDLE) {
+			if (!fixup_ref_node(fs, m->ref))
 				return true;
 		}
 	}
 
 	for_each_child(node, c) {
-		if (any_fixup_tree(dti, c))
+		if (any_fixup_tree(fs, c))
 			return true;
 	}
 
 	return false;
 }
 
-static int add_fixup_entry(struct dt_info *dti, struct node *fn,
+static int add_fixup_entry(struct fixup_state *fs, struct node *fn,
 			   struct node *node, struct property *prop,
 			   struct marker *m)
 {
@@ -988,23 +1485,23 @@ static int add_fixup_entry(struct dt_info *dti, struct node *fn,
 		    m->ref);
 
 	/* there shouldn't be any ':' in the arguments */
-	if (strchr(node->fullpath, ':') || strchr(prop->name, ':'))
+	if (strchr(get_node_path(node), ':') || strchr(prop->name, ':'))
 		die("arguments should not contain ':'\n");
 
 	xasprintf(&entry, "%s:%s:%u",
-			node->fullpath, prop->name, m->offset);
-	ret = append_unique_str_to_property(fn, m->ref, entry, strlen(entry) + 1);
+			get_node_path(node), prop->name, m->offset);
+	ret = fixup_append(fs, fn, m->ref, entry, strlen(entry) + 1,
+			   TYPE_STRING);
 
 	free(entry);
 
 	return ret;
 }
 
-static int generate_fixups_tree_internal(struct dt_info *dti,
+static int generate_fixups_tree_internal(struct fixup_state *fs,
 					 struct node *fn,
 					 struct node *node)
 {
-	struct node *dt = dti->dt;
 	struct node *c;
 	struct property *prop;
 	struct marker *m;
@@ -1012,83 +1509,78 @@ static int generate_fixups_tree_internal(struct dt_info *dti,
 	int ret = 0;
 
 	for_each_property(node, prop) {
-		m = prop->val.markers;
-		for_each_marker_of_type(m, REF_PHANDLE) {
-			refnode = get_node_by_ref(dt, m->ref);
+		for_each_marker_of_type(prop->val, m, REF_PHANDLE) {
+			refnode = fixup_ref_node(fs, m->ref);
 			if (!refnode)
-				if (add_fixup_entry(dti, fn, node, prop, m))
+				if (add_fixup_entry(fs, fn, node, prop, m))
 					ret = -1;
 		}
 	}
 
 	for_each_child(node, c)
-		if (generate_fixups_tree_internal(dti, fn, c))
+		if (generate_fixups_tree_internal(fs, fn, c))
 			ret = -1;
 
 	return ret;
 }
 
-static bool any_local_fixup_tree(struct dt_info *dti, struct node *node)
+static bool any_local_fixup_tree(struct fixup_state *fs, struct node *node)
 {
 	struct node *c;
 	struct property *prop;
 	struct marker *m;
 
 	for_each_property(node, prop) {
-		m = prop->val.markers;
-		for_each_marker_of_type(m, REF_PHANDLE) {
-			if (get_node_by_ref(dti->dt, m->ref))
+		for_each_marker_of_type(prop->val, m, REF_PHANDLE) {
+			if (fixup_ref_node(fs, m->ref))
 				return true;
 		}
 	}
 
 	for_each_child(node, c) {
-		if (any_local_fixup_tree(dti, c))
+		if (any_local_fixup_tree(fs, c))
 			return true;
 	}
 
 	return false;
 }
 
-static int add_local_fixup_entry(struct dt_info *dti,
-		struct node *lfn, struct node *node,
-		struct property *prop, struct marker *m,
-		struct node *refnode)
-{
-	struct node *wn, *nwn;	/* local fixup node, walk node, new */
-	fdt32_t value_32;
-	char **compp;
-	int i, depth;
-
-	/* walk back retrieving depth */
-	depth = 0;
-	for (wn = node; wn; wn = wn->parent)
-		depth++;
-
-	/* allocate name array */
-	compp = xmalloc(sizeof(*compp) * depth);
-
-	/* store names in the array */
-	for (wn = node, i = depth - 1; wn; wn = wn->parent, i--)
-		compp[i] = wn->name;
-
-	/* walk the path components creating nodes if they don't exist */
-	for (wn = lfn, i = 1; i < depth; i++, wn = nwn) {
-		/* if no node exists, create it */
-		nwn = build_root_node(wn, compp[i]);
-	}
+/* The node in the local fixup tree lfn at the same path as node */
+static struct node *local_fixup_node(struct fixup_state *fs,
+				     struct node *lfn, struct node *node)
+{
+	struct fixup_slot *s;
+	struct node *wn;
+
+	if (!node->parent)
+		return lfn;
+
+	s = fixup_lookup(&fs->lfnodes, node, NULL, 0);
+	if (s)
+		return s->val;
+
+	/* if no node exists, create it */
+	wn = fixup_subnode(fs, local_fixup_node(fs, lfn, node->parent),
+			   node->name);
+	fixup_insert(&fs->lfnodes, node, NULL, 0, wn);
+	return wn;
+}
 
-	free(compp);
+static int add_local_fixup_entry(struct fixup_state *fs,
+		struct node *lfn, struct node *node,
+		struct property *prop, struct marker *m)
+{
+	struct node *wn = local_fixup_node(fs, lfn, node);
+	fdt32_t value_32 = cpu_to_fdt32(m->offset);
 
-	value_32 = cpu_to_fdt32(m->offset);
-	return append_unique_u32_to_property(wn, prop->name, value_32);
+	return fixup_append(fs, wn, prop->name, &value_32, sizeof(value_32),
+			    TYPE_UINT32);
 }
 
-static int generate_local_fixups_tree_internal(struct dt_info *dti,
+static int generate_local_fixups_tree_internal(struct fixup_state *fs,
 					       struct node *lfn,
 					       struct node *node)
 {
-	struct node *dt = dti->dt;
 	struct node *c;
 	struct property *prop;
 	struct marker *m;
@@ -1096,17 +1588,16 @@ static int generate_local_fixups_tree_internal(struct dt_info *dti,
 	int ret = 0;
 
 	for_each_property(node, prop) {
-		m = prop->val.markers;
-		for_each_marker_of_type(m, REF_PHANDLE) {
-			refnode = get_node_by_ref(dt, m->ref);
+		for_each_marker_of_type(prop->val, m, REF_PHANDLE) {
+			refnode = fixup_ref_node(fs, m->ref);
 			if (refnode)
-				if (add_local_fixup_entry(dti, lfn, node, prop, m, refnode))
+				if (add_local_fixup_entry(fs, lfn, node, prop, m))
 					ret = -1;
 		}
 	}
 
 	for_each_child(node, c)
-		if (generate_local_fixups_tree_internal(dti, lfn, c))
+		if (generate_local_fixups_tree_internal(fs, lfn, c))
 			ret = -1;
 
 	return ret;
@@ -1126,29 +1617,80 @@ void generate_labels_from_tree(struct dt_info *dti, const char *name)
 
 		labeled_node = get_node_by_path(dti->dt, p->val.val);
 		if (labeled_node)
-			add_label(&labeled_node->labels, p->name);
+			add_label(&labeled_node->labels, xstrdup(p->name));
 		else if (quiet < 1)
 			fprintf(stderr, "Warning: Path %s referenced in property %s/%s missing",
 				p->val.val, name, p->name);
 	}
 }
 
-void generate_label_tree(struct dt_info *dti, const char *name, bool allocph)
+void generate_label_tree(struct dt_info *dti, const char *name, bool allocph,
+			 bool sorted)
 {
+	struct label_entry *labels;
+	struct node *an, **nodes;
+	struct property **nextprop;
+	int i, nlabels = 0, nnodes = 0;
+
 	if (!any_label_tree(dti, dti->dt))
 		return;
-	generate_label_tree_internal(dti, build_root_node(dti->dt, name),
-				     dti->dt, allocph);
+
+	an = build_root_node(dti->dt, name);
+
+	count_labels(dti->dt, &nlabels, &nnodes);
+	labels = xmalloc((nlabels + 1) * sizeof(*labels));
+	nodes = xmalloc(nnodes * sizeof(*nodes));
+	nlabels = nnodes = 0;
+	gather_labels(dti->dt, labels, &nlabels, nodes, &nnodes);
+
+	find_dup_labels(an, labels, nlabels);
+
+	nextprop = &an->proplist;
+	while (*nextprop)
+		nextprop = &(*nextprop)->next;
+
+	for (i = 0; i < nlabels; i++) {
+		struct label_entry *le = &labels[i];
+		struct property *p;
+
+		if (le->dup) {
+			fprintf(stderr, "WARNING: label %s already"
+				" exists in /%s", le->label, an->name);
+			continue;
+		}
+
+		p = build_property(le->label,
+			data_copy_escape_string(get_node_path(le->node),
+						strlen(get_node_path(le->node))),
+			NULL);
+		*nextprop = p;
+		nextprop = &p->next;
+	}
+
+	/* force allocation of a phandle for each labeled node */
+	if (allocph)
+		assign_node_phandles(dti->dt, nodes, nnodes);
+
+	/* So that consumers can binary search the labels */
+	if (sorted)
+		sort_properties(an);
+
+	free(nodes);
+	free(labels);
 }
 
 void generate_fixups_tree(struct dt_info *dti, const char *name)
 {
-	if (!any_fixup_tree(dti, dti->dt))
-		return;
-	if (generate_fixups_tree_internal(dti, build_root_node(dti->dt, name), dti->dt))
+	struct fixup_state fs;
+
+	fixup_state_init(&fs, dti->dt);
+	if (any_fixup_tree(&fs, dti->dt)
+	    && generate_fixups_tree_internal(&fs, build_root_node(dti->dt, name),
+					     dti->dt))
 		fprintf(stderr,
 			"Warning: Preexisting data in %s malformed, some content could not be added.\n",
 			name);
+	fixup_state_free(&fs);
 }
 
 void fixup_phandles(struct dt_info *dti, const char *name)
@@ -1226,7 +1768,7 @@ void fixup_phandles(struct dt_info *dti, const char *name)
 
 			if (!p && quiet < 1)
 				fprintf(stderr, "Warning: Label %s references non-existing property %s in node %s\n",
-					fp->name, n->fullpath, propname);
+					fp->name, get_node_path(n), propname);
 
 			*(soffset - 1) = ':';
 
@@ -1238,23 +1780,29 @@ void fixup_phandles(struct dt_info *dti, const char *name)
 				if (quiet < 1)
 					fprintf(stderr,
 						"Warning: Label %s contains invalid offset for property %s in node %s\n",
-						fp->name, p->name, n->fullpath);
+						fp->name, p->name, get_node_path(n));
 				continue;
 			}
 
-			property_add_marker(p, REF_PHANDLE, offset, fp->name);
+			property_add_marker(p, REF_PHANDLE, offset,
+					    xstrdup(fp->name));
 		}
 	}
 }
 
 void generate_local_fixups_tree(struct dt_info *dti, const char *name)
 {
-	if (!any_local_fixup_tree(dti, dti->dt))
-		return;
-	if (generate_local_fixups_tree_internal(dti, build_root_node(dti->dt, name), dti->dt))
+	struct fixup_state fs;
+
+	fixup_state_init(&fs, dti->dt);
+	if (any_local_fixup_tree(&fs, dti->dt)
+	    && generate_local_fixups_tree_internal(&fs,
+						   build_root_node(dti->dt, name),
+						   dti->dt))
 		fprintf(stderr,
 			"Warning: Preexisting data in %s malformed, some content could not be added.\n",
 			name);
+	fixup_state_free(&fs);
 }
 
 static void local_fixup_phandles_node(struct dt_info *dti, struct node *lf, struct node *n)
@@ -1270,7 +1818,7 @@ static void local_fixup_phandles_node(struct dt_info *dti, struct node *lf, stru
 		if (!p) {
 			if (quiet < 1)
 				fprintf(stderr, "Warning: Property %s in %s referenced in __local_fixups__ missing\n",
-					lfp->name, n->fullpath);
+					lfp->name, get_node_path(n));
 			continue;
 		}
 
@@ -1281,7 +1829,7 @@ static void local_fixup_phandles_node(struct dt_info *dti, struct node *lf, stru
 		if (lfp->val.len % sizeof(fdt32_t)) {
 			if (quiet < 1)
 				fprintf(stderr, "Warning: property %s in /__local_fixups__%s malformed\n",
-					lfp->name, n->fullpath);
+					lfp->name, get_node_path(n));
 			continue;
 		}
 
@@ -1295,7 +1843,7 @@ static void local_fixup_phandles_node(struct dt_info *dti, struct node *lf, stru
 		if (!subnode) {
 			if (quiet < 1)
 				fprintf(stderr, "Warning: node %s/%s referenced in __local_fixups__ missing\n",
-					lfsubnode->name, n->fullpath);
+					lfsubnode->name, get_node_path(n));
 			continue;
 		}
 
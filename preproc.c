@@ -0,0 +1,1626 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Built-in C preprocessor, for --cpp.
+ *
+ * Device tree sources are usually run through
+ * "cpp -nostdinc -undef -x assembler-with-cpp" before dtc, for the sake
+ * of #include and #define.  This implements the part of the C
+ * preprocessor that device trees use, so that no cpp has to be run:
+ * #include, object-like and function-like #define (with # and ##),
+ * #undef, #if, #ifdef, #ifndef, #elif, #else and #endif with integer
+ * expressions, #error, #warning and #pragma once.  As in cpp's assembler
+ * mode, a line starting with '#' which is not a directive, such as
+ * "#address-cells = <1>;", is passed through as text.
+ *
+ * The output carries cpp's line markers, so the lexer sees the same
+ * source positions that it would after cpp.  Headers are kept once read,
+ * along with their include guard if they have one, so a header included
+ * again with its guard defined is skipped without being opened.
+ */
+
+#include "dtc.h"
+#include "srcpos.h"
+
+#define MAX_INCLUDE_DEPTH	200
+
+/*
+ * Marks an identifier which must not be expanded, because it was found
+ * while its macro was being expanded.  Stripped from the output.
+ */
+#define PAINT	'\x01'
+
+struct ppbuf {
+	char *s;
+	size_t len, size;
+};
+
+struct macro {
+	char *name;
+	int nparams;		/* -1 for an object-like macro */
+	bool variadic;		/* the last parameter takes the rest */
+	char **params;
+	char *body;
+	enum { MACRO_PLAIN, MACRO_FILE, MACRO_LINE } kind;
+	bool undefined;		/* by #undef, but left in the table */
+	bool disabled;		/* being expanded */
+};
+
+struct header {
+	char *name;		/* as found on the include path */
+	char *dir;
+	char *text;
+	size_t len;
+	bool scanned;		/* processed in full once */
+	char *guard;		/* include guard, if it has one */
+	bool once;		/* #pragma once */
+};
+
+/* The header an #include resolved to, keyed on the directory searched */
+struct include {
+	char *key;
+	struct header *h;
+};
+
+struct ppfile {
+	const char *name;	/* for line markers and __FILE__ */
+	const char *dir;
+	const char *p, *end;
+	int lineno;		/* of the next line */
+	int depth;
+	struct header *h;	/* NULL for the input file itself */
+	int condbase;		/* conditionals open when it was entered */
+
+	/* Include guard detection */
+	enum { GUARD_NONE, GUARD_OPEN, GUARD_CLOSED, GUARD_FAILED } guard;
+	char *guardname;
+	int guardlevel;
+};
+
+struct cond {
+	bool active;		/* lines in the current group are output */
+	bool taken;		/* a group has been (or can't be) taken */
+	bool seen_else;
+};
+
+/* A macro expansion being rescanned, up to offset end in the buffer */
+struct active {
+	struct macro *m;
+	size_t end;
+};
+
+/* These hold pointers to structures whose first member is the key */
+static struct hashtab macros, headers, includes;
+static struct ppbuf out;
+static struct cond *conds;
+static int nconds, condsize;
+static struct active *actives;
+static size_t nactives, activesize;
+static struct ppfile *cur;
+static int curline;		/* of the line being expanded */
+static char **cmdline_defs;
+static int ncmdline_defs;
+
+/*
+ * Buffers
+ */
+
+static void buf_grow(struct ppbuf *b, size_t len)
+{
+	if (b->len + len + 1 <= b->size)
+		return;
+	b->size = b->size ? 2 * b->size : 256;
+	while (b->len + len + 1 > b->size)
+		b->size *= 2;
+	b->s = xrealloc(b->s, b->size);
+}
+
+static void buf_add(struct ppbuf *b, const char *s, size_t len)
+{
+	buf_grow(b, len);
+	memcpy(b->s + b->len, s, len);
+	b->len += len;
+	b->s[b->len] = '\0';
+}
+
+static void buf_addc(struct ppbuf *b, char c)
+{
+	buf_add(b, &c, 1);
+}
+
+static void buf_addstr(struct ppbuf *b, const char *s)
+{
+	buf_add(b, s, strlen(s));
+}
+
+/* Replaces len bytes at pos with r */
+static void buf_replace(struct ppbuf *b, size_t pos, size_t len,
+			const char *r, size_t rlen)
+{
+	if (rlen > len)
+		buf_grow(b, rlen - len);
+	memmove(b->s + pos + rlen, b->s + pos + len, b->len - pos - len + 1);
+	memcpy(b->s + pos, r, rlen);
+	b->len = b->len - len + rlen;
+}
+
+static void buf_clear(struct ppbuf *b)
+{
+	b->len = 0;
+	buf_grow(b, 0);
+	b->s[0] = '\0';
+}
+
+/*
+ * Tables
+ */
+
+struct table_key {
+	const char *name;
+	size_t len;
+};
+
+static bool table_matches(const void *slot, const void *key)
+{
+	const char *name = **(char *const *const *)slot;
+	const struct table_key *k = key;
+
+	return !strncmp(name, k->name, k->len) && !name[k->len];
+}
+
+static void *table_find(struct hashtab *t, const char *name, size_t len)
+{
+	struct table_key k = { name, len };
+	void **slot;
+
+	slot = hashtab_find(t, fnv1a_hash(name, len, FNV1A_SEED),
+			    table_matches, &k);
+	return slot ? *slot : NULL;
+}
+
+static void table_add(struct hashtab *t, void *entry)
+{
+	const char *key = *(char **)entry;
+	void **slot;
+
+	slot = hashtab_add(t, sizeof(*slot),
+			   fnv1a_hash(key, strlen(key), FNV1A_SEED));
+	*slot = entry;
+}
+
+/*
+ * Scanning
+ */
+
+static bool is_ident_start(char c)
+{
+	return isalpha((unsigned char)c) || (c == '_');
+}
+
+static bool is_ident_char(char c)
+{
+	return isalnum((unsigned char)c) || (c == '_');
+}
+
+static size_t skip_space(const char *s, size_t i)
+{
+	while (isspace((unsigned char)s[i]))
+		i++;
+	return i;
+}
+
+static size_t ident_end(const char *s, size_t i)
+{
+	while (is_ident_char(s[i]))
+		i++;
+	return i;
+}
+
+/* Finds the end of a string or character literal on one line */
+static size_t literal_end(const char *s, size_t i)
+{
+	char quote = s[i++];
+
+	while (s[i] && (s[i] != quote) && (s[i] != '\n')) {
+		if ((s[i] == '\\') && s[i + 1])
+			i++;
+		i++;
+	}
+	return (s[i] == quote) ? i + 1 : i;
+}
+
+/*
+ * A ' only starts a character literal if it is closed on the same line,
+ * as apostrophes are common in assembler (and dts) comments and text.
+ */
+static bool is_literal_start(const char *s, size_t i)
+{
+	size_t end;
+
+	if (s[i] == '"')
+		return true;
+	if (s[i] != '\'')
+		return false;
+	end = literal_end(s, i);
+	return (end > i + 1) && (s[end - 1] == '\'');
+}
+
+static size_t ppnumber_end(const char *s, size_t i)
+{
+	for (;;) {
+		if (strchr("eEpP", s[i]) && s[i] && strchr("+-", s[i + 1])
+		    && s[i + 1])
+			i += 2;
+		else if (is_ident_char(s[i]) || (s[i] == '.'))
+			i++;
+		else
+			return i;
+	}
+}
+
+static bool is_ppnumber_start(const char *s, size_t i)
+{
+	return isdigit((unsigned char)s[i])
+		|| ((s[i] == '.') && isdigit((unsigned char)s[i + 1]));
+}
+
+/* Finds the end of the token at s[i], which is not whitespace */
+static size_t token_end(const char *s, size_t i)
+{
+	if (s[i] == PAINT)
+		return ident_end(s, i + 1);
+	if (is_ident_start(s[i]))
+		return ident_end(s, i);
+	if (is_ppnumber_start(s, i))
+		return ppnumber_end(s, i);
+	if (is_literal_start(s, i))
+		return literal_end(s, i);
+	if ((s[i] == '#') && (s[i + 1] == '#'))
+		return i + 2;
+	return i + 1;
+}
+
+static void NORETURN PRINTF(1, 2) pp_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "Error: %s:%d: ", cur->name, curline);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	die("Unable to preprocess input tree\n");
+}
+
+static void PRINTF(1, 2) pp_warning(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (quiet)
+		return;
+	fprintf(stderr, "Warning: %s:%d: ", cur->name, curline);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+}
+
+/*
+ * Reads a logical line, with backslash-newlines spliced, and counts the
+ * physical lines it took.  Whitespace is laid out as cpp would output
+ * it, so that columns are the same: indentation is kept a space per
+ * character, other runs of whitespace and comments become one space, and
+ * trailing whitespace is dropped.
+ */
+static bool read_line(struct ppfile *f, struct ppbuf *line, int *nlines)
+{
+	const char *p = f->p, *end = f->end;
+	bool text = false, space = false;
+	char quote = 0;
+
+	buf_clear(line);
+	*nlines = 0;
+	if (p >= end)
+		return false;
+
+	while (p < end) {
+		char c = *p;
+
+		if ((c == '\\') && (p + 1 < end) && (p[1] == '\n')) {
+			p += 2;
+			(*nlines)++;
+			continue;
+		}
+		if (c == '\n') {
+			p++;
+			break;
+		}
+		if (!c) {
+			/* As cpp does, ignore NULs */
+			p++;
+			continue;
+		}
+
+		if (quote) {
+			if ((c == '\\') && (p + 1 < end) && (p[1] != '\n')) {
+				buf_add(line, p, 2);
+				p += 2;
+				continue;
+			}
+			if (c == quote)
+				quote = 0;
+		} else if (isspace((unsigned char)c)
+			   || ((c == '/') && (p + 1 < end) && (p[1] == '*'))) {
+			if (c == '/') {
+				const char *q;
+
+				for (q = p + 2; q + 1 < end; q++) {
+					if ((q[0] == '*') && (q[1] == '/'))
+						break;
+					if (*q == '\n')
+						(*nlines)++;
+				}
+				if (q + 1 >= end) {
+					curline = f->lineno + *nlines;
+					pp_error("unterminated comment");
+				}
+				p = q + 1;
+			}
+			if (text)
+				space = true;
+			else
+				buf_addc(line, ' ');
+			p++;
+			continue;
+		} else if ((c == '/') && (p + 1 < end) && (p[1] == '/')) {
+			while ((p < end) && (*p != '\n')) {
+				if ((*p == '\\') && (p + 1 < end)
+				    && (p[1] == '\n')) {
+					p++;
+					(*nlines)++;
+				}
+				p++;
+			}
+			continue;
+		} else if ((c == '"') || (c == '\'')) {
+			/* Check the rest of the line for a closing ' */
+			const char *q = p + 1;
+
+			while ((q < end) && (*q != c) && (*q != '\n'))
+				q += ((*q == '\\') && (q + 1 < end)) ? 2 : 1;
+			if ((c == '"') || ((q < end) && (*q == c)))
+				quote = c;
+		}
+
+		if (space)
+			buf_addc(line, ' ');
+		space = false;
+		text = true;
+		buf_addc(line, c);
+		p++;
+	}
+
+	if (!text)
+		buf_clear(line);
+	(*nlines)++;
+	f->p = p;
+	return true;
+}
+
+/* Reads the next line to continue a macro invocation, unless a directive */
+static bool read_more(struct ppfile *f, struct ppbuf *w, int *nlines,
+		      bool directives)
+{
+	static struct ppbuf line;
+	const char *p;
+	int n;
+
+	if (!f)
+		return false;
+	p = f->p;
+	if (!read_line(f, &line, &n))
+		return false;
+	if (!directives && (line.s[skip_space(line.s, 0)] == '#')) {
+		f->p = p;
+		return false;
+	}
+	buf_addc(w, ' ');
+	buf_addstr(w, line.s + skip_space(line.s, 0));
+	*nlines += n;
+	return true;
+}
+
+/*
+ * Macros
+ */
+
+static struct macro *find_macro(const char *name, size_t len)
+{
+	struct macro *m = table_find(&macros, name, len);
+
+	return (m && !m->undefined) ? m : NULL;
+}
+
+static int param_index(const struct macro *m, const char *name, size_t len)
+{
+	int i;
+
+	for (i = 0; i < m->nparams; i++)
+		if (!strncmp(m->params[i], name, len) && !m->params[i][len])
+			return i;
+	return -1;
+}
+
+static void define_builtin(const char *name, int kind)
+{
+	struct macro *m = xmalloc(sizeof(*m));
+
+	memset(m, 0, sizeof(*m));
+	m->name = xstrdup(name);
+	m->nparams = -1;
+	m->body = xstrdup("");
+	m->kind = kind;
+	table_add(&macros, m);
+}
+
+static bool same_definition(const struct macro *a, const struct macro *b)
+{
+	int i;
+
+	if ((a->nparams != b->nparams) || (a->variadic != b->variadic)
+	    || (a->kind != b->kind) || !streq(a->body, b->body))
+		return false;
+	for (i = 0; i < a->nparams; i++)
+		if (!streq(a->params[i], b->params[i]))
+			return false;
+	return true;
+}
+
+static void free_macro_def(struct macro *m)
+{
+	int i;
+
+	for (i = 0; i < m->nparams; i++)
+		free(m->params[i]);
+	free(m->params);
+	free(m->body);
+}
+
+/* Handles the text of a #define, after the directive name */
+static void do_define(const char *s)
+{
+	struct macro def = { .nparams = -1 }, *m;
+	size_t i = skip_space(s, 0), j, end;
+
+	if (!is_ident_start(s[i]))
+		pp_error("macro names must be identifiers");
+	j = ident_end(s, i);
+
+	if (s[j] == '(') {
+		def.nparams = 0;
+		j = skip_space(s, j + 1);
+		while (s[j] != ')') {
+			char *param;
+			size_t k;
+
+			if (def.variadic)
+				pp_error("missing ')' in macro parameter list");
+			if (!strncmp(s + j, "...", 3)) {
+				param = xstrdup("__VA_ARGS__");
+				def.variadic = true;
+				k = j + 3;
+			} else if (is_ident_start(s[j])) {
+				k = ident_end(s, j);
+				param = xstrndup(s + j, k - j);
+				if (!strncmp(s + k, "...", 3)) {
+					def.variadic = true;
+					k += 3;
+				}
+			} else {
+				pp_error("expected parameter name");
+			}
+			def.params = xrealloc(def.params, (def.nparams + 1)
+					      * sizeof(*def.params));
+			def.params[def.nparams++] = param;
+
+			j = skip_space(s, k);
+			if (s[j] == ',')
+				j = skip_space(s, j + 1);
+			else if (s[j] != ')')
+				pp_error("expected ',' or ')' in macro parameter list");
+		}
+		j++;
+	}
+
+	/* The body, with its whitespace trimmed */
+	j = skip_space(s, j);
+	for (end = strlen(s); (end > j) && isspace((unsigned char)s[end - 1]);
+	     end--)
+		;
+	def.body = xstrndup(s + j, end - j);
+
+	m = table_find(&macros, s + i, ident_end(s, i) - i);
+	if (!m) {
+		m = xmalloc(sizeof(*m));
+		*m = def;
+		m->name = xstrndup(s + i, ident_end(s, i) - i);
+		table_add(&macros, m);
+		return;
+	}
+
+	if (!m->undefined && !same_definition(m, &def))
+		pp_warning("\"%s\" redefined", m->name);
+	free_macro_def(m);
+	def.name = m->name;
+	*m = def;
+}
+
+/* Copies text, dropping PAINT marks */
+static void add_unpainted(struct ppbuf *b, const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (s[i] != PAINT)
+			buf_addc(b, s[i]);
+}
+
+static void add_stringified(struct ppbuf *r, const char *arg)
+{
+	char quote = 0;
+	size_t i;
+
+	buf_addc(r, '"');
+	for (i = 0; arg[i]; i++) {
+		char c = arg[i];
+
+		if (c == PAINT)
+			continue;
+		if (isspace((unsigned char)c)) {
+			if (!quote) {
+				i = skip_space(arg, i) - 1;
+				c = ' ';
+			}
+		} else if (quote) {
+			if ((c == '\\') && arg[i + 1]) {
+				buf_add(r, "\\\\", 2);
+				c = arg[++i];
+				if ((c == '"') || (c == '\\'))
+					buf_addc(r, '\\');
+				buf_addc(r, c);
+				continue;
+			}
+			if (c == quote)
+				quote = 0;
+		} else if (is_literal_start(arg, i)) {
+			quote = c;
+		}
+		if (c == '"')
+			buf_addc(r, '\\');
+		buf_addc(r, c);
+	}
+	buf_addc(r, '"');
+}
+
+static void expand(struct ppbuf *w, struct ppfile *more, int *nlines);
+
+/* Builds the replacement for an invocation of m */
+static void substitute(struct ppbuf *r, struct macro *m, char **args)
+{
+	struct ppbuf *expanded = NULL;
+	const char *b = m->body;
+	bool paste = false;
+	size_t i = 0;
+	char num[16];
+
+	switch (m->kind) {
+	case MACRO_FILE:
+		add_stringified(r, cur->name);
+		return;
+	case MACRO_LINE:
+		snprintf(num, sizeof(num), "%d", curline);
+		buf_addstr(r, num);
+		return;
+	case MACRO_PLAIN:
+		break;
+	}
+
+	if (m->nparams > 0) {
+		expanded = xmalloc(m->nparams * sizeof(*expanded));
+		memset(expanded, 0, m->nparams * sizeof(*expanded));
+	}
+
+	while (b[i]) {
+		size_t t, next;
+		int p;
+
+		if (isspace((unsigned char)b[i])) {
+			i = skip_space(b, i);
+			if (!paste)
+				buf_addc(r, ' ');
+			continue;
+		}
+
+		t = token_end(b, i);
+		if ((t == i + 2) && (b[i] == '#') && (b[i + 1] == '#')) {
+			while (r->len && (r->s[r->len - 1] == ' '))
+				r->s[--r->len] = '\0';
+			paste = true;
+			i = skip_space(b, t);
+			continue;
+		}
+
+		if ((b[i] == '#') && (m->nparams >= 0)) {
+			next = skip_space(b, t);
+			p = param_index(m, b + next, ident_end(b, next) - next);
+			if (is_ident_start(b[next]) && (p >= 0)) {
+				add_stringified(r, args[p]);
+				paste = false;
+				i = ident_end(b, next);
+				continue;
+			}
+		}
+
+		p = is_ident_start(b[i]) ? param_index(m, b + i, t - i) : -1;
+		if (p < 0) {
+			buf_add(r, b + i, t - i);
+		} else {
+			next = skip_space(b, t);
+			if (paste || ((b[next] == '#') && (b[next + 1] == '#'))) {
+				/*
+				 * GNU ", ## __VA_ARGS__" drops the comma if
+				 * there are no arguments, and otherwise just
+				 * separates them, rather than pasting
+				 */
+				if (paste && m->variadic && (p == m->nparams - 1)
+				    && r->len && (r->s[r->len - 1] == ',')) {
+					if (!args[p][0])
+						r->s[--r->len] = '\0';
+					else
+						buf_addc(r, ' ');
+				}
+				add_unpainted(r, args[p], strlen(args[p]));
+			} else {
+				if (!expanded[p].s) {
+					buf_addstr(&expanded[p], args[p]);
+					expand(&expanded[p], NULL, NULL);
+				}
+				buf_add(r, expanded[p].s, expanded[p].len);
+			}
+		}
+		paste = false;
+		i = t;
+	}
+
+	/* Trim the space left by whitespace at the end of an argument */
+	while (r->len && (r->s[r->len - 1] == ' '))
+		r->s[--r->len] = '\0';
+
+	if (expanded) {
+		for (i = 0; i < (size_t)m->nparams; i++)
+			free(expanded[i].s);
+		free(expanded);
+	}
+}
+
+/*
+ * Collects the arguments of an invocation of m whose '(' is at w->s[i],
+ * reading further lines if need be, and returns the offset after ')'.
+ */
+static size_t collect_args(struct macro *m, struct ppbuf *w, size_t i,
+			   char ***argsp, struct ppfile *more, int *nlines)
+{
+	char **args = NULL;
+	int nargs = 0, depth = 0;
+	size_t start = ++i;
+
+	for (;;) {
+		char c;
+
+		if (i >= w->len) {
+			if (!read_more(more, w, nlines, true))
+				pp_error("unterminated argument list invoking macro \"%s\"",
+					 m->name);
+			continue;
+		}
+
+		c = w->s[i];
+		if (is_literal_start(w->s, i)) {
+			i = literal_end(w->s, i);
+			continue;
+		}
+		if (c == '(') {
+			depth++;
+		} else if ((c == ')') && depth) {
+			depth--;
+		} else if ((c == ')')
+			   || ((c == ',') && !depth
+			       && !(m->variadic && (nargs == m->nparams - 1)))) {
+			size_t s = skip_space(w->s, start), e = i;
+
+			while ((e > s) && isspace((unsigned char)w->s[e - 1]))
+				e--;
+			args = xrealloc(args, (nargs + 1) * sizeof(*args));
+			args[nargs++] = xstrndup(w->s + s, e - s);
+			start = i + 1;
+			if (c == ')')
+				break;
+		}
+		i++;
+	}
+
+	/* "f()" is no arguments, rather than one empty one, if f takes none */
+	if ((m->nparams == 0) && (nargs == 1) && !args[0][0])
+		nargs = 0;
+	/* A variadic macro may be given nothing for the rest */
+	if (m->variadic && (nargs == m->nparams - 1)) {
+		args = xrealloc(args, (nargs + 1) * sizeof(*args));
+		args[nargs++] = xstrdup("");
+	}
+
+	if (nargs < m->nparams)
+		pp_error("macro \"%s\" requires %d arguments, but only %d given",
+			 m->name, m->nparams, nargs);
+	if (nargs > m->nparams)
+		pp_error("macro \"%s\" passed %d arguments, but takes just %d",
+			 m->name, nargs, m->nparams);
+
+	*argsp = args;
+	return i + 1;
+}
+
+static void push_active(struct macro *m, size_t end)
+{
+	if (nactives == activesize) {
+		activesize = activesize ? 2 * activesize : 16;
+		actives = xrealloc(actives, activesize * sizeof(*actives));
+	}
+	actives[nactives].m = m;
+	actives[nactives++].end = end;
+	m->disabled = true;
+}
+
+/* Moves the ends of the expansions being rescanned, for an edit at pos */
+static void adjust_actives(size_t base, size_t pos, size_t end, size_t len)
+{
+	/*
+	 * Expansions which finished before the end of the replaced text are
+	 * over (they are at the top of the stack, as they are the innermost).
+	 * Those which contain it take in the replacement.
+	 */
+	while ((nactives > base) && (actives[nactives - 1].end < end)
+	       && (actives[nactives - 1].end > pos))
+		actives[--nactives].m->disabled = false;
+
+	for (; base < nactives; base++)
+		if (actives[base].end > pos)
+			actives[base].end = actives[base].end - (end - pos) + len;
+}
+
+/*
+ * Whether two characters would run together into one token, so that, like
+ * cpp, a space must keep apart the text either side of an expansion
+ */
+static bool would_merge(char a, char b)
+{
+	static const char *const puncts[] = {
+		"<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "++", "--",
+		"->", "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "##",
+	};
+	char pair[3] = { a, b, '\0' };
+	size_t i;
+
+	if (is_ident_char(a) && is_ident_char(b))
+		return true;
+	for (i = 0; i < ARRAY_SIZE(puncts); i++)
+		if (streq(pair, puncts[i]))
+			return true;
+	return false;
+}
+
+/*
+ * Expands the macros in w in place.  If more is given, an invocation may
+ * continue onto its following lines, whose number is added to *nlines.
+ */
+static void expand(struct ppbuf *w, struct ppfile *more, int *nlines)
+{
+	size_t base = nactives, i = 0;
+
+	for (;;) {
+		struct ppbuf r = { 0 };
+		struct macro *m;
+		char **args = NULL;
+		size_t j, end;
+		int k;
+
+		while ((nactives > base) && (actives[nactives - 1].end <= i))
+			actives[--nactives].m->disabled = false;
+		if (i >= w->len)
+			break;
+
+		if (w->s[i] == PAINT) {
+			i = ident_end(w->s, i + 1);
+			continue;
+		}
+		if (!is_ident_start(w->s[i])) {
+			if (is_ppnumber_start(w->s, i)
+			    || is_literal_start(w->s, i))
+				i = token_end(w->s, i);
+			else
+				i++;
+			continue;
+		}
+
+		j = ident_end(w->s, i);
+		m = find_macro(w->s + i, j - i);
+		if (!m) {
+			i = j;
+			continue;
+		}
+		if (m->disabled) {
+			char paint = PAINT;
+
+			buf_replace(w, i, 0, &paint, 1);
+			adjust_actives(base, i, i, 1);
+			i = j + 1;
+			continue;
+		}
+
+		end = j;
+		if (m->nparams >= 0) {
+			size_t p = skip_space(w->s, j);
+
+			while ((p >= w->len) && read_more(more, w, nlines, false))
+				p = skip_space(w->s, j);
+			if (w->s[p] != '(') {
+				i = j;
+				continue;
+			}
+			end = collect_args(m, w, p, &args, more, nlines);
+		}
+
+		substitute(&r, m, args);
+		if (r.len && (end < w->len)
+		    && would_merge(r.s[r.len - 1], w->s[end]))
+			buf_addc(&r, ' ');
+		if (r.len && (i > 0)
+		    && would_merge(w->s[i - 1], r.s[r.s[0] == PAINT]))
+			buf_replace(&r, 0, 0, " ", 1);
+		buf_replace(w, i, end - i, r.s ? r.s : "", r.len);
+		adjust_actives(base, i, end, r.len);
+		push_active(m, i + r.len);
+
+		for (k = 0; args && (k < m->nparams); k++)
+			free(args[k]);
+		free(args);
+		free(r.s);
+	}
+}
+
+/*
+ * #if expressions
+ */
+
+struct pp_value {
+	uint64_t v;
+	bool is_unsigned;
+};
+
+struct expr {
+	const char *s;
+};
+
+enum { OP_NONE, OP_OR, OP_AND, OP_BITOR, OP_BITXOR, OP_BITAND, OP_EQ, OP_NE,
+       OP_LT, OP_GT, OP_LE, OP_GE, OP_LSHIFT, OP_RSHIFT, OP_ADD, OP_SUB,
+       OP_MUL, OP_DIV, OP_MOD };
+
+static const struct {
+	const char *text;
+	int op, prec;
+} binops[] = {
+	/* Two-character operators first */
+	{ "||", OP_OR, 1 }, { "&&", OP_AND, 2 }, { "==", OP_EQ, 6 },
+	{ "!=", OP_NE, 6 }, { "<=", OP_LE, 7 }, { ">=", OP_GE, 7 },
+	{ "<<", OP_LSHIFT, 8 }, { ">>", OP_RSHIFT, 8 },
+	{ "|", OP_BITOR, 3 }, { "^", OP_BITXOR, 4 }, { "&", OP_BITAND, 5 },
+	{ "<", OP_LT, 7 }, { ">", OP_GT, 7 }, { "+", OP_ADD, 9 },
+	{ "-", OP_SUB, 9 }, { "*", OP_MUL, 10 }, { "/", OP_DIV, 10 },
+	{ "%", OP_MOD, 10 },
+};
+
+static void skip_expr_space(struct expr *e)
+{
+	while (isspace((unsigned char)*e->s) || (*e->s == PAINT))
+		e->s++;
+}
+
+static struct pp_value eval_cond(struct expr *e, bool ev);
+
+static struct pp_value eval_unary(struct expr *e, bool ev)
+{
+	struct pp_value v = { 0 };
+	char *end;
+
+	skip_expr_space(e);
+	switch (*e->s) {
+	case '+':
+		e->s++;
+		return eval_unary(e, ev);
+	case '-':
+		e->s++;
+		v = eval_unary(e, ev);
+		v.v = -v.v;
+		return v;
+	case '~':
+		e->s++;
+		v = eval_unary(e, ev);
+		v.v = ~v.v;
+		return v;
+	case '!':
+		e->s++;
+		v = eval_unary(e, ev);
+		v.v = !v.v;
+		v.is_unsigned = false;
+		return v;
+	case '(':
+		e->s++;
+		v = eval_cond(e, ev);
+		skip_expr_space(e);
+		if (*e->s != ')')
+			pp_error("missing ')' in expression");
+		e->s++;
+		return v;
+	case '\'': {
+		int i = 1;
+
+		if (e->s[i] == '\\') {
+			i++;
+			v.v = (unsigned char)get_escape_char(e->s, &i);
+		} else if (e->s[i] && (e->s[i] != '\'')) {
+			v.v = (unsigned char)e->s[i++];
+		}
+		if (e->s[i] != '\'')
+			pp_error("invalid character constant in expression");
+		e->s += i + 1;
+		return v;
+	}
+	}
+
+	if (isdigit((unsigned char)*e->s)) {
+		errno = 0;
+		v.v = strtoull(e->s, &end, 0);
+		if (errno == ERANGE)
+			pp_error("integer constant is too large");
+		for (e->s = end; strchr("uUlL", *e->s) && *e->s; e->s++)
+			if ((*e->s == 'u') || (*e->s == 'U'))
+				v.is_unsigned = true;
+		if (is_ident_char(*e->s) || (*e->s == '.'))
+			pp_error("invalid integer constant in expression");
+		if (v.v > INT64_MAX)
+			v.is_unsigned = true;
+		return v;
+	}
+
+	/* Identifiers left after expansion are 0 */
+	if (is_ident_start(*e->s)) {
+		e->s += ident_end(e->s, 0);
+		return v;
+	}
+
+	if (*e->s)
+		pp_error("token \"%c\" is not valid in preprocessor expressions",
+			 *e->s);
+	pp_error("#if with no expression");
+}
+
+static int peek_binop(struct expr *e, int *prec, size_t *len)
+{
+	size_t i;
+
+	skip_expr_space(e);
+	for (i = 0; i < ARRAY_SIZE(binops); i++) {
+		*len = strlen(binops[i].text);
+		if (!strncmp(e->s, binops[i].text, *len)) {
+			*prec = binops[i].prec;
+			return binops[i].op;
+		}
+	}
+	return OP_NONE;
+}
+
+static struct pp_value apply_binop(int op, struct pp_value a,
+				   struct pp_value b, bool ev)
+{
+	struct pp_value r;
+	bool u = a.is_unsigned || b.is_unsigned;
+	int64_t sa = a.v, sb = b.v;
+
+	r.is_unsigned = u;
+	switch (op) {
+	case OP_OR: r.v = a.v || b.v; r.is_unsigned = false; break;
+	case OP_AND: r.v = a.v && b.v; r.is_unsigned = false; break;
+	case OP_BITOR: r.v = a.v | b.v; break;
+	case OP_BITXOR: r.v = a.v ^ b.v; break;
+	case OP_BITAND: r.v = a.v & b.v; break;
+	case OP_EQ: r.v = a.v == b.v; r.is_unsigned = false; break;
+	case OP_NE: r.v = a.v != b.v; r.is_unsigned = false; break;
+	case OP_LT: r.v = u ? (a.v < b.v) : (sa < sb); r.is_unsigned = false; break;
+	case OP_GT: r.v = u ? (a.v > b.v) : (sa > sb); r.is_unsigned = false; break;
+	case OP_LE: r.v = u ? (a.v <= b.v) : (sa <= sb); r.is_unsigned = false; break;
+	case OP_GE: r.v = u ? (a.v >= b.v) : (sa >= sb); r.is_unsigned = false; break;
+	case OP_LSHIFT:
+		r.is_unsigned = a.is_unsigned;
+		r.v = (b.v >= 64) ? 0 : a.v << b.v;
+		break;
+	case OP_RSHIFT:
+		r.is_unsigned = a.is_unsigned;
+		if (b.v >= 64)
+			r.v = (a.is_unsigned || (sa >= 0)) ? 0 : -1;
+		else
+			r.v = a.is_unsigned ? (a.v >> b.v)
+				: (uint64_t)(sa >> b.v);
+		break;
+	case OP_ADD: r.v = a.v + b.v; break;
+	case OP_SUB: r.v = a.v - b.v; break;
+	case OP_MUL: r.v = a.v * b.v; break;
+	case OP_DIV:
+	case OP_MOD:
+		if (!b.v) {
+			if (ev)
+				pp_error("division by zero in #if");
+			r.v = 0;
+		} else if (u) {
+			r.v = (op == OP_DIV) ? a.v / b.v : a.v % b.v;
+		} else if ((sa == INT64_MIN) && (sb == -1)) {
+			r.v = (op == OP_DIV) ? a.v : 0;
+		} else {
+			r.v = (op == OP_DIV) ? sa / sb : sa % sb;
+		}
+		break;
+	default:
+		assert(0);
+	}
+	return r;
+}
+
+static struct pp_value eval_binary(struct expr *e, int minprec, bool ev)
+{
+	struct pp_value lhs = eval_unary(e, ev);
+	int op, prec;
+	size_t len;
+
+	while (((op = peek_binop(e, &prec, &len)) != OP_NONE)
+	       && (prec >= minprec)) {
+		struct pp_value rhs;
+		bool rhs_ev = ev;
+
+		e->s += len;
+		if ((op == OP_AND) && !lhs.v)
+			rhs_ev = false;
+		if ((op == OP_OR) && lhs.v)
+			rhs_ev = false;
+		rhs = eval_binary(e, prec + 1, rhs_ev);
+		lhs = apply_binop(op, lhs, rhs, ev);
+	}
+	return lhs;
+}
+
+static struct pp_value eval_cond(struct expr *e, bool ev)
+{
+	struct pp_value c = eval_binary(e, 1, ev), a, b;
+
+	skip_expr_space(e);
+	if (*e->s != '?')
+		return c;
+	e->s++;
+	a = eval_cond(e, ev && c.v);
+	skip_expr_space(e);
+	if (*e->s != ':')
+		pp_error("'?' without following ':'");
+	e->s++;
+	b = eval_cond(e, ev && !c.v);
+
+	a.v = c.v ? a.v : b.v;
+	a.is_unsigned = a.is_unsigned || b.is_unsigned;
+	return a;
+}
+
+static bool eval_if(const char *s)
+{
+	struct ppbuf w = { 0 };
+	struct expr e;
+	size_t i = 0;
+	bool val;
+
+	/* "defined" is handled before expansion */
+	while (s[i]) {
+		size_t j = token_end(s, i), k;
+		bool paren;
+
+		if (isspace((unsigned char)s[i]) || (j - i != 7)
+		    || strncmp(s + i, "defined", 7)) {
+			if (isspace((unsigned char)s[i]))
+				j = i + 1;
+			buf_add(&w, s + i, j - i);
+			i = j;
+			continue;
+		}
+
+		k = skip_space(s, j);
+		paren = (s[k] == '(');
+		if (paren)
+			k = skip_space(s, k + 1);
+		if (!is_ident_start(s[k]))
+			pp_error("operator \"defined\" requires an identifier");
+		j = ident_end(s, k);
+		buf_addstr(&w, find_macro(s + k, j - k) ? " 1 " : " 0 ");
+		if (paren) {
+			j = skip_space(s, j);
+			if (s[j] != ')')
+				pp_error("missing ')' after \"defined\"");
+			j++;
+		}
+		i = j;
+	}
+
+	if (!w.s)
+		pp_error("#if with no expression");
+	expand(&w, NULL, NULL);
+
+	e.s = w.s;
+	val = eval_cond(&e, true).v != 0;
+	skip_expr_space(&e);
+	if (*e.s)
+		pp_error("missing binary operator before \"%c\"", *e.s);
+
+	free(w.s);
+	return val;
+}
+
+/*
+ * Output
+ */
+
+static void emit_marker(const char *name, int lineno, const char *flag)
+{
+	char num[16];
+	size_t i;
+
+	snprintf(num, sizeof(num), "# %d \"", lineno);
+	buf_addstr(&out, num);
+	for (i = 0; name[i]; i++) {
+		if ((name[i] == '"') || (name[i] == '\\'))
+			buf_addc(&out, '\\');
+		buf_addc(&out, name[i]);
+	}
+	buf_addc(&out, '"');
+	buf_addstr(&out, flag);
+	buf_addc(&out, '\n');
+}
+
+static void emit_newlines(int n)
+{
+	while (n-- > 0)
+		buf_addc(&out, '\n');
+}
+
+/*
+ * Includes
+ */
+
+static struct header *read_header(const char *fullname, FILE *f)
+{
+	struct header *h = xmalloc(sizeof(*h));
+	size_t size = 4096, n;
+	char *slash;
+
+	memset(h, 0, sizeof(*h));
+	h->name = xstrdup(fullname);
+	slash = strrchr(h->name, '/');
+	if (slash)
+		h->dir = xstrndup(h->name, slash - h->name);
+
+	h->text = xmalloc(size);
+	while ((n = fread(h->text + h->len, 1, size - h->len, f)) > 0) {
+		h->len += n;
+		if (h->len == size) {
+			size *= 2;
+			h->text = xrealloc(h->text, size);
+		}
+	}
+	if (ferror(f))
+		die("Error reading \"%s\": %s\n", fullname, strerror(errno));
+
+	return h;
+}
+
+static struct header *find_header(const char *name, bool angled)
+{
+	const char *dir = angled ? srcfile_search_path(0) : cur->dir;
+	struct include *inc;
+	struct header *h;
+	char *key, *fullname;
+	FILE *f;
+
+	xasprintf(&key, "%c%s\n%s", angled ? '<' : '"', dir ? dir : "", name);
+	inc = table_find(&includes, key, strlen(key));
+	if (inc) {
+		free(key);
+		return inc->h;
+	}
+
+	if (angled && !dir)
+		return NULL;
+	f = srcfile_open_from(dir, name, &fullname);
+	if (!f) {
+		free(key);
+		free(fullname);
+		return NULL;
+	}
+
+	h = table_find(&headers, fullname, strlen(fullname));
+	if (!h) {
+		h = read_header(fullname, f);
+		table_add(&headers, h);
+		if (depfile) {
+			fputc(' ', depfile);
+			fprint_path_escaped(depfile, fullname);
+		}
+	}
+	fclose(f);
+	free(fullname);
+
+	inc = xmalloc(sizeof(*inc));
+	inc->key = key;
+	inc->h = h;
+	table_add(&includes, inc);
+	return h;
+}
+
+static void process_file(struct ppfile *f);
+
+/* Returns false if the header was skipped, so no line markers were output */
+static bool do_include(const char *s)
+{
+	struct ppbuf w = { 0 };
+	struct ppfile inc;
+	struct header *h;
+	char *name;
+	size_t i = skip_space(s, 0), j;
+	bool angled;
+
+	if ((s[i] != '"') && (s[i] != '<')) {
+		/* #include MACRO */
+		buf_addstr(&w, s + i);
+		expand(&w, NULL, NULL);
+		s = w.s;
+		i = skip_space(s, 0);
+		if ((s[i] != '"') && (s[i] != '<'))
+			pp_error("#include expects \"FILENAME\" or <FILENAME>");
+	}
+
+	angled = (s[i] == '<');
+	j = i + 1;
+	while (s[j] && (s[j] != (angled ? '>' : '"')))
+		j++;
+	if (!s[j])
+		pp_error("missing terminating %c character", angled ? '>' : '"');
+	name = xstrndup(s + i + 1, j - i - 1);
+	free(w.s);
+
+	h = find_header(name, angled);
+	if (!h)
+		pp_error("%s: No such file or directory", name);
+	free(name);
+
+	if (h->once && h->scanned)
+		return false;
+	if (h->guard && find_macro(h->guard, strlen(h->guard)))
+		return false;
+	if (cur->depth >= MAX_INCLUDE_DEPTH)
+		pp_error("#include nested depth %d exceeds maximum of %d",
+			 cur->depth, MAX_INCLUDE_DEPTH);
+
+	memset(&inc, 0, sizeof(inc));
+	inc.name = h->name;
+	inc.dir = h->dir;
+	inc.p = h->text;
+	inc.end = h->text + h->len;
+	inc.lineno = 1;
+	inc.depth = cur->depth + 1;
+	inc.h = h;
+
+	emit_marker(inc.name, 1, " 1");
+	process_file(&inc);
+	emit_marker(cur->name, cur->lineno, " 2");
+	return true;
+}
+
+/*
+ * Directives
+ */
+
+static bool skipping(void)
+{
+	return nconds && !conds[nconds - 1].active;
+}
+
+static void push_cond(bool val)
+{
+	bool outer = !skipping();
+
+	if (nconds == condsize) {
+		condsize = condsize ? 2 * condsize : 16;
+		conds = xrealloc(conds, condsize * sizeof(*conds));
+	}
+	conds[nconds].active = outer && val;
+	conds[nconds].taken = !outer || val;
+	conds[nconds].seen_else = false;
+	nconds++;
+}
+
+/* Reads the macro name after #ifdef, #ifndef or #undef */
+static char *directive_name(const char *s, const char *directive)
+{
+	size_t i = skip_space(s, 0), j = ident_end(s, i);
+
+	if (!is_ident_start(s[i]))
+		pp_error("no macro name given in #%s directive", directive);
+	if (s[skip_space(s, j)])
+		pp_warning("extra tokens at end of #%s directive", directive);
+	return xstrndup(s + i, j - i);
+}
+
+static void check_guard(struct ppfile *f, bool significant)
+{
+	if (significant && ((f->guard == GUARD_NONE)
+			    || (f->guard == GUARD_CLOSED)))
+		f->guard = GUARD_FAILED;
+}
+
+enum directive_result {
+	NOT_DIRECTIVE,
+	DIRECTIVE_DONE,
+	DIRECTIVE_MARKED,	/* a line marker gives the next line's number */
+};
+
+static enum directive_result directive(struct ppfile *f, const char *s)
+{
+	size_t i = skip_space(s, 0), j = ident_end(s, i);
+	const char *rest = s + j;
+	struct macro *m;
+	char *name, *e;
+	bool ifdef;
+	int n;
+
+#define IS(d)	((j - i == strlen(d)) && !strncmp(s + i, (d), j - i))
+
+	if (!s[i])
+		return DIRECTIVE_DONE;	/* null directive */
+
+	if (isdigit((unsigned char)s[i]) || IS("line")) {
+		if (skipping())
+			return DIRECTIVE_DONE;
+		if (IS("line"))
+			i = skip_space(s, j);
+		if (!isdigit((unsigned char)s[i]))
+			pp_error("\"%s\" after #line is not a positive integer",
+				 s + i);
+		n = strtol(s + i, &e, 10);
+		i = skip_space(s, e - s);
+		if (s[i] == '"') {
+			struct data d;
+
+			j = literal_end(s, i);
+			d = data_copy_escape_string(s + i + 1, j - i - 2);
+			f->name = xstrdup(d.val);
+			data_free(d);
+		}
+		check_guard(f, true);
+		f->lineno = n;
+		emit_marker(f->name, n, "");
+		return DIRECTIVE_MARKED;
+	}
+
+	if (IS("if")) {
+		check_guard(f, true);
+		push_cond(!skipping() && eval_if(rest));
+		return DIRECTIVE_DONE;
+	}
+
+	if (IS("ifdef") || IS("ifndef")) {
+		ifdef = IS("ifdef");
+		name = directive_name(rest, ifdef ? "ifdef" : "ifndef");
+
+		/* The header may be wholly within #ifndef GUARD ... #endif */
+		if (!ifdef && f->h && !f->h->scanned
+		    && (f->guard == GUARD_NONE) && (nconds == f->condbase)) {
+			f->guard = GUARD_OPEN;
+			f->guardname = xstrdup(name);
+			f->guardlevel = nconds;
+		} else {
+			check_guard(f, true);
+		}
+
+		push_cond(!find_macro(name, strlen(name)) == !ifdef);
+		free(name);
+		return DIRECTIVE_DONE;
+	}
+
+	if (IS("elif") || IS("else")) {
+		struct cond *c;
+
+		if (nconds == f->condbase)
+			pp_error("#%s without #if", IS("else") ? "else" : "elif");
+		c = &conds[nconds - 1];
+		if (c->seen_else)
+			pp_error("#%s after #else", IS("else") ? "else" : "elif");
+		if ((f->guard == GUARD_OPEN) && (nconds - 1 == f->guardlevel))
+			f->guard = GUARD_FAILED;
+
+		c->active = false;
+		if (!c->taken) {
+			c->active = IS("else") || eval_if(rest);
+			c->taken = c->active;
+		}
+		c->seen_else = IS("else");
+		return DIRECTIVE_DONE;
+	}
+
+	if (IS("endif")) {
+		if (nconds == f->condbase)
+			pp_error("#endif without #if");
+		nconds--;
+		if ((f->guard == GUARD_OPEN) && (nconds == f->guardlevel))
+			f->guard = GUARD_CLOSED;
+		return DIRECTIVE_DONE;
+	}
+
+	if (skipping())
+		return DIRECTIVE_DONE;
+
+	if (IS("define")) {
+		do_define(rest);
+	} else if (IS("undef")) {
+		name = directive_name(rest, "undef");
+		m = find_macro(name, strlen(name));
+		if (m)
+			m->undefined = true;
+		free(name);
+	} else if (IS("include")) {
+		check_guard(f, true);
+		return do_include(rest) ? DIRECTIVE_MARKED : DIRECTIVE_DONE;
+	} else if (IS("error")) {
+		pp_error("#error %s", rest + skip_space(rest, 0));
+	} else if (IS("warning")) {
+		pp_warning("#warning %s", rest + skip_space(rest, 0));
+	} else if (IS("pragma")) {
+		i = skip_space(rest, 0);
+		if (f->h && !strncmp(rest + i, "once", 4)
+		    && !is_ident_char(rest[i + 4]))
+			f->h->once = true;
+	} else {
+		/* As in assembler mode, not a directive but text */
+		return NOT_DIRECTIVE;
+	}
+	check_guard(f, true);
+	return DIRECTIVE_DONE;
+#undef IS
+}
+
+static void process_file(struct ppfile *f)
+{
+	struct ppfile *prev = cur;
+	struct ppbuf line = { 0 };
+	int n;
+
+	cur = f;
+	f->condbase = nconds;
+
+	while (read_line(f, &line, &n)) {
+		size_t i = skip_space(line.s, 0);
+
+		curline = f->lineno;
+		f->lineno += n;
+
+		if (line.s[i] == '#') {
+			enum directive_result r = directive(f, line.s + i + 1);
+
+			if (r == DIRECTIVE_DONE)
+				emit_newlines(n);
+			if (r != NOT_DIRECTIVE)
+				continue;
+		}
+		if (skipping()) {
+			emit_newlines(n);
+			continue;
+		}
+
+		check_guard(f, line.s[i] != '\0');
+		expand(&line, f, &n);
+		f->lineno = curline + n;
+		add_unpainted(&out, line.s, line.len);
+		emit_newlines(n);
+	}
+
+	curline = f->lineno;
+	if (nconds > f->condbase)
+		pp_error("unterminated conditional directive");
+
+	if (f->h && !f->h->scanned) {
+		f->h->scanned = true;
+		if (f->guard == GUARD_CLOSED)
+			f->h->guard = f->guardname;
+		else
+			free(f->guardname);
+	}
+	free(line.s);
+	cur = prev;
+}
+
+void preproc_define(const char *def)
+{
+	cmdline_defs = xrealloc(cmdline_defs,
+				(ncmdline_defs + 1) * sizeof(*cmdline_defs));
+	cmdline_defs[ncmdline_defs++] = xstrdup(def);
+}
+
+static void define_cmdline(void)
+{
+	struct ppfile cmdline = { .name = "<command-line>" };
+	int i;
+
+	cur = &cmdline;
+	curline = 1;
+	do_define("__ASSEMBLER__ 1");
+	for (i = 0; i < ncmdline_defs; i++) {
+		char *def = xstrdup(cmdline_defs[i]);
+		char *eq = strchr(def, '=');
+
+		/* -D NAME is NAME 1, and -D NAME=VALUE is NAME VALUE */
+		if (eq) {
+			*eq = ' ';
+			do_define(def);
+		} else {
+			char *d;
+
+			xasprintf(&d, "%s 1", def);
+			do_define(d);
+			free(d);
+		}
+		free(def);
+	}
+	cur = NULL;
+}
+
+void preproc_srcfile(void)
+{
+	struct srcfile_state *srcfile = current_srcfile;
+	struct ppfile f;
+	struct header *top;
+
+	define_builtin("__FILE__", MACRO_FILE);
+	define_builtin("__LINE__", MACRO_LINE);
+	define_cmdline();
+
+	top = read_header(srcfile->name, srcfile->f);
+	memset(&f, 0, sizeof(f));
+	f.name = srcfile->name;
+	f.dir = srcfile->dir;
+	f.p = top->text;
+	f.end = top->text + top->len;
+	f.lineno = 1;
+
+	emit_marker(f.name, 1, "");
+	process_file(&f);
+	free(top->text);
+	free(top->dir);
+	free(top->name);
+	free(top);
+
+	/* The lexer scans the output in place, which needs two NULs after it */
+	buf_grow(&out, 1);
+	out.s[out.len + 1] = '\0';
+	srcfile_set_text(out.s, out.len);
+	out.s = NULL;
+	out.len = out.size = 0;
+}
@@ -0,0 +1,703 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Persistent cache of lexed /include/ files.
+ *
+ * The same .dtsi files are typically included by many dts files, and
+ * lexing them again for every board is wasted work.  With -C <dir>,
+ * each included file lexed without errors has its token stream saved
+ * to <dir>, and later includes of an unchanged file replay the saved
+ * tokens instead of lexing it again.
+ *
+ * A file's tokens depend on its contents, on the lexer start condition
+ * at the point it is included, and on whatever it includes in turn.
+ * Entries are keyed on the first two; the nested includes are recorded
+ * in the entry along with their contents' hashes, and are resolved and
+ * hashed again before an entry is used.  Anything that does not match
+ * simply causes the file to be lexed as normal.
+ *
+ * The parser still sees exactly the same tokens, locations, #line
+ * directives and include nesting as it would have from the lexer, so
+ * the resulting tree is identical.
+ */
+
+#include <sys/stat.h>
+
+#include "dtc.h"
+#include "srcpos.h"
+#include "version_gen.h"
+
+#define CACHE_MAGIC	0x43435444	/* "DTCC" */
+#define CACHE_FORMAT	2
+
+enum cache_event {
+	EV_END = 0,
+	EV_TOKEN,
+	EV_LINE,	/* #line directive */
+	EV_PUSH,	/* start of a nested include */
+	EV_POP,		/* end of a nested include */
+};
+
+struct cachebuf {
+	char *buf;
+	size_t len, size;
+};
+
+/* A file whose tokens are being saved as it is lexed */
+struct recorder {
+	struct srcfile_state *file;
+	char *fullname;		/* file->name may be changed by #line */
+	uint64_t hash;
+	int startcond;
+	bool failed;
+	unsigned int ndeps;
+	struct cachebuf deps, events;
+	struct recorder *prev;
+};
+
+/* A cache entry being replayed */
+struct replay {
+	char *buf;
+	size_t len, pos;
+	int endcond;
+	uint32_t ndeps;
+	size_t deps, depslen;	/* encoded nested includes, within buf */
+	int depth;		/* nested includes currently open */
+};
+
+static char *cache_dir;
+static struct recorder *recorders;
+static struct replay *replay;
+
+void srccache_init(const char *dir)
+{
+	cache_dir = xstrdup(dir);
+	if ((mkdir(cache_dir, 0777) != 0) && (errno != EEXIST))
+		die("Couldn't create include cache directory %s: %s\n",
+		    cache_dir, strerror(errno));
+}
+
+/*
+ * Files are told apart by a hash of their contents, and entries found by
+ * a hash of their key, so both use the 64-bit FNV-1a: a collision would
+ * replay the wrong tokens rather than just cost a probe, and with 32 bits
+ * one becomes likely over a few tens of thousands of files.
+ */
+static bool hash_file(FILE *f, uint64_t *hash)
+{
+	char buf[65536];
+	uint64_t h = FNV1A64_SEED;
+	size_t n;
+
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		h = fnv1a_hash64(buf, n, h);
+
+	if (ferror(f))
+		return false;
+
+	*hash = h;
+	return true;
+}
+
+/*
+ * Writing entries
+ */
+
+static void buf_put(struct cachebuf *b, const void *p, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = b->size ? 2 * b->size : 4096;
+		while (b->len + len > b->size)
+			b->size *= 2;
+		b->buf = xrealloc(b->buf, b->size);
+	}
+	memcpy(b->buf + b->len, p, len);
+	b->len += len;
+}
+
+static void buf_u8(struct cachebuf *b, uint8_t v)
+{
+	buf_put(b, &v, sizeof(v));
+}
+
+static void buf_u32(struct cachebuf *b, uint32_t v)
+{
+	buf_put(b, &v, sizeof(v));
+}
+
+static void buf_u64(struct cachebuf *b, uint64_t v)
+{
+	buf_put(b, &v, sizeof(v));
+}
+
+static void buf_str(struct cachebuf *b, const char *s)
+{
+	uint32_t len = s ? strlen(s) + 1 : 0;
+
+	buf_u32(b, len);
+	buf_put(b, s, len);
+}
+
+static void buf_bytes(struct cachebuf *b, const void *p, size_t len)
+{
+	buf_u32(b, len);
+	buf_put(b, p, len);
+}
+
+static char *search_path_string(void)
+{
+	const char *dir;
+	char *s = NULL;
+	int i;
+
+	xasprintf(&s, "%s", "");
+	for (i = 0; (dir = srcfile_search_path(i)) != NULL; i++)
+		xasprintf_append(&s, "%s\n", dir);
+	return s;
+}
+
+static char *entry_name(const char *fullname, uint64_t hash, int startcond)
+{
+	char *searchpath = search_path_string();
+	uint64_t key = FNV1A64_SEED;
+	char *name;
+
+	key = fnv1a_hash64(DTC_VERSION, strlen(DTC_VERSION) + 1, key);
+	key = fnv1a_hash64(fullname, strlen(fullname) + 1, key);
+	key = fnv1a_hash64(&hash, sizeof(hash), key);
+	key = fnv1a_hash64(&startcond, sizeof(startcond), key);
+	key = fnv1a_hash64(searchpath, strlen(searchpath) + 1, key);
+	free(searchpath);
+
+	xasprintf(&name, "%s/%016" PRIx64 ".dtsc", cache_dir, key);
+	return name;
+}
+
+static void write_entry(struct recorder *r, int endcond)
+{
+	struct cachebuf b = { 0 };
+	char *name, *tmpname, *searchpath;
+	FILE *f;
+	bool ok;
+
+	buf_u32(&b, CACHE_MAGIC);
+	buf_u32(&b, CACHE_FORMAT);
+	buf_str(&b, DTC_VERSION);
+	buf_str(&b, r->fullname);
+	buf_u64(&b, r->hash);
+	buf_u32(&b, r->startcond);
+	searchpath = search_path_string();
+	buf_str(&b, searchpath);
+	free(searchpath);
+	buf_u32(&b, endcond);
+	buf_u32(&b, r->ndeps);
+	buf_put(&b, r->deps.buf, r->deps.len);
+	buf_put(&b, r->events.buf, r->events.len);
+	buf_u8(&b, EV_END);
+
+	/* Write to a temporary and rename, so readers never see a partial entry */
+	name = entry_name(r->fullname, r->hash, r->startcond);
+	xasprintf(&tmpname, "%s.%ld.tmp", name, (long)getpid());
+	f = fopen(tmpname, "wb");
+	if (f) {
+		ok = (fwrite(b.buf, 1, b.len, f) == b.len);
+		ok = (fclose(f) == 0) && ok;
+		if (!ok || (rename(tmpname, name) != 0))
+			remove(tmpname);
+	}
+
+	free(tmpname);
+	free(name);
+	free(b.buf);
+}
+
+static void record_event(struct recorder *r, const void *p, size_t len)
+{
+	if (!r->failed)
+		buf_put(&r->events, p, len);
+}
+
+/* Add an already encoded event to every file being recorded */
+static void record(struct cachebuf *ev)
+{
+	struct recorder *r;
+
+	for (r = recorders; r; r = r->prev)
+		record_event(r, ev->buf, ev->len);
+	ev->len = 0;
+}
+
+static struct cachebuf evbuf;
+
+static void record_push(const char *fullname)
+{
+	if (!recorders)
+		return;
+
+	buf_u8(&evbuf, EV_PUSH);
+	buf_str(&evbuf, fullname);
+	record(&evbuf);
+}
+
+/* Outer files depend on this one, so check it when loading them */
+static void record_dep(const char *name, const char *dir,
+		       const char *fullname, uint64_t hash)
+{
+	struct recorder *r;
+
+	for (r = recorders; r; r = r->prev) {
+		buf_str(&r->deps, name);
+		buf_str(&r->deps, dir);
+		buf_str(&r->deps, fullname);
+		buf_u64(&r->deps, hash);
+		r->ndeps++;
+	}
+}
+
+static void record_pop(void)
+{
+	if (!recorders)
+		return;
+
+	buf_u8(&evbuf, EV_POP);
+	record(&evbuf);
+}
+
+void srccache_token(const struct srccache_token *t)
+{
+	if (!recorders)
+		return;
+
+	buf_u8(&evbuf, EV_TOKEN);
+	buf_u32(&evbuf, t->token);
+	buf_u8(&evbuf, t->kind);
+	switch (t->kind) {
+	case CACHE_VAL_NONE:
+		break;
+	case CACHE_VAL_STRING:
+		buf_str(&evbuf, t->str);
+		break;
+	case CACHE_VAL_DATA:
+		buf_bytes(&evbuf, t->str, t->len);
+		break;
+	case CACHE_VAL_INTEGER:
+		buf_u64(&evbuf, t->integer);
+		break;
+	}
+	buf_u32(&evbuf, t->pos.first_line);
+	buf_u32(&evbuf, t->pos.first_column);
+	buf_u32(&evbuf, t->pos.last_line);
+	buf_u32(&evbuf, t->pos.last_column);
+	record(&evbuf);
+}
+
+void srccache_line(const char *name, int line)
+{
+	if (!recorders)
+		return;
+
+	buf_u8(&evbuf, EV_LINE);
+	buf_str(&evbuf, name);
+	buf_u32(&evbuf, line);
+	record(&evbuf);
+}
+
+void srccache_error(void)
+{
+	struct recorder *r;
+
+	/* Errors must be reported on every run, so never cache them */
+	for (r = recorders; r; r = r->prev)
+		r->failed = true;
+}
+
+/*
+ * Reading entries
+ */
+
+struct reader {
+	const char *buf;
+	size_t len, pos;
+	bool bad;
+};
+
+static const void *rd_get(struct reader *rd, size_t len)
+{
+	const void *p = rd->buf + rd->pos;
+
+	if (rd->bad || (len > rd->len - rd->pos)) {
+		rd->bad = true;
+		return NULL;
+	}
+	rd->pos += len;
+	return p;
+}
+
+static uint8_t rd_u8(struct reader *rd)
+{
+	const uint8_t *p = rd_get(rd, sizeof(*p));
+
+	return p ? *p : 0;
+}
+
+static uint32_t rd_u32(struct reader *rd)
+{
+	const void *p = rd_get(rd, sizeof(uint32_t));
+	uint32_t v = 0;
+
+	if (p)
+		memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t rd_u64(struct reader *rd)
+{
+	const void *p = rd_get(rd, sizeof(uint64_t));
+	uint64_t v = 0;
+
+	if (p)
+		memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static const char *rd_bytes(struct reader *rd, uint32_t *lenp)
+{
+	uint32_t len = rd_u32(rd);
+
+	if (lenp)
+		*lenp = len;
+	return rd_get(rd, len);
+}
+
+/* Returns NULL for a NULL string as well as on error */
+static const char *rd_str(struct reader *rd)
+{
+	uint32_t len;
+	const char *s = rd_bytes(rd, &len);
+
+	if (!len)
+		return NULL;
+	if (s && (s[len - 1] != '\0'))
+		rd->bad = true;
+	return rd->bad ? NULL : s;
+}
+
+static bool str_matches(struct reader *rd, const char *s)
+{
+	const char *r = rd_str(rd);
+
+	return r && streq(r, s);
+}
+
+static bool load_file(const char *name, char **bufp, size_t *lenp)
+{
+	FILE *f = fopen(name, "rb");
+	struct cachebuf b = { 0 };
+	char tmp[65536];
+	size_t n;
+
+	if (!f)
+		return false;
+
+	while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0)
+		buf_put(&b, tmp, n);
+
+	if (ferror(f) || !b.len) {
+		fclose(f);
+		free(b.buf);
+		return false;
+	}
+	fclose(f);
+
+	*bufp = b.buf;
+	*lenp = b.len;
+	return true;
+}
+
+/* Check a nested include still resolves to the same, unchanged file */
+static bool dep_is_current(struct reader *rd)
+{
+	const char *name = rd_str(rd);
+	const char *dir = rd_str(rd);
+	const char *fullname = rd_str(rd);
+	uint64_t hash = rd_u64(rd), newhash;
+	char *newname;
+	FILE *f;
+	bool ok;
+
+	if (rd->bad || !name || !fullname)
+		return false;
+
+	f = srcfile_open_from(dir, name, &newname);
+	if (!f)
+		return false;
+
+	ok = streq(newname, fullname) && hash_file(f, &newhash)
+		&& (newhash == hash);
+	fclose(f);
+	free(newname);
+	return ok;
+}
+
+/* Check the events are well formed, so replaying them can't fail */
+static bool events_are_valid(struct reader *rd)
+{
+	int depth = 0;
+
+	for (;;) {
+		switch (rd_u8(rd)) {
+		case EV_TOKEN:
+			rd_u32(rd);
+			switch (rd_u8(rd)) {
+			case CACHE_VAL_NONE:
+				break;
+			case CACHE_VAL_STRING:
+				if (!rd_str(rd))
+					return false;
+				break;
+			case CACHE_VAL_DATA:
+				rd_bytes(rd, NULL);
+				break;
+			case CACHE_VAL_INTEGER:
+				rd_u64(rd);
+				break;
+			default:
+				return false;
+			}
+			rd_get(rd, 4 * sizeof(uint32_t));
+			break;
+
+		case EV_LINE:
+			if (!rd_str(rd))
+				return false;
+			rd_u32(rd);
+			break;
+
+		case EV_PUSH:
+			if (!rd_str(rd))
+				return false;
+			depth++;
+			break;
+
+		case EV_POP:
+			if (!depth--)
+				return false;
+			break;
+
+		case EV_END:
+			return !rd->bad && !depth && (rd->pos == rd->len);
+
+		default:
+			return false;
+		}
+
+		if (rd->bad)
+			return false;
+	}
+}
+
+static struct replay *load_entry(const char *fullname, uint64_t hash,
+				 int startcond)
+{
+	char *name = entry_name(fullname, hash, startcond);
+	char *searchpath = search_path_string();
+	struct reader rd = { 0 };
+	struct replay *rp = NULL;
+	char *buf;
+	size_t len;
+	uint32_t i, ndeps;
+	size_t deps;
+	int endcond;
+
+	if (!load_file(name, &buf, &len))
+		goto out;
+
+	rd.buf = buf;
+	rd.len = len;
+
+	if ((rd_u32(&rd) != CACHE_MAGIC) || (rd_u32(&rd) != CACHE_FORMAT)
+	    || !str_matches(&rd, DTC_VERSION)
+	    || !str_matches(&rd, fullname)
+	    || (rd_u64(&rd) != hash)
+	    || ((int)rd_u32(&rd) != startcond)
+	    || !str_matches(&rd, searchpath))
+		goto bad;
+
+	endcond = rd_u32(&rd);
+	ndeps = rd_u32(&rd);
+	deps = rd.pos;
+	for (i = 0; i < ndeps; i++)
+		if (!dep_is_current(&rd))
+			goto bad;
+
+	rp = xmalloc(sizeof(*rp));
+	rp->buf = buf;
+	rp->len = len;
+	rp->pos = rd.pos;
+	rp->endcond = endcond;
+	rp->ndeps = ndeps;
+	rp->deps = deps;
+	rp->depslen = rd.pos - deps;
+	rp->depth = 0;
+
+	if (!events_are_valid(&rd)) {
+		free(rp);
+		goto bad;
+	}
+	goto out;
+
+bad:
+	free(buf);
+out:
+	free(searchpath);
+	free(name);
+	return rp;
+}
+
+bool srccache_push(const char *name, int startcond)
+{
+	struct srcfile_state *file = current_srcfile;
+	const char *dir = file->prev ? file->prev->dir : NULL;
+	struct recorder *r;
+	uint64_t hash;
+
+	if (!cache_dir)
+		return false;
+
+	record_push(file->name);
+
+	if ((file->f == stdin) || !hash_file(file->f, &hash)
+	    || fseek(file->f, 0, SEEK_SET)) {
+		/* We can't tell if this changes, so can't cache what includes it */
+		srccache_error();
+		return false;
+	}
+
+	record_dep(name, dir, file->name, hash);
+
+	replay = load_entry(file->name, hash, startcond);
+	if (replay) {
+		for (r = recorders; r; r = r->prev) {
+			buf_put(&r->deps, replay->buf + replay->deps,
+				replay->depslen);
+			r->ndeps += replay->ndeps;
+		}
+		return true;
+	}
+
+	r = xmalloc(sizeof(*r));
+	memset(r, 0, sizeof(*r));
+	r->file = file;
+	r->fullname = xstrdup(file->name);
+	r->hash = hash;
+	r->startcond = startcond;
+	r->prev = recorders;
+	recorders = r;
+	return false;
+}
+
+void srccache_pop(int endcond)
+{
+	struct recorder *r = recorders;
+
+	if (r && (r->file == current_srcfile)) {
+		if (!r->failed)
+			write_entry(r, endcond);
+		recorders = r->prev;
+		free(r->fullname);
+		free(r->deps.buf);
+		free(r->events.buf);
+		free(r);
+	}
+
+	record_pop();
+}
+
+bool srccache_replaying(void)
+{
+	return replay != NULL;
+}
+
+bool srccache_next(struct srccache_token *t, int *endcond)
+{
+	struct reader rd = { replay->buf, replay->len, replay->pos, false };
+	const char *fullname, *name;
+	int line;
+
+	for (;;) {
+		switch (rd_u8(&rd)) {
+		case EV_TOKEN:
+			t->token = rd_u32(&rd);
+			t->kind = rd_u8(&rd);
+			switch (t->kind) {
+			case CACHE_VAL_NONE:
+				break;
+			case CACHE_VAL_STRING:
+				t->str = rd_str(&rd);
+				break;
+			case CACHE_VAL_DATA:
+				t->str = rd_bytes(&rd, &t->len);
+				break;
+			case CACHE_VAL_INTEGER:
+				t->integer = rd_u64(&rd);
+				break;
+			default:
+				rd.bad = true;
+			}
+			t->pos.first_line = rd_u32(&rd);
+			t->pos.first_column = rd_u32(&rd);
+			t->pos.last_line = rd_u32(&rd);
+			t->pos.last_column = rd_u32(&rd);
+			t->pos.file = current_srcfile;
+			t->pos.next = NULL;
+			if (rd.bad)
+				break;
+			replay->pos = rd.pos;
+			return true;
+
+		case EV_LINE:
+			name = rd_str(&rd);
+			line = rd_u32(&rd);
+			if (rd.bad)
+				break;
+			srccache_line(name, line);
+			srcpos_set_line(xstrdup(name), line);
+			continue;
+
+		case EV_PUSH:
+			fullname = rd_str(&rd);
+			if (rd.bad)
+				break;
+			srcfile_push_cached(fullname);
+			record_push(fullname);
+			replay->depth++;
+			continue;
+
+		case EV_POP:
+			if (!replay->depth--) {
+				rd.bad = true;
+				break;
+			}
+			record_pop();
+			srcfile_pop();
+			continue;
+
+		case EV_END:
+			if (replay->depth)
+				rd.bad = true;
+			break;
+
+		default:
+			rd.bad = true;
+		}
+		break;
+	}
+
+	/* Entries are checked when loaded, so this can't happen */
+	assert(!rd.bad);
+
+	*endcond = replay->endcond;
+	free(replay->buf);
+	free(replay);
+	replay = NULL;
+	return false;
+}
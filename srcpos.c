@@ -8,6 +8,10 @@
 #endif
 
 #include <stdio.h>
+#include <dirent.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "dtc.h"
 #include "srcpos.h"
@@ -108,6 +112,93 @@ static bool is_absolute_path(const char *path)
 #endif
 }
 
+/*
+ * Listings of the directories files have been looked for in, read the
+ * first time each is needed and kept for the rest of the run, so that
+ * looking along the search path for a file doesn't try to open it in
+ * every directory it isn't in.  Names are compared ignoring case, so on
+ * a case insensitive file system nothing is missed; a name that only
+ * differs in case is just tried, as before.
+ */
+struct dir_listing {
+	struct dir_listing *next;
+	char *dirname;
+	bool complete;		/* false if it couldn't be read */
+	char **names;		/* sorted */
+	int n;
+};
+
+static struct dir_listing *dir_listings;
+
+static int cmp_dirent_name(const void *a, const void *b)
+{
+	return strcasecmp(*(char * const *)a, *(char * const *)b);
+}
+
+static struct dir_listing *get_dir_listing(const char *dirname)
+{
+	struct dir_listing *l;
+	struct dirent *de;
+	int size = 0;
+	DIR *d;
+
+	for (l = dir_listings; l; l = l->next)
+		if (streq(l->dirname, dirname))
+			return l;
+
+	l = xmalloc(sizeof(*l));
+	memset(l, 0, sizeof(*l));
+	l->dirname = xstrdup(dirname);
+	l->next = dir_listings;
+	dir_listings = l;
+
+	d = opendir(dirname);
+	if (!d) {
+		/* A directory that isn't there has nothing in it */
+		l->complete = (errno == ENOENT) || (errno == ENOTDIR);
+		return l;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (l->n == size) {
+			size = size ? 2 * size : 64;
+			l->names = xrealloc(l->names, size * sizeof(*l->names));
+		}
+		l->names[l->n++] = xstrdup(de->d_name);
+	}
+	closedir(d);
+
+	qsort(l->names, l->n, sizeof(*l->names), cmp_dirent_name);
+	l->complete = true;
+	return l;
+}
+
+/* Returns false if fullname certainly doesn't exist */
+static bool may_exist(const char *fullname)
+{
+	const char *slash = strrchr(fullname, '/');
+	const char *base = slash ? slash + 1 : fullname;
+	struct dir_listing *l;
+	char *dir;
+
+	if (!*base)
+		return true;
+
+	if (!slash)
+		dir = xstrdup(".");
+	else if (slash == fullname)
+		dir = xstrdup("/");
+	else
+		dir = xstrndup(fullname, slash - fullname);
+
+	l = get_dir_listing(dir);
+	free(dir);
+
+	return !l->complete
+		|| bsearch(&base, l->names, l->n, sizeof(*l->names),
+			   cmp_dirent_name);
+}
+
 /**
  * Try to open a file in a given directory.
  *
@@ -128,7 +219,12 @@ static char *try_open(const char *dirname, const char *fname, FILE **fp)
 	else
 		fullname = join_path(dirname, fname);
 
-	*fp = fopen(fullname, "rb");
+	if (!may_exist(fullname)) {
+		errno = ENOENT;
+		*fp = NULL;
+	} else {
+		*fp = fopen(fullname, "rb");
+	}
 	if (!*fp) {
 		free(fullname);
 		fullname = NULL;
@@ -142,20 +238,19 @@ static char *try_open(const char *dirname, const char *fname, FILE **fp)
  *
  * If it is a relative filename, we search the full search path for it.
  *
+ * @param cur_dir	Directory to look in first, or NULL for none
  * @param fname	Filename to open
  * @param fp	Returns pointer to opened FILE, or NULL on failure
  * @return pointer to allocated filename, which caller must free
  */
-static char *fopen_any_on_path(const char *fname, FILE **fp)
+static char *fopen_any_on_path(const char *cur_dir, const char *fname,
+			       FILE **fp)
 {
-	const char *cur_dir = NULL;
 	struct search_path *node;
 	char *fullname;
 
 	/* Try current directory first */
 	assert(fp);
-	if (current_srcfile)
-		cur_dir = current_srcfile->dir;
 	fullname = try_open(cur_dir, fname, fp);
 
 	/* Failing that, try each search path in turn */
@@ -174,7 +269,9 @@ FILE *srcfile_relative_open(const char *fname, char **fullnamep)
 		f = stdin;
 		fullname = xstrdup("<stdin>");
 	} else {
-		fullname = fopen_any_on_path(fname, &f);
+		fullname = fopen_any_on_path(current_srcfile ?
+					     current_srcfile->dir : NULL,
+					     fname, &f);
 		if (!f)
 			die("Couldn't open \"%s\": %s\n", fname,
 			    strerror(errno));
@@ -193,6 +290,14 @@ FILE *srcfile_relative_open(const char *fname, char **fullnamep)
 	return f;
 }
 
+FILE *srcfile_open_from(const char *dir, const char *fname, char **fullnamep)
+{
+	FILE *f;
+
+	*fullnamep = fopen_any_on_path(dir, fname, &f);
+	return f;
+}
+
 void srcfile_push(const char *fname)
 {
 	struct srcfile_state *srcfile;
@@ -208,6 +313,12 @@ void srcfile_push(const char *fname)
 
 	srcfile->lineno = 1;
 	srcfile->colno = 1;
+	srcfile->shortname = NULL;
+	srcfile->shortname_of = NULL;
+	srcfile->map = NULL;
+	srcfile->maplen = 0;
+	srcfile->text = NULL;
+	srcfile->textlen = 0;
 
 	current_srcfile = srcfile;
 
@@ -215,6 +326,37 @@ void srcfile_push(const char *fname)
 		set_initial_path(srcfile->name);
 }
 
+void srcfile_push_cached(const char *fullname)
+{
+	struct srcfile_state *srcfile;
+
+	if (srcfile_depth++ >= MAX_SRCFILE_DEPTH)
+		die("Includes nested too deeply");
+
+	if (depfile) {
+		fputc(' ', depfile);
+		fprint_path_escaped(depfile, fullname);
+	}
+
+	srcfile = xmalloc(sizeof(*srcfile));
+
+	srcfile->f = NULL;
+	srcfile->name = xstrdup(fullname);
+	srcfile->dir = get_dirname(srcfile->name);
+	srcfile->prev = current_srcfile;
+
+	srcfile->lineno = 1;
+	srcfile->colno = 1;
+	srcfile->shortname = NULL;
+	srcfile->shortname_of = NULL;
+	srcfile->map = NULL;
+	srcfile->maplen = 0;
+	srcfile->text = NULL;
+	srcfile->textlen = 0;
+
+	current_srcfile = srcfile;
+}
+
 bool srcfile_pop(void)
 {
 	struct srcfile_state *srcfile = current_srcfile;
@@ -223,9 +365,12 @@ bool srcfile_pop(void)
 
 	current_srcfile = srcfile->prev;
 
-	if (fclose(srcfile->f))
+	if (srcfile->f && fclose(srcfile->f))
 		die("Error closing \"%s\": %s\n", srcfile->name,
 		    strerror(errno));
+	if (srcfile->map)
+		munmap(srcfile->map, srcfile->maplen);
+	free(srcfile->text);
 
 	/* FIXME: We allow the srcfile_state structure to leak,
 	 * because it could still be referenced from a location
@@ -236,6 +381,63 @@ bool srcfile_pop(void)
 	return current_srcfile ? true : false;
 }
 
+char *srcfile_map(size_t *len)
+{
+	struct srcfile_state *srcfile = current_srcfile;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	size_t maplen;
+	void *p;
+	int fd;
+
+	if (srcfile->text) {
+		*len = srcfile->textlen;
+		return srcfile->text;
+	}
+
+	fd = srcfile->f ? fileno(srcfile->f) : -1;
+	if ((fd < 0) || (fstat(fd, &st) != 0) || !S_ISREG(st.st_mode)
+	    || (st.st_size == 0) || (ftell(srcfile->f) != 0))
+		return NULL;
+
+	/*
+	 * Reserve room for the file and the NULs after it, then map the
+	 * file over the start.  The rest of its last page reads as zeroes,
+	 * as do the anonymous pages after it.
+	 */
+	maplen = (st.st_size + 2 + pagesize - 1) / pagesize * pagesize;
+	p = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	if (mmap(p, st.st_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(p, maplen);
+		return NULL;
+	}
+
+	srcfile->map = p;
+	srcfile->maplen = maplen;
+	*len = st.st_size;
+	return p;
+}
+
+void srcfile_set_text(char *text, size_t len)
+{
+	current_srcfile->text = text;
+	current_srcfile->textlen = len;
+}
+
+const char *srcfile_search_path(int i)
+{
+	struct search_path *node;
+
+	for (node = search_path_head; node && i; node = node->next)
+		i--;
+	return node ? node->dirname : NULL;
+}
+
 void srcfile_add_search_path(const char *dirname)
 {
 	struct search_path *node;
@@ -343,10 +545,34 @@ srcpos_string(struct srcpos *pos)
 	return pos_str;
 }
 
+/*
+ * The file name to give for pos in an annotation.  Shortening it to a path
+ * relative to the initial file is done once per file name, rather than
+ * once per annotation.
+ */
+const char *srcpos_filename(struct srcpos *pos, int level)
+{
+	struct srcfile_state *file = pos->file;
+
+	if (!file)
+		return "<no-file>";
+	if (!file->name)
+		return "<no-filename>";
+	if (level > 1)
+		return file->name;
+
+	if (file->shortname_of != file->name) {
+		free(file->shortname);
+		file->shortname = shorten_to_initial_path(file->name);
+		file->shortname_of = file->name;
+	}
+	return file->shortname ? : file->name;
+}
+
 static char *
 srcpos_string_comment(struct srcpos *pos, bool first_line, int level)
 {
-	char *pos_str, *fresh_fname = NULL, *first, *rest;
+	char *pos_str, *first, *rest;
 	const char *fname;
 
 	if (!pos) {
@@ -358,19 +584,7 @@ srcpos_string_comment(struct srcpos *pos, bool first_line, int level)
 		}
 	}
 
-	if (!pos->file)
-		fname = "<no-file>";
-	else if (!pos->file->name)
-		fname = "<no-filename>";
-	else if (level > 1)
-		fname = pos->file->name;
-	else {
-		fresh_fname = shorten_to_initial_path(pos->file->name);
-		if (fresh_fname)
-			fname = fresh_fname;
-		else
-			fname = pos->file->name;
-	}
+	fname = srcpos_filename(pos, level);
 
 	if (level > 1)
 		xasprintf(&first, "%s:%d:%d-%d:%d", fname,
@@ -380,9 +594,6 @@ srcpos_string_comment(struct srcpos *pos, bool first_line, int level)
 		xasprintf(&first, "%s:%d", fname,
 			  first_line ? pos->first_line : pos->last_line);
 
-	if (fresh_fname)
-		free(fresh_fname);
-
 	if (pos->next != NULL) {
 		rest = srcpos_string_comment(pos->next, first_line, level);
 		xasprintf(&pos_str, "%s, %s", first, rest);
@@ -8,6 +8,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "util.h"
 
 struct srcfile_state {
@@ -16,6 +17,18 @@ struct srcfile_state {
 	char *dir;
 	int lineno, colno;
 	struct srcfile_state *prev;
+
+	/* name relative to the initial file, if made for the current name */
+	char *shortname;
+	const char *shortname_of;
+
+	/* the file mapped for the lexer, if it is */
+	char *map;
+	size_t maplen;
+
+	/* text the lexer scans instead of the file, from srcfile_set_text() */
+	char *text;
+	size_t textlen;
 };
 
 extern FILE *depfile; /* = NULL */
@@ -42,9 +55,55 @@ extern struct srcfile_state *current_srcfile; /* = NULL */
  */
 FILE *srcfile_relative_open(const char *fname, char **fullnamep);
 
+/**
+ * Open a source file, searching as srcfile_relative_open() would from dir
+ *
+ * Unlike srcfile_relative_open(), this returns NULL if the file can't be
+ * found, and doesn't add the file to the dependency list.
+ *
+ * @param dir		Directory to look in first, or NULL for none
+ * @param fname		Filename to search
+ * @param fullnamep	Set to the allocated filename of the file that was
+ *			opened, or NULL
+ * @return pointer to opened FILE, or NULL
+ */
+FILE *srcfile_open_from(const char *dir, const char *fname, char **fullnamep);
+
 void srcfile_push(const char *fname);
+
+/**
+ * Enter a source file whose tokens come from the include cache
+ *
+ * The file is not opened, but otherwise this is as srcfile_push().
+ *
+ * @param fullname	Filename, as found by srcfile_relative_open()
+ */
+void srcfile_push_cached(const char *fullname);
 bool srcfile_pop(void);
 
+/**
+ * Map the current source file for the lexer to scan in place
+ *
+ * The mapping is private and writable, and the file's contents are
+ * followed by two NULs, as flex's yy_scan_buffer() needs.  It is unmapped
+ * when the file is popped.
+ *
+ * @param len		Returns the length of the file
+ * @return the mapped file, or NULL if it can't be mapped (e.g. a pipe)
+ */
+char *srcfile_map(size_t *len);
+
+/**
+ * Have the lexer scan text instead of the current source file's contents
+ *
+ * This is for the output of the built-in preprocessor.  srcfile_map()
+ * returns the text from then on, and it is freed when the file is popped.
+ *
+ * @param text		The text, which must be followed by two NULs
+ * @param len		Length of the text, not counting the NULs
+ */
+void srcfile_set_text(char *text, size_t len);
+
 /**
  * Add a new directory to the search path for input files
  *
@@ -54,6 +113,14 @@ bool srcfile_pop(void);
  */
 void srcfile_add_search_path(const char *dirname);
 
+/**
+ * Get an entry from the search path for input files
+ *
+ * @param i		Index into the search path
+ * @return directory name, or NULL if there are fewer than i + 1 entries
+ */
+const char *srcfile_search_path(int i);
+
 struct srcpos {
     int first_line;
     int first_column;
@@ -90,6 +157,7 @@ extern struct srcpos *srcpos_extend(struct srcpos *new_srcpos,
 				    struct srcpos *old_srcpos);
 extern void srcpos_free(struct srcpos *pos);
 extern char *srcpos_string(struct srcpos *pos);
+extern const char *srcpos_filename(struct srcpos *pos, int level);
 extern char *srcpos_string_first(struct srcpos *pos, int level);
 extern char *srcpos_string_last(struct srcpos *pos, int level);
 
@@ -101,4 +169,32 @@ extern void PRINTF(3, 4) srcpos_error(struct srcpos *pos, const char *prefix,
 
 extern void srcpos_set_line(char *f, int l);
 
+/* Include cache, in srccache.c */
+struct srccache_token {
+	int token;
+	enum {
+		CACHE_VAL_NONE = 0,
+		CACHE_VAL_STRING,
+		CACHE_VAL_DATA,
+		CACHE_VAL_INTEGER,
+	} kind;
+	const char *str;	/* STRING and DATA */
+	uint32_t len;		/* DATA */
+	uint64_t integer;	/* INTEGER */
+	struct srcpos pos;
+};
+
+void srccache_init(const char *dir);
+bool srccache_push(const char *name, int startcond);
+void srccache_pop(int endcond);
+void srccache_token(const struct srccache_token *t);
+void srccache_line(const char *name, int line);
+void srccache_error(void);
+bool srccache_replaying(void);
+bool srccache_next(struct srccache_token *t, int *endcond);
+
+/* Built-in preprocessor, in preproc.c */
+void preproc_define(const char *def);
+void preproc_srcfile(void);
+
 #endif /* SRCPOS_H */
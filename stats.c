@@ -0,0 +1,264 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Phase timing and tree statistics, reported with -P/--profile.
+ */
+
+#include <time.h>
+#include <sys/resource.h>
+
+#include "dtc.h"
+
+struct stats_phase {
+	const char *cat;
+	const char *name;
+	int thread;		/* 0 for the main thread, else a -j worker */
+	uint64_t start, end;	/* microseconds since stats_init() */
+	long maxrss;		/* peak resident size at the end, KiB */
+};
+
+static struct stats_phase *phases;
+static int num_phases, max_phases;
+static uint64_t epoch;
+
+bool stats_enabled;
+
+static uint64_t monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_init(void)
+{
+	stats_enabled = true;
+	epoch = monotonic_us();
+}
+
+uint64_t stats_now(void)
+{
+	return monotonic_us() - epoch;
+}
+
+long stats_maxrss(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return -1;
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1024;	/* bytes on Darwin */
+#else
+	return ru.ru_maxrss;
+#endif
+}
+
+void stats_add(const char *cat, const char *name, int thread,
+	       uint64_t start, uint64_t end, long maxrss)
+{
+	struct stats_phase *p;
+
+	if (num_phases == max_phases) {
+		max_phases = max_phases ? 2 * max_phases : 64;
+		phases = xrealloc(phases, max_phases * sizeof(*phases));
+	}
+
+	p = &phases[num_phases++];
+	p->cat = cat;
+	p->name = name;
+	p->thread = thread;
+	p->start = start;
+	p->end = end;
+	p->maxrss = maxrss;
+}
+
+int stats_begin(const char *cat, const char *name)
+{
+	if (!stats_enabled)
+		return -1;
+
+	stats_add(cat, name, 0, stats_now(), 0, 0);
+	return num_phases - 1;
+}
+
+void stats_end(int phase)
+{
+	if (phase < 0)
+		return;
+
+	phases[phase].end = stats_now();
+	phases[phase].maxrss = stats_maxrss();
+}
+
+struct tree_counts {
+	unsigned int nodes, props, labels, names;
+	size_t prop_bytes;
+};
+
+static int cmp_names(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+static void count_node(struct tree_counts *tc, struct node *node,
+		       const char ***names, unsigned int *max_names)
+{
+	struct property *prop;
+	struct node *child;
+	struct label *l;
+
+	tc->nodes++;
+	for_each_label(node->labels, l)
+		tc->labels++;
+
+	for_each_property(node, prop) {
+		if (tc->props == *max_names) {
+			*max_names = *max_names ? 2 * *max_names : 256;
+			*names = xrealloc(*names, *max_names * sizeof(**names));
+		}
+		(*names)[tc->props++] = prop->name;
+		tc->prop_bytes += prop->val.len;
+		for_each_label(prop->labels, l)
+			tc->labels++;
+	}
+
+	for_each_child(node, child)
+		count_node(tc, child, names, max_names);
+}
+
+static void count_tree(struct tree_counts *tc, struct node *tree)
+{
+	const char **names = NULL;
+	unsigned int i, max_names = 0;
+
+	memset(tc, 0, sizeof(*tc));
+	count_node(tc, tree, &names, &max_names);
+
+	/* Distinct property names, i.e. entries in the dtb strings block */
+	qsort(names, tc->props, sizeof(*names), cmp_names);
+	for (i = 0; i < tc->props; i++)
+		if ((i == 0) || !streq(names[i], names[i - 1]))
+			tc->names++;
+	free(names);
+}
+
+static void report_text(FILE *f, struct tree_counts *tc)
+{
+	int i;
+
+	fprintf(f, "nodes:              %u\n", tc->nodes);
+	fprintf(f, "properties:         %u\n", tc->props);
+	fprintf(f, "property names:     %u\n", tc->names);
+	fprintf(f, "labels:             %u\n", tc->labels);
+	fprintf(f, "property bytes:     %zu\n", tc->prop_bytes);
+	fprintf(f, "\n%-48s %12s %12s\n", "phase", "time (ms)", "maxrss (KiB)");
+	for (i = 0; i < num_phases; i++) {
+		struct stats_phase *p = &phases[i];
+		char *name;
+
+		xasprintf(&name, "%s:%s", p->cat, p->name);
+		fprintf(f, "%-48s %12.3f %12ld\n", name,
+			(p->end - p->start) / 1000.0, p->maxrss);
+		free(name);
+	}
+}
+
+/* Writes s as a JSON string, quoted and escaped */
+static void fprint_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if ((c == '"') || (c == '\\'))
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static void report_json(FILE *f, struct tree_counts *tc)
+{
+	int i;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"nodes\": %u,\n", tc->nodes);
+	fprintf(f, "  \"properties\": %u,\n", tc->props);
+	fprintf(f, "  \"property_names\": %u,\n", tc->names);
+	fprintf(f, "  \"labels\": %u,\n", tc->labels);
+	fprintf(f, "  \"property_bytes\": %zu,\n", tc->prop_bytes);
+	fprintf(f, "  \"phases\": [");
+	for (i = 0; i < num_phases; i++) {
+		struct stats_phase *p = &phases[i];
+
+		fprintf(f, "%s\n    { \"category\": ", i ? "," : "");
+		fprint_json_string(f, p->cat);
+		fprintf(f, ", \"name\": ");
+		fprint_json_string(f, p->name);
+		fprintf(f, ", \"thread\": %d, \"start_us\": %" PRIu64 ", "
+			"\"duration_us\": %" PRIu64 ", \"maxrss_kib\": %ld }",
+			p->thread, p->start, p->end - p->start, p->maxrss);
+	}
+	fprintf(f, "\n  ]\n}\n");
+}
+
+/*
+ * Chrome trace event format, as read by chrome://tracing and Perfetto.
+ * Each thread gets its own track, so that checks which overlapped under
+ * -j are drawn side by side.
+ */
+static void report_trace(FILE *f, struct tree_counts *tc)
+{
+	int i;
+
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(f, "{\"name\": \"tree\", \"ph\": \"C\", \"ts\": 0, "
+		"\"pid\": 1, \"tid\": 1, \"args\": {\"nodes\": %u, "
+		"\"properties\": %u, \"property_names\": %u, \"labels\": %u, "
+		"\"property_bytes\": %zu}}",
+		tc->nodes, tc->props, tc->names, tc->labels, tc->prop_bytes);
+	for (i = 0; i < num_phases; i++) {
+		struct stats_phase *p = &phases[i];
+
+		fprintf(f, ",\n{\"name\": ");
+		fprint_json_string(f, p->name);
+		fprintf(f, ", \"cat\": ");
+		fprint_json_string(f, p->cat);
+		fprintf(f, ", \"ph\": \"X\", \"ts\": %" PRIu64 ", "
+			"\"dur\": %" PRIu64 ", \"pid\": 1, \"tid\": %d, "
+			"\"args\": {\"maxrss_kib\": %ld}}",
+			p->start, p->end - p->start, p->thread + 1, p->maxrss);
+	}
+	fprintf(f, "\n]}\n");
+}
+
+void stats_report(const char *format, const char *fname, struct dt_info *dti)
+{
+	struct tree_counts tc;
+	FILE *f = stderr;
+
+	count_tree(&tc, dti->dt);
+
+	if (fname) {
+		f = fopen(fname, "w");
+		if (!f)
+			die("Couldn't open statistics file %s: %s\n", fname,
+			    strerror(errno));
+	}
+
+	if (streq(format, "text"))
+		report_text(f, &tc);
+	else if (streq(format, "json"))
+		report_json(f, &tc);
+	else if (streq(format, "trace"))
+		report_trace(f, &tc);
+	else
+		die("Unknown statistics format \"%s\"\n", format);
+
+	if (fname)
+		fclose(f);
+}
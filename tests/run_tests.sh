@@ -209,6 +209,14 @@ asm_to_so_test () {
     run_wrap_test asm_to_so "$@"
 }
 
+c_to_so () {
+    $CC -shared -fPIC -o $1.test.so $1.test.c
+}
+
+c_to_so_test () {
+    run_wrap_test c_to_so "$@"
+}
+
 run_fdtget_test () {
     expect="$1"
     shift
@@ -299,6 +307,10 @@ dtc_overlay_tests () {
     run_test check_path overlay_base.test.dtb not-exists "/__fixups__"
     run_test check_path overlay_base.test.dtb not-exists "/__local_fixups__"
 
+    # With the symbols sorted by label
+    run_dtc_test -@ -@ -I dts -O dtb -o overlay_base_sorted_symbols.test.dtb "$SRCDIR/overlay_base.dts"
+    run_fdtget_test "subtest\nsubtest_with_long_path\ntest" -p overlay_base_sorted_symbols.test.dtb /__symbols__
+
     # With syntactic sugar
     run_dtc_test -I dts -O dtb -o overlay_overlay.test.dtb "$SRCDIR/overlay_overlay.dts"
     run_test check_path overlay_overlay.test.dtb not-exists "/__symbols__"
@@ -334,6 +346,7 @@ dtc_overlay_tests () {
     # Check we can actually apply the result
     run_dtc_test -I dts -O dtb -o overlay_base_no_symbols.test.dtb "$SRCDIR/overlay_base.dts"
     run_test overlay overlay_base.test.dtb overlay_overlay.test.dtb
+    run_test overlay overlay_base_sorted_symbols.test.dtb overlay_overlay.test.dtb
     run_test overlay overlay_base_no_symbols.test.dtb overlay_overlay_bypath.test.dtb
 
     # test plugin source to dtb and back
@@ -532,6 +545,8 @@ libfdt_tests () {
     run_dtc_test -I fs -O dts -o fs.test_tree1.test.dts $FSBASE/test_tree1
     run_dtc_test -I fs -O dtb -o fs.test_tree1.test.dtb $FSBASE/test_tree1
     run_test dtbs_equal_unordered -m fs.test_tree1.test.dtb test_tree1.dtb
+    run_dtc_test -j 4 -I fs -O dtb -o fs.test_tree1.j4.test.dtb $FSBASE/test_tree1
+    run_wrap_test cmp fs.test_tree1.test.dtb fs.test_tree1.j4.test.dtb
     run_test get_next_tag_invalid_prop_len
 
     ## https://github.com/dgibson/dtc/issues/64
@@ -572,6 +587,11 @@ dtc_tests () {
     run_dtc_test -I dts -O dtb -o dtc_sized_cells.test.dtb "$SRCDIR/sized_cells.dts"
     run_test sized_cells dtc_sized_cells.test.dtb
 
+    # Runs of plain cells are lexed as one token
+    run_dtc_test -I dts -O dtb -o cells_runs.test.dtb "$SRCDIR/cells_runs.dts"
+    run_dtc_test -I dts -O dtb -o cells_runs_split.test.dtb "$SRCDIR/cells_runs_split.dts"
+    run_wrap_test cmp cells_runs.test.dtb cells_runs_split.test.dtb
+
     run_dtc_test -I dts -O dtb -o dtc_extra-terminating-null.test.dtb "$SRCDIR/extra-terminating-null.dts"
     run_test extra-terminating-null dtc_extra-terminating-null.test.dtb
 
@@ -643,6 +663,25 @@ dtc_tests () {
 	run_test value-labels ./oasm_value-labels.dts.test.so
     fi
 
+    # Check several outputs from one run
+    run_dtc_test -O dtb:multi.test.dtb -O asm:multi.test.s -O dts:multi.test.dts "$SRCDIR/value-labels.dts"
+    run_dtc_test -O asm -o single.test.s "$SRCDIR/value-labels.dts"
+    run_dtc_test -O dts -o single.test.dts "$SRCDIR/value-labels.dts"
+    run_wrap_test cmp multi.test.dtb value-labels.dts.test.dtb
+    run_wrap_test cmp multi.test.s single.test.s
+    run_wrap_test cmp multi.test.dts single.test.dts
+
+    # Check -Oc mode
+    for tree in test_tree1.dts escapes.dts references.dts incbin.dts \
+	value-labels.dts ; do
+	run_dtc_test -I dts -O c -o oc_$tree.test.c "$SRCDIR/$tree"
+	c_to_so_test oc_$tree
+	if [ -x ./asm_tree_dump ]; then
+	    run_test asm_tree_dump ./oc_$tree.test.so oc_$tree.test.dtb
+	    run_wrap_test cmp oc_$tree.test.dtb $tree.test.dtb
+	fi
+    done
+
     # Check -Odts mode preserve all dtb information
     for tree in test_tree1.dtb dtc_tree1.test.dtb dtc_escapes.test.dtb \
 	dtc_extra-terminating-null.test.dtb dtc_references.test.dtb; do
@@ -804,6 +843,26 @@ dtc_tests () {
     run_sh_test "$SRCDIR/dtc-fails.sh" -n test-negation-4.test.dtb -Esize_cells_is_cell -Eno_size_cells_is_cell -I dts -O dtb "$SRCDIR/bad-ncells.dts"
     run_sh_test "$SRCDIR/dtc-checkfails.sh" size_cells_is_cell -- -Esize_cells_is_cell -Eno_size_cells_is_cell -I dts -O dtb "$SRCDIR/bad-ncells.dts"
 
+    # Check that running checks on several threads gives the same results
+    run_dtc_test -j 4 -I dts -O dtb -o jobs_dtc_tree1.test.dtb "$SRCDIR/test_tree1.dts"
+    run_wrap_test cmp jobs_dtc_tree1.test.dtb dtc_tree1.test.dtb
+    run_sh_test "$SRCDIR/dtc-checkfails.sh" address_cells_is_cell interrupts_extended_is_cell size_cells_is_cell -- -j 4 -I dts -O dtb "$SRCDIR/bad-ncells.dts"
+    run_sh_test "$SRCDIR/dtc-checkfails.sh" phandle_references -- -j 4 -I dts -O dtb "$SRCDIR/nonexist-node-ref.dts"
+    run_wrap_error_test $DTC -j 0 -I dts -O dtb -o jobs_0.test.dtb "$SRCDIR/test_tree1.dts"
+    run_wrap_error_test $DTC -j -1 -I dts -O dtb -o jobs_0.test.dtb "$SRCDIR/test_tree1.dts"
+    run_wrap_error_test $DTC -j 4x -I dts -O dtb -o jobs_0.test.dtb "$SRCDIR/test_tree1.dts"
+    run_dtc_test -j 1000000 -I dts -O dtb -o jobs_many.test.dtb "$SRCDIR/test_tree1.dts"
+    run_wrap_test cmp jobs_many.test.dtb jobs_dtc_tree1.test.dtb
+
+    # Check phase statistics reporting
+    run_dtc_test -P text -I dts -O dtb -o stats_tree1.test.dtb "$SRCDIR/test_tree1.dts"
+    run_wrap_test cmp stats_tree1.test.dtb dtc_tree1.test.dtb
+    run_dtc_test -P json:stats_tree1.test.json -I dts -O dtb -o stats_tree1.test.dtb "$SRCDIR/test_tree1.dts"
+    run_wrap_test grep -q '"phases"' stats_tree1.test.json
+    run_dtc_test -P trace:stats_tree1.test.trace -j 2 -I dts -O dtb -o stats_tree1.test.dtb "$SRCDIR/test_tree1.dts"
+    run_wrap_test grep -q '"traceEvents"' stats_tree1.test.trace
+    run_wrap_error_test $DTC -P xml -I dts -O dtb -o stats_tree1.test.dtb "$SRCDIR/test_tree1.dts"
+
     # Check for proper behaviour reading from stdin
     run_dtc_test -I dts -O dtb -o stdin_dtc_tree1.test.dtb - < "$SRCDIR/test_tree1.dts"
     run_wrap_test cmp stdin_dtc_tree1.test.dtb dtc_tree1.test.dtb
@@ -836,6 +895,48 @@ dtc_tests () {
     run_dtc_test -I dts -O dtb -o search_paths_subdir.dtb \
 	"$SRCDIR/search_dir_b/search_paths_subdir.dts"
 
+    # Include cache: the second run of each replays the cached includes
+    rm -rf include_cache
+    for i in 1 2; do
+	run_dtc_test -C include_cache -I dts -O dtb -o include_cache.test.dtb "$SRCDIR/include0.dts"
+	run_wrap_test cmp include_cache.test.dtb includes.test.dtb
+	run_dtc_test -C include_cache -i "$SRCDIR/search_dir" -I dts -O dtb \
+	    -o include_cache_search.test.dtb "$SRCDIR/search_paths.dts"
+	run_wrap_test cmp include_cache_search.test.dtb search_paths.dtb
+	run_dtc_test -C include_cache -I dts -O dtb -o dependencies.test.dtb \
+	    -d include_cache.test.d "$SRCDIR/dependencies.dts"
+	sed -i.bak "s,$SRCDIR/,,g" include_cache.test.d
+	run_wrap_test cmp include_cache.test.d "$SRCDIR/dependencies.cmp"
+    done
+
+    # Built-in preprocessor
+    run_dtc_test -I dts -O dtb -o preproc_plain.test.dtb "$SRCDIR/preproc_plain.dts"
+    run_dtc_test --cpp -i "$SRCDIR/search_dir" -I dts -O dtb \
+	-o preproc.test.dtb "$SRCDIR/preproc.dts"
+    run_wrap_test cmp preproc.test.dtb preproc_plain.test.dtb
+    run_dtc_test --cpp -i "$SRCDIR/search_dir" -D BASE=0x2000 -D EXTRA -I dts -O dts \
+	-o preproc_defs.test.dts "$SRCDIR/preproc.dts"
+    run_wrap_test grep -q 'extra = "EXTRA"' preproc_defs.test.dts
+    run_wrap_error_test $DTC --cpp -I dts -O dtb "$SRCDIR/preproc.dts"
+
+    # Batch compilation
+    printf '%s\n' "# batch test" "-o batch_tree1.test.dtb $SRCDIR/test_tree1.dts" \
+	"-I dts -o batch_includes.test.dtb $SRCDIR/include0.dts" > tmp.batch
+    run_dtc_test -j 2 -B tmp.batch
+    run_wrap_test cmp batch_tree1.test.dtb dtc_tree1.test.dtb
+    run_wrap_test cmp batch_includes.test.dtb includes.test.dtb
+    echo "-o batch_bad.test.dtb $SRCDIR/nonexist-node-ref.dts" >> tmp.batch
+    run_wrap_error_test $DTC -j 2 -B tmp.batch
+    run_wrap_error_test $DTC -B tmp.batch "$SRCDIR/test_tree1.dts"
+
+    # Unchecked dtb to dtb copies, which don't build a tree
+    for opts in "" "-s" "-S 4096 -R 2" "-p 100 -a 64 -b 7" "-V 16 -s"; do
+	run_dtc_test $opts -I dtb -O dtb -o copy_tree.test.dtb test_tree1.dtb
+	run_dtc_test -N $opts -I dtb -O dtb -o copy_tree_fast.test.dtb test_tree1.dtb
+	run_wrap_test cmp copy_tree.test.dtb copy_tree_fast.test.dtb
+    done
+    run_wrap_error_test $DTC -N -I dts -O dtb "$SRCDIR/test_tree1.dts"
+
     # Check -a option
     for align in 2 4 8 16 32 64; do
 	# -p -a
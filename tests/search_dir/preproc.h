@@ -0,0 +1,11 @@
+#ifndef PREPROC_H
+#define PREPROC_H
+
+#define GPIO_ACTIVE_HIGH	0
+#define GPIO_ACTIVE_LOW		1
+
+#define CELLS(n, flags)	<0 (n) (flags)>
+#define REG(addr, size)		<(addr) (size)>
+#define NODE(name, addr)	name@addr
+
+#endif /* PREPROC_H */
@@ -19,6 +19,8 @@ struct dt_info *dt_from_source(const char *fname)
 	treesource_error = false;
 
 	srcfile_push(fname);
+	if (preprocess)
+		preproc_srcfile();
 	yyin = current_srcfile->f;
 	yylloc.file = current_srcfile;
 
@@ -31,12 +33,105 @@ struct dt_info *dt_from_source(const char *fname)
 	return parser_output;
 }
 
-static void write_prefix(FILE *f, int level)
+/*
+ * The dts is written through a single buffer, with the numbers formatted
+ * by hand rather than by printf(), which otherwise dominates the time
+ * taken to write out a large tree.
+ */
+static struct {
+	FILE *f;
+	size_t len;
+	char buf[65536];
+} out;
+
+static void out_write(const char *s, size_t len)
+{
+	if (fwrite(s, 1, len, out.f) != len)
+		die("Error writing device tree source: %s\n", strerror(errno));
+}
+
+static void out_flush(void)
+{
+	out_write(out.buf, out.len);
+	out.len = 0;
+}
+
+/* Makes room for len more bytes, which must fit in the buffer */
+static inline char *out_reserve(size_t len)
+{
+	if (out.len + len > sizeof(out.buf))
+		out_flush();
+	return out.buf + out.len;
+}
+
+static void out_mem(const char *s, size_t len)
+{
+	if (len > sizeof(out.buf)) {
+		out_flush();
+		out_write(s, len);
+		return;
+	}
+	memcpy(out_reserve(len), s, len);
+	out.len += len;
+}
+
+static inline void out_char(char c)
+{
+	*out_reserve(1) = c;
+	out.len++;
+}
+
+static void out_str(const char *s)
+{
+	out_mem(s, strlen(s));
+}
+
+/* As printf("%0*" PRIx64, mindigits, v) */
+static void out_hex(uint64_t v, int mindigits)
+{
+	char tmp[16], *p;
+	int n = 0;
+
+	do {
+		tmp[n++] = "0123456789abcdef"[v & 0xf];
+		v >>= 4;
+	} while (v);
+	while (n < mindigits)
+		tmp[n++] = '0';
+
+	p = out_reserve(n);
+	out.len += n;
+	while (n)
+		*p++ = tmp[--n];
+}
+
+static void out_dec(int v)
+{
+	unsigned int u = v;
+	char tmp[12], *p;
+	int n = 0;
+
+	if (v < 0) {
+		out_char('-');
+		u = -u;
+	}
+	do {
+		tmp[n++] = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+
+	p = out_reserve(n);
+	out.len += n;
+	while (n)
+		*p++ = tmp[--n];
+}
+
+static void write_prefix(int level)
 {
 	int i;
 
 	for (i = 0; i < level; i++)
-		fputc('\t', f);
+		out_char('\t');
 }
 
 static bool isstring(char c)
@@ -46,7 +141,7 @@ static bool isstring(char c)
 		|| strchr("\a\b\t\n\v\f\r", c));
 }
 
-static void write_propval_string(FILE *f, const char *s, size_t len)
+static void write_propval_string(const char *s, size_t len)
 {
 	const char *end = s + len - 1;
 
@@ -55,51 +150,60 @@ static void write_propval_string(FILE *f, const char *s, size_t len)
 
 	assert(*end == '\0');
 
-	fprintf(f, "\"");
+	out_char('"');
 	while (s < end) {
-		char c = *s++;
+		const char *run = s;
+		char c;
+
+		while ((s < end) && isprint((unsigned char)*s)
+		       && (*s != '\\') && (*s != '"'))
+			s++;
+		out_mem(run, s - run);
+		if (s == end)
+			break;
+
+		c = *s++;
 		switch (c) {
 		case '\a':
-			fprintf(f, "\\a");
+			out_str("\\a");
 			break;
 		case '\b':
-			fprintf(f, "\\b");
+			out_str("\\b");
 			break;
 		case '\t':
-			fprintf(f, "\\t");
+			out_str("\\t");
 			break;
 		case '\n':
-			fprintf(f, "\\n");
+			out_str("\\n");
 			break;
 		case '\v':
-			fprintf(f, "\\v");
+			out_str("\\v");
 			break;
 		case '\f':
-			fprintf(f, "\\f");
+			out_str("\\f");
 			break;
 		case '\r':
-			fprintf(f, "\\r");
+			out_str("\\r");
 			break;
 		case '\\':
-			fprintf(f, "\\\\");
+			out_str("\\\\");
 			break;
 		case '\"':
-			fprintf(f, "\\\"");
+			out_str("\\\"");
 			break;
 		case '\0':
-			fprintf(f, "\\0");
+			out_str("\\0");
 			break;
 		default:
-			if (isprint((unsigned char)c))
-				fprintf(f, "%c", c);
-			else
-				fprintf(f, "\\x%02"PRIx8, c);
+			/* c is promoted as it always has been by printf() */
+			out_str("\\x");
+			out_hex((unsigned int)c, 2);
 		}
 	}
-	fprintf(f, "\"");
+	out_char('"');
 }
 
-static void write_propval_int(FILE *f, const char *p, size_t len, size_t width)
+static void write_propval_int(const char *p, size_t len, size_t width)
 {
 	const char *end = p + len;
 	assert(len % width == 0);
@@ -107,20 +211,23 @@ static void write_propval_int(FILE *f, const char *p, size_t len, size_t width)
 	for (; p < end; p += width) {
 		switch (width) {
 		case 1:
-			fprintf(f, "%02"PRIx8, *(const uint8_t*)p);
+			out_hex(*(const uint8_t*)p, 2);
 			break;
 		case 2:
-			fprintf(f, "0x%02"PRIx16, dtb_ld16(p));
+			out_str("0x");
+			out_hex(dtb_ld16(p), 2);
 			break;
 		case 4:
-			fprintf(f, "0x%02"PRIx32, dtb_ld32(p));
+			out_str("0x");
+			out_hex(dtb_ld32(p), 2);
 			break;
 		case 8:
-			fprintf(f, "0x%02"PRIx64, dtb_ld64(p));
+			out_str("0x");
+			out_hex(dtb_ld64(p), 2);
 			break;
 		}
 		if (p + width < end)
-			fputc(' ', f);
+			out_char(' ');
 	}
 }
 
@@ -145,48 +252,48 @@ static const char *delim_end[] = {
  *  - for a single offset there is at most one type marker
  *  - for a single offset that has both a type marker and non-type markers, the
  *    type marker appears before the others.
+ *
+ * The new marker goes at or after index i.  Returns the index after it, or
+ * of the existing marker that made it unnecessary.
  */
-static struct marker **add_marker(struct marker **mi,
-				  enum markertype type, unsigned int offset, char *ref)
+static unsigned int add_marker(struct data *d, unsigned int i,
+			       enum markertype type, unsigned int offset, char *ref)
 {
-	struct marker *nm;
+	unsigned int first = data_marker_index(*d, offset);
 
-	while (*mi && (*mi)->offset < offset)
-		mi = &(*mi)->next;
+	if (i < first)
+		i = first;
 
-	if (*mi && (*mi)->offset == offset && is_type_marker((*mi)->type)) {
+	if (i < d->nmarkers && d->markers[i].offset == offset
+	    && is_type_marker(d->markers[i].type)) {
 		if (is_type_marker(type))
-			return mi;
-		mi = &(*mi)->next;
+			return i;
+		i++;
 	}
 
-	if (*mi && (*mi)->offset == offset && type == (*mi)->type)
-		return mi;
+	if (i < d->nmarkers && d->markers[i].offset == offset
+	    && type == d->markers[i].type)
+		return i;
 
-	nm = xmalloc(sizeof(*nm));
-	nm->type = type;
-	nm->offset = offset;
-	nm->ref = ref;
-	nm->next = *mi;
-	*mi = nm;
+	*d = data_insert_marker(*d, i, type, offset, ref);
 
-	return &nm->next;
+	return i + 1;
 }
 
 void property_add_marker(struct property *prop,
 			 enum markertype type, unsigned int offset, char *ref)
 {
-	add_marker(&prop->val.markers, type, offset, ref);
+	add_marker(&prop->val, 0, type, offset, ref);
 }
 
 static void add_string_markers(struct property *prop, unsigned int offset, int len)
 {
 	int l;
 	const char *p = prop->val.val + offset;
-	struct marker **mi = &prop->val.markers;
+	unsigned int i = 0;
 
 	for (l = strlen(p) + 1; l < len; l += strlen(p + l) + 1)
-		mi = add_marker(mi, TYPE_STRING, offset + l, NULL);
+		i = add_marker(&prop->val, i, TYPE_STRING, offset + l, NULL);
 }
 
 void add_phandle_marker(struct dt_info *dti, struct property *prop, unsigned int offset)
@@ -217,9 +324,9 @@ void add_phandle_marker(struct dt_info *dti, struct property *prop, unsigned int
 	if (refn->labels)
 		ref = refn->labels->label;
 	else
-		ref = refn->fullpath;
+		ref = xstrdup(get_node_path(refn));
 
-	add_marker(&prop->val.markers, REF_PHANDLE, offset, ref);
+	add_marker(&prop->val, 0, REF_PHANDLE, offset, ref);
 }
 
 static enum markertype guess_value_type(struct property *prop, unsigned int offset, int len)
@@ -248,190 +355,223 @@ static enum markertype guess_value_type(struct property *prop, unsigned int offs
 
 static void guess_type_markers(struct property *prop)
 {
-	struct marker **m = &prop->val.markers;
-	unsigned int offset = 0;
+	struct data *d = &prop->val;
+	unsigned int i, offset = 0;
 
-	for (m = &prop->val.markers; *m; m = &((*m)->next)) {
-		if (is_type_marker((*m)->type))
+	for (i = 0; i < d->nmarkers; i++) {
+		if (is_type_marker(d->markers[i].type))
 			/* assume the whole property is already marked */
 			return;
 
-		if ((*m)->offset > offset) {
-			m = add_marker(m, guess_value_type(prop, offset, (*m)->offset - offset),
-				       offset, NULL);
+		if (d->markers[i].offset > offset) {
+			enum markertype type = guess_value_type(prop, offset,
+					d->markers[i].offset - offset);
+
+			i = add_marker(d, i, type, offset, NULL);
 
-			offset = (*m)->offset;
+			offset = d->markers[i].offset;
 		}
 
-		if ((*m)->type == REF_PHANDLE) {
-			m = add_marker(m, TYPE_UINT32, offset, NULL);
+		if (d->markers[i].type == REF_PHANDLE) {
+			i = add_marker(d, i, TYPE_UINT32, offset, NULL);
 			offset += 4;
 		}
 	}
 
 	if (offset < prop->val.len)
-		add_marker(m, guess_value_type(prop, offset, prop->val.len - offset),
+		add_marker(d, i, guess_value_type(prop, offset, prop->val.len - offset),
 			   offset, NULL);
 }
 
-static void write_propval(FILE *f, struct property *prop)
+/*
+ * Writes the annotation comment for pos, as srcpos_string_first() or
+ * srcpos_string_last() would give it, without building the string.
+ */
+static void write_srcpos_comment(struct srcpos *pos, bool first_line)
+{
+	if (!pos) {
+		if (annotate > 1)
+			out_str(" /* <no-file>:<no-line> */");
+		return;
+	}
+
+	out_str(" /* ");
+	for (; pos; pos = pos->next) {
+		out_str(srcpos_filename(pos, annotate));
+		out_char(':');
+		if (annotate > 1) {
+			out_dec(pos->first_line);
+			out_char(':');
+			out_dec(pos->first_column);
+			out_char('-');
+			out_dec(pos->last_line);
+			out_char(':');
+			out_dec(pos->last_column);
+		} else {
+			out_dec(first_line ? pos->first_line : pos->last_line);
+		}
+		if (pos->next)
+			out_str(", ");
+	}
+	out_str(" */");
+}
+
+static void write_propval(struct property *prop)
 {
 	size_t len = prop->val.len;
 	struct marker *m;
 	enum markertype emit_type = TYPE_NONE;
-	char *srcstr;
 
 	if (len == 0) {
-		fprintf(f, ";");
-		if (annotate) {
-			srcstr = srcpos_string_first(prop->srcpos, annotate);
-			if (srcstr) {
-				fprintf(f, " /* %s */", srcstr);
-				free(srcstr);
-			}
-		}
-		fprintf(f, "\n");
+		out_char(';');
+		if (annotate)
+			write_srcpos_comment(prop->srcpos, true);
+		out_char('\n');
 		return;
 	}
 
-	fprintf(f, " =");
+	out_str(" =");
 
 	guess_type_markers(prop);
-	m = prop->val.markers;
 
-	for_each_marker(m) {
-		size_t chunk_len = (m->next ? m->next->offset : len) - m->offset;
-		size_t data_len = type_marker_length(m) ? : len - m->offset;
+	for_each_marker(prop->val, m) {
+		struct marker *next = m + 1;
+		size_t chunk_len = (next < prop->val.markers + prop->val.nmarkers ?
+				    next->offset : len) - m->offset;
+		size_t data_len = type_marker_length(prop->val, m) ? : len - m->offset;
 		const char *p = &prop->val.val[m->offset];
 		struct marker *m_phandle;
 
 		if (is_type_marker(m->type)) {
 			emit_type = m->type;
-			fprintf(f, " %s", delim_start[emit_type]);
-		} else if (m->type == LABEL)
-			fprintf(f, " %s:", m->ref);
+			out_char(' ');
+			out_str(delim_start[emit_type]);
+		} else if (m->type == LABEL) {
+			out_char(' ');
+			out_str(m->ref);
+			out_char(':');
+		}
 
 		if (emit_type == TYPE_NONE || chunk_len == 0)
 			continue;
 
 		switch(emit_type) {
 		case TYPE_UINT16:
-			write_propval_int(f, p, chunk_len, 2);
+			write_propval_int(p, chunk_len, 2);
 			break;
 		case TYPE_UINT32:
-			m_phandle = prop->val.markers;
-			for_each_marker_of_type(m_phandle, REF_PHANDLE)
-				if (m->offset == m_phandle->offset)
-					break;
-
+			m_phandle = data_find_marker(prop->val, REF_PHANDLE,
+						     m->offset);
 			if (m_phandle) {
-				if (m_phandle->ref[0] == '/')
-					fprintf(f, "&{%s}", m_phandle->ref);
-				else
-					fprintf(f, "&%s", m_phandle->ref);
+				if (m_phandle->ref[0] == '/') {
+					out_str("&{");
+					out_str(m_phandle->ref);
+					out_char('}');
+				} else {
+					out_char('&');
+					out_str(m_phandle->ref);
+				}
 				if (chunk_len > 4) {
-					fputc(' ', f);
-					write_propval_int(f, p + 4, chunk_len - 4, 4);
+					out_char(' ');
+					write_propval_int(p + 4, chunk_len - 4, 4);
 				}
 			} else {
-				write_propval_int(f, p, chunk_len, 4);
+				write_propval_int(p, chunk_len, 4);
 			}
 			if (data_len > chunk_len)
-				fputc(' ', f);
+				out_char(' ');
 			break;
 		case TYPE_UINT64:
-			write_propval_int(f, p, chunk_len, 8);
+			write_propval_int(p, chunk_len, 8);
 			break;
 		case TYPE_STRING:
-			write_propval_string(f, p, chunk_len);
+			write_propval_string(p, chunk_len);
 			break;
 		default:
-			write_propval_int(f, p, chunk_len, 1);
+			write_propval_int(p, chunk_len, 1);
 		}
 
 		if (chunk_len == data_len) {
 			size_t pos = m->offset + chunk_len;
-			fprintf(f, pos == len ? "%s" : "%s,",
-			        delim_end[emit_type] ? : "");
+
+			out_str(delim_end[emit_type] ? : "");
+			if (pos != len)
+				out_char(',');
 			emit_type = TYPE_NONE;
 		}
 	}
-	fprintf(f, ";");
-	if (annotate) {
-		srcstr = srcpos_string_first(prop->srcpos, annotate);
-		if (srcstr) {
-			fprintf(f, " /* %s */", srcstr);
-			free(srcstr);
-		}
+	out_char(';');
+	if (annotate)
+		write_srcpos_comment(prop->srcpos, true);
+	out_char('\n');
+}
+
+static void write_labels(struct label *labels)
+{
+	struct label *l;
+
+	for_each_label(labels, l) {
+		out_str(l->label);
+		out_str(": ");
 	}
-	fprintf(f, "\n");
 }
 
-static void write_tree_source_node(FILE *f, struct node *tree, int level)
+static void write_tree_source_node(struct node *tree, int level)
 {
 	struct property *prop;
 	struct node *child;
-	struct label *l;
-	char *srcstr;
 
-	write_prefix(f, level);
-	for_each_label(tree->labels, l)
-		fprintf(f, "%s: ", l->label);
+	write_prefix(level);
+	write_labels(tree->labels);
 	if (tree->name && (*tree->name))
-		fprintf(f, "%s {", tree->name);
+		out_str(tree->name);
 	else
-		fprintf(f, "/ {");
+		out_char('/');
+	out_str(" {");
 
-	if (annotate) {
-		srcstr = srcpos_string_first(tree->srcpos, annotate);
-		if (srcstr) {
-			fprintf(f, " /* %s */", srcstr);
-			free(srcstr);
-		}
-	}
-	fprintf(f, "\n");
+	if (annotate)
+		write_srcpos_comment(tree->srcpos, true);
+	out_char('\n');
 
 	for_each_property(tree, prop) {
-		write_prefix(f, level+1);
-		for_each_label(prop->labels, l)
-			fprintf(f, "%s: ", l->label);
-		fprintf(f, "%s", prop->name);
-		write_propval(f, prop);
+		write_prefix(level+1);
+		write_labels(prop->labels);
+		out_str(prop->name);
+		write_propval(prop);
 	}
 	for_each_child(tree, child) {
-		fprintf(f, "\n");
-		write_tree_source_node(f, child, level+1);
-	}
-	write_prefix(f, level);
-	fprintf(f, "};");
-	if (annotate) {
-		srcstr = srcpos_string_last(tree->srcpos, annotate);
-		if (srcstr) {
-			fprintf(f, " /* %s */", srcstr);
-			free(srcstr);
-		}
+		out_char('\n');
+		write_tree_source_node(child, level+1);
 	}
-	fprintf(f, "\n");
+	write_prefix(level);
+	out_str("};");
+	if (annotate)
+		write_srcpos_comment(tree->srcpos, false);
+	out_char('\n');
 }
 
 void dt_to_source(FILE *f, struct dt_info *dti)
 {
 	struct reserve_info *re;
 
-	fprintf(f, "/dts-v1/;\n");
+	out.f = f;
+	out.len = 0;
+
+	out_str("/dts-v1/;\n");
 	if (dti->dtsflags & DTSF_PLUGIN)
-		fprintf(f, "/plugin/;\n");
-	fprintf(f, "\n");
+		out_str("/plugin/;\n");
+	out_char('\n');
 
 	for (re = dti->reservelist; re; re = re->next) {
-		struct label *l;
-
-		for_each_label(re->labels, l)
-			fprintf(f, "%s: ", l->label);
-		fprintf(f, "/memreserve/\t0x%016llx 0x%016llx;\n",
-			(unsigned long long)re->address,
-			(unsigned long long)re->size);
+		write_labels(re->labels);
+		out_str("/memreserve/\t0x");
+		out_hex(re->address, 16);
+		out_str(" 0x");
+		out_hex(re->size, 16);
+		out_str(";\n");
 	}
 
-	write_tree_source_node(f, dti->dt, 0);
+	write_tree_source_node(dti->dt, 0);
+
+	out_flush();
 }
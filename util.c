@@ -132,6 +132,106 @@ char *join_path(const char *path, const char *name)
 	return str;
 }
 
+uint32_t fnv1a_hash(const void *mem, size_t len, uint32_t seed)
+{
+	const unsigned char *p = mem;
+	uint32_t h = seed;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+uint64_t fnv1a_hash64(const void *mem, size_t len, uint64_t seed)
+{
+	const unsigned char *p = mem;
+	uint64_t h = seed;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+/* Hashes are kept non-zero, as zero marks an unused slot */
+static inline uint32_t hashtab_hash(uint32_t hash)
+{
+	return hash ? hash : 1;
+}
+
+void *hashtab_find(const struct hashtab *t, uint32_t hash,
+		   bool (*match)(const void *slot, const void *key),
+		   const void *key)
+{
+	unsigned int i;
+
+	if (!t->size)
+		return NULL;
+
+	hash = hashtab_hash(hash);
+	for (i = hash & (t->size - 1); t->hashes[i];
+	     i = (i + 1) & (t->size - 1))
+		if ((t->hashes[i] == hash)
+		    && match(t->slots + i * t->slotsize, key))
+			return t->slots + i * t->slotsize;
+	return NULL;
+}
+
+/* Claims the first unused slot for hash, which must be non-zero */
+static unsigned int hashtab_claim(struct hashtab *t, uint32_t hash)
+{
+	unsigned int i;
+
+	for (i = hash & (t->size - 1); t->hashes[i];
+	     i = (i + 1) & (t->size - 1))
+		;
+	t->hashes[i] = hash;
+	return i;
+}
+
+void *hashtab_add(struct hashtab *t, size_t slotsize, uint32_t hash)
+{
+	char *slot;
+
+	if (2 * (t->count + 1) > t->size) {
+		struct hashtab old = *t;
+		unsigned int i, j;
+
+		t->slotsize = slotsize;
+		t->size = old.size ? 2 * old.size : 64;
+		t->hashes = xmalloc(t->size * sizeof(*t->hashes));
+		memset(t->hashes, 0, t->size * sizeof(*t->hashes));
+		t->slots = xmalloc(t->size * slotsize);
+		for (i = 0; i < old.size; i++)
+			if (old.hashes[i]) {
+				j = hashtab_claim(t, old.hashes[i]);
+				memcpy(t->slots + j * slotsize,
+				       old.slots + i * slotsize, slotsize);
+			}
+		free(old.hashes);
+		free(old.slots);
+	}
+	assert(slotsize == t->slotsize);
+
+	slot = t->slots + hashtab_claim(t, hashtab_hash(hash)) * slotsize;
+	memset(slot, 0, slotsize);
+	t->count++;
+	return slot;
+}
+
+void *hashtab_slot(const struct hashtab *t, unsigned int i)
+{
+	return t->hashes[i] ? t->slots + i * t->slotsize : NULL;
+}
+
+void hashtab_free(struct hashtab *t)
+{
+	free(t->hashes);
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+}
+
 bool util_is_printable_string(const void *data, int len)
 {
 	const char *s = data;
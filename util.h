@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <getopt.h>
 
 /*
@@ -75,6 +76,40 @@ extern int PRINTF(2, 3) xasprintf_append(char **strp, const char *fmt, ...);
 extern int PRINTF(2, 0) xavsprintf_append(char **strp, const char *fmt, va_list ap);
 extern char *join_path(const char *path, const char *name);
 
+/*
+ * FNV-1a hash of len bytes at mem, continuing from seed.  A new hash
+ * starts from FNV1A_SEED.
+ */
+#define FNV1A_SEED	2166136261u
+uint32_t fnv1a_hash(const void *mem, size_t len, uint32_t seed);
+
+/* The 64-bit FNV-1a, for keys that must not collide in practice */
+#define FNV1A64_SEED	0xcbf29ce484222325ULL
+uint64_t fnv1a_hash64(const void *mem, size_t len, uint64_t seed);
+
+/*
+ * Open addressed hash tables, grown to stay at most half full.  Each
+ * slot holds slotsize bytes for the caller, and the table keeps the hash
+ * of every slot in use, so it can grow without the keys being hashed
+ * again.  A table which is all zeroes is empty.
+ */
+struct hashtab {
+	uint32_t *hashes;	/* 0 for an unused slot */
+	char *slots;
+	size_t slotsize;
+	unsigned int size, count;	/* size is a power of 2 */
+};
+
+/* The slot with the given hash whose key matches, or NULL */
+void *hashtab_find(const struct hashtab *t, uint32_t hash,
+		   bool (*match)(const void *slot, const void *key),
+		   const void *key);
+/* A new zeroed slot, for a key with the given hash */
+void *hashtab_add(struct hashtab *t, size_t slotsize, uint32_t hash);
+/* Slot i, if it is in use, for walking the table */
+void *hashtab_slot(const struct hashtab *t, unsigned int i);
+void hashtab_free(struct hashtab *t);
+
 /**
  * Check a property of a given length to see if it is all printable and
  * has a valid terminator. The property can contain either a single string,
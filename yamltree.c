@@ -29,7 +29,7 @@ const char *yaml_error_name[] = {
 		    (emitter)->problem, __func__, __LINE__);		\
 })
 
-static void yaml_propval_int(yaml_emitter_t *emitter, struct marker *markers,
+static void yaml_propval_int(yaml_emitter_t *emitter, struct data val,
 	char *data, unsigned int seq_offset, unsigned int len, int width)
 {
 	yaml_event_t event;
@@ -52,7 +52,6 @@ static void yaml_propval_int(yaml_emitter_t *emitter, struct marker *markers,
 
 	for (off = 0; off < len; off += width) {
 		char buf[32];
-		struct marker *m;
 		bool is_phandle = false;
 
 		switch(width) {
@@ -64,14 +63,8 @@ static void yaml_propval_int(yaml_emitter_t *emitter, struct marker *markers,
 			break;
 		case 4:
 			sprintf(buf, "0x%"PRIx32, dtb_ld32(data + off));
-			m = markers;
-			is_phandle = false;
-			for_each_marker_of_type(m, REF_PHANDLE) {
-				if (m->offset == (seq_offset + off)) {
-					is_phandle = true;
-					break;
-				}
-			}
+			is_phandle = data_find_marker(val, REF_PHANDLE,
+						      seq_offset + off) != NULL;
 			break;
 		case 8:
 			sprintf(buf, "0x%"PRIx64, dtb_ld64(data + off));
@@ -114,8 +107,7 @@ static void yaml_propval(yaml_emitter_t *emitter, struct property *prop)
 {
 	yaml_event_t event;
 	unsigned int len = prop->val.len;
-	struct marker *m = prop->val.markers;
-	struct marker *markers = prop->val.markers;
+	struct marker *m;
 
 	/* Emit the property name */
 	yaml_scalar_event_initialize(&event, NULL,
@@ -133,39 +125,39 @@ static void yaml_propval(yaml_emitter_t *emitter, struct property *prop)
 		return;
 	}
 
-	if (!m)
+	if (!prop->val.nmarkers)
 		die("No markers present in property '%s' value\n", prop->name);
 
 	yaml_sequence_start_event_initialize(&event, NULL,
 		(const yaml_char_t *)YAML_SEQ_TAG, 1, YAML_FLOW_SEQUENCE_STYLE);
 	yaml_emitter_emit_or_die(emitter, &event);
 
-	for_each_marker(m) {
+	for_each_marker(prop->val, m) {
 		int chunk_len;
 		char *data = &prop->val.val[m->offset];
 
 		if (m->type < TYPE_UINT8)
 			continue;
 
-		chunk_len = type_marker_length(m) ? : len;
+		chunk_len = type_marker_length(prop->val, m) ? : len;
 		assert(chunk_len > 0);
 		len -= chunk_len;
 
 		switch(m->type) {
 		case TYPE_UINT16:
-			yaml_propval_int(emitter, markers, data, m->offset, chunk_len, 2);
+			yaml_propval_int(emitter, prop->val, data, m->offset, chunk_len, 2);
 			break;
 		case TYPE_UINT32:
-			yaml_propval_int(emitter, markers, data, m->offset, chunk_len, 4);
+			yaml_propval_int(emitter, prop->val, data, m->offset, chunk_len, 4);
 			break;
 		case TYPE_UINT64:
-			yaml_propval_int(emitter, markers, data, m->offset, chunk_len, 8);
+			yaml_propval_int(emitter, prop->val, data, m->offset, chunk_len, 8);
 			break;
 		case TYPE_STRING:
 			yaml_propval_string(emitter, data, chunk_len);
 			break;
 		default:
-			yaml_propval_int(emitter, markers, data, m->offset, chunk_len, 1);
+			yaml_propval_int(emitter, prop->val, data, m->offset, chunk_len, 1);
 			break;
 		}
 	}